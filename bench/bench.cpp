@@ -0,0 +1,900 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "../src/audio/async_file.hpp"
+#include "../src/audio/buffer.hpp"
+#include "../src/audio/buffer_pool.hpp"
+#include "../src/audio/connection.hpp"
+#include "../src/audio/graph.hpp"
+#include "../src/audio/kernels.hpp"
+#include "../src/audio/loudness.hpp"
+#include "../src/audio/process.hpp"
+#include "../src/audio/stage.hpp"
+#include "../src/executor.hpp"
+#include "../src/logger.hpp"
+#include "../src/semaphore.hpp"
+
+using std::function;
+using std::int64_t;
+using std::pair;
+using std::string;
+using std::to_string;
+using std::uint64_t;
+using std::unique_ptr;
+using std::vector;
+using fu::audio::async_reader;
+using fu::audio::buffer;
+using fu::audio::buffer_pool;
+using fu::audio::connection;
+using fu::audio::graph;
+using fu::audio::loudness_meter;
+using fu::audio::process_sink;
+using fu::executor;
+using fu::logger;
+using fu::semaphore;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                          fu-bench                                             */
+/* --------------------------------------------------------------------------------------------- */
+
+/*
+ * Microbenchmarks of the hot paths of fu, and synthetic pipelines, reported as
+ * JSON on standard output (progress goes to stderr), so that runs of different
+ * commits can be diffed. Every benchmark runs a fixed number of operations, once
+ * to warm up then --repeat times, and reports the median, minimum and maximum
+ * time per operation. Threads of multi-threaded benchmarks are pinned to the
+ * cores of each pairing available: the same core, two adjacent ones, and two
+ * far apart.
+ */
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Configurable constants                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+#define DEFAULT_REPEAT   5
+#define SAMPLE_RATE      48000
+#define CHANNELS         2
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                            Harness                                            */
+/* --------------------------------------------------------------------------------------------- */
+
+namespace {
+
+    /**
+     * Measurements of a benchmark.
+     */
+    struct result {
+        string                         name;
+        vector<pair<string, string>>   params;
+        uint64_t                       ops;
+        vector<double>                 runs;       // ns per op, one per run
+        vector<pair<string, double>>   extra;      // e.g. frames per second, allocations per op
+    };
+
+    /**
+     * Command line options.
+     */
+    struct options {
+        string    filter;
+        unsigned  repeat = DEFAULT_REPEAT;
+        double    scale  = 1.0;
+        string    output;
+        bool      list   = false;
+    };
+
+    /**
+     * Pair of cores threads are pinned to.
+     */
+    struct pairing {
+        const char*  name;
+        int          first;
+        int          second;
+    };
+
+    /**
+     * Pins the calling thread to a core while alive.
+     */
+    class pinned
+    {
+        cpu_set_t  _saved;
+        bool       _restore;
+
+    public:
+        explicit pinned(int cpu)
+        {
+            _restore = pthread_getaffinity_np(pthread_self(), sizeof(_saved), &_saved) == 0;
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+
+        ~pinned()
+        {
+            if (_restore)
+                pthread_setaffinity_np(pthread_self(), sizeof(_saved), &_saved);
+        }
+    };
+
+    /**
+     * Runs benchmarks and collects their results.
+     */
+    class suite
+    {
+        options         _options;
+        vector<result>  _results;
+
+    public:
+        explicit suite(const options& opt)
+            : _options(opt)
+        { }
+
+        /**
+         * Returns whether a benchmark is selected by --filter.
+         */
+        bool selected(const string& name) const
+        {
+            return name.find(_options.filter) != string::npos;
+        }
+
+        /**
+         * Scales a number of operations by --scale.
+         */
+        uint64_t ops(uint64_t n) const
+        {
+            return std::max<uint64_t>(1, static_cast<uint64_t>(n * _options.scale));
+        }
+
+        /**
+         * Runs a benchmark: body runs ops operations and returns the ns they took.
+         * Returns the result, so that extra figures can be added to it.
+         */
+        result* run(const string& name, const vector<pair<string, string>>& params, uint64_t ops,
+                    const function<int64_t(uint64_t)>& body)
+        {
+            string full = name;
+            for (auto& p: params)
+                full += "/" + p.first + "=" + p.second;
+
+            if (_options.list) {
+                std::cerr << full << std::endl;
+                return nullptr;
+            }
+            if (!selected(full))
+                return nullptr;
+
+            std::cerr << full << "..." << std::flush;
+
+            result r;
+            r.name   = name;
+            r.params = params;
+            r.ops    = ops;
+
+            body(ops);      // warm up
+            for (unsigned i = 0; i < _options.repeat; i++)
+                r.runs.push_back(static_cast<double>(body(ops)) / ops);
+
+            vector<double> sorted(r.runs);
+            std::sort(sorted.begin(), sorted.end());
+            std::cerr << " " << sorted[sorted.size() / 2] << " ns/op" << std::endl;
+
+            _results.push_back(std::move(r));
+            return &_results.back();
+        }
+
+        /**
+         * Writes every result as JSON.
+         */
+        void write(std::ostream& os) const;
+    };
+
+    /**
+     * Returns the time in ns since the steady clock epoch.
+     */
+    int64_t now()
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::nanoseconds;
+        using std::chrono::steady_clock;
+
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * Quotes a string for JSON.
+     */
+    string quote(const string& s)
+    {
+        string out = "\"";
+        for (char c: s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char tmp[8];
+                std::snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+                out += tmp;
+            } else {
+                out += c;
+            }
+        }
+        return out + "\"";
+    }
+
+    /**
+     * Formats a number for JSON.
+     */
+    string number(double x)
+    {
+        if (!std::isfinite(x))
+            return "null";
+        char tmp[32];
+        std::snprintf(tmp, sizeof(tmp), "%.6g", x);
+        return tmp;
+    }
+
+    void suite::write(std::ostream& os) const
+    {
+        os << "{\n";
+        os << "  \"schema\": 1,\n";
+        os << "  \"host\": {\n";
+        os << "    \"cpus\": " << std::thread::hardware_concurrency() << ",\n";
+        os << "    \"compiler\": " << quote(__VERSION__) << ",\n";
+#ifdef NDEBUG
+        os << "    \"assertions\": false\n";
+#else
+        os << "    \"assertions\": true\n";
+#endif
+        os << "  },\n";
+        os << "  \"repeat\": " << _options.repeat << ",\n";
+        os << "  \"scale\": " << number(_options.scale) << ",\n";
+        os << "  \"results\": [";
+
+        for (size_t i = 0; i < _results.size(); i++) {
+            const result& r = _results[i];
+
+            vector<double> sorted(r.runs);
+            std::sort(sorted.begin(), sorted.end());
+
+            os << (i > 0 ? ",\n" : "\n") << "    {\n";
+            os << "      \"name\": " << quote(r.name) << ",\n";
+            os << "      \"params\": {";
+            for (size_t k = 0; k < r.params.size(); k++)
+                os << (k > 0 ? ", " : "") << quote(r.params[k].first) << ": " << quote(r.params[k].second);
+            os << "},\n";
+            os << "      \"ops\": " << r.ops << ",\n";
+            os << "      \"unit\": \"ns/op\",\n";
+            os << "      \"median\": " << number(sorted[sorted.size() / 2]) << ",\n";
+            os << "      \"min\": " << number(sorted.front()) << ",\n";
+            os << "      \"max\": " << number(sorted.back()) << ",\n";
+            os << "      \"runs\": [";
+            for (size_t k = 0; k < r.runs.size(); k++)
+                os << (k > 0 ? ", " : "") << number(r.runs[k]);
+            os << "]";
+            for (auto& e: r.extra)
+                os << ",\n      " << quote(e.first) << ": " << number(e.second);
+            os << "\n    }";
+        }
+
+        os << "\n  ]\n}\n";
+    }
+
+    /**
+     * Returns the core pairings available on this machine.
+     */
+    vector<pairing> pairings()
+    {
+        const int cpus = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+        vector<pairing> list;
+        list.push_back(pairing { "same", 0, 0 });
+        if (cpus >= 2)
+            list.push_back(pairing { "adjacent", 0, 1 });
+        if (cpus >= 4)
+            list.push_back(pairing { "far", 0, cpus / 2 });
+        return list;
+    }
+
+    /**
+     * Median of the runs of a result, in ns per op.
+     */
+    double median(const result& r)
+    {
+        vector<double> sorted(r.runs);
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[sorted.size() / 2];
+    }
+
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                           semaphore                                           */
+/* --------------------------------------------------------------------------------------------- */
+
+/**
+ * Round trip between two threads through a pair of semaphores.
+ */
+static void __bench_semaphore(suite& s)
+{
+    for (const pairing& p: pairings()) {
+        s.run("semaphore.ping_pong", { { "cores", p.name } }, s.ops(100000), [&p](uint64_t ops) {
+            semaphore ping, pong;
+
+            std::thread peer([&] {
+                pinned pin(p.second);
+                for (uint64_t i = 0; i < ops; i++) {
+                    ping.wait();
+                    pong.post();
+                }
+            });
+
+            pinned pin(p.first);
+            const int64_t start = now();
+            for (uint64_t i = 0; i < ops; i++) {
+                ping.post();
+                pong.wait();
+            }
+            const int64_t elapsed = now() - start;
+
+            peer.join();
+            return elapsed;
+        });
+    }
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                       audio::connection                                       */
+/* --------------------------------------------------------------------------------------------- */
+
+/**
+ * Buffers sent from one thread to another, per depth, block size and pairing.
+ */
+static void __bench_connection(suite& s)
+{
+    static const unsigned depths[] = { 0, 4 };
+    static const unsigned blocks[] = { 64, 1024, 8192 };
+
+    for (unsigned depth: depths) {
+        for (unsigned block: blocks) {
+            for (const pairing& p: pairings()) {
+                result* r = s.run("connection.send_recv",
+                                  { { "depth", to_string(depth) }, { "block", to_string(block) },
+                                    { "cores", p.name } },
+                                  s.ops(depth > 0 ? 200000 : 50000), [&](uint64_t ops) {
+                    connection conn(depth);
+
+                    std::thread receiver([&] {
+                        pinned pin(p.second);
+                        buffer buf;
+                        while (conn.recv(buf))
+                            ;
+                    });
+
+                    pinned pin(p.first);
+                    buffer buf;
+                    const int64_t start = now();
+                    for (uint64_t i = 0; i < ops; i++) {
+                        buf.reset(block, CHANNELS, SAMPLE_RATE);
+                        conn.send(buf);
+                    }
+                    conn.close();
+                    receiver.join();
+                    return now() - start;
+                });
+
+                if (r != nullptr)
+                    r->extra.emplace_back("frames_per_s", block * 1e9 / median(*r));
+            }
+        }
+    }
+
+    // Small blocks moved in batches; reported per buffer.
+    static const unsigned batches[] = { 1, 16 };
+
+    for (unsigned depth: depths) {
+        for (unsigned batch: batches) {
+            for (const pairing& p: pairings()) {
+                s.run("connection.send_recv_batch",
+                      { { "depth", to_string(depth) }, { "block", "64" }, { "batch", to_string(batch) },
+                        { "cores", p.name } },
+                      s.ops(320000), [&](uint64_t ops) {
+                    connection conn(depth > 0 ? std::max(depth, batch) : 0);
+
+                    std::thread receiver([&] {
+                        pinned pin(p.second);
+                        vector<buffer> bufs(batch);
+                        while (conn.recv(bufs.data(), batch) > 0)
+                            ;
+                    });
+
+                    pinned pin(p.first);
+                    vector<buffer> bufs(batch);
+                    const int64_t start = now();
+                    for (uint64_t i = 0; i < ops; i += batch) {
+                        for (auto& buf: bufs)
+                            buf.reset(64, CHANNELS, SAMPLE_RATE);
+                        conn.send(bufs.data(), batch);
+                    }
+                    conn.close();
+                    receiver.join();
+                    return now() - start;
+                });
+            }
+        }
+    }
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                         audio::buffer                                         */
+/* --------------------------------------------------------------------------------------------- */
+
+/**
+ * buffer::reset with constant and alternating sizes, counting blocks the pool
+ * had to get from the system.
+ */
+static void __bench_buffer(suite& s)
+{
+    struct pattern {
+        const char*  name;
+        unsigned     sizes[2];
+    };
+
+    static const pattern patterns[] = {
+        { "constant",     { 1024, 1024 } },
+        { "alternating",  { 256, 8192 } },
+        { "growing",      { 0, 0 } },         // every size from 1 to 65536 frames, in turn
+    };
+
+    for (const pattern& pat: patterns) {
+        unsigned long misses = 0;
+        result* r = s.run("buffer.reset", { { "sizes", pat.name } }, s.ops(1000000), [&](uint64_t ops) {
+            buffer_pool pool;
+            const unsigned long before = pool.statistics().misses;
+            int64_t elapsed;
+            {
+                buffer buf(pool);
+                const int64_t start = now();
+                for (uint64_t i = 0; i < ops; i++) {
+                    const unsigned frames = pat.sizes[0] == 0 ? static_cast<unsigned>(i % 65536) + 1
+                                                              : pat.sizes[i & 1];
+                    buf.reset(frames, CHANNELS, SAMPLE_RATE);
+                }
+                elapsed = now() - start;
+            }
+            misses = pool.statistics().misses - before;
+            return elapsed;
+        });
+
+        if (r != nullptr)
+            r->extra.emplace_back("system_allocations", misses);
+    }
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                          logger_line                                          */
+/* --------------------------------------------------------------------------------------------- */
+
+/**
+ * Redirects stderr to /dev/null while alive.
+ */
+class quiet_stderr
+{
+    int _saved;
+
+public:
+    quiet_stderr()
+    {
+        std::cerr.flush();
+        std::clog.flush();
+        _saved = dup(STDERR_FILENO);
+        const int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+
+    ~quiet_stderr()
+    {
+        std::clog.flush();
+        dup2(_saved, STDERR_FILENO);
+        close(_saved);
+    }
+};
+
+/**
+ * FU_LOG at a suppressed level, and at a visible one through each output.
+ */
+static void __bench_logger(suite& s)
+{
+    static const logger bench_log("bench");
+
+    const fu::logger_level saved = logger::level();
+    logger::level(fu::WARN);
+
+    s.run("logger.line", { { "output", "suppressed" } }, s.ops(100000000), [](uint64_t ops) {
+        const int64_t start = now();
+        for (uint64_t i = 0; i < ops; i++)
+            FU_LOG(bench_log, fu::DEBUG) << "value " << i;
+        return now() - start;
+    });
+
+    s.run("logger.line", { { "output", "sync" } }, s.ops(200000), [](uint64_t ops) {
+        quiet_stderr quiet;
+        const int64_t start = now();
+        for (uint64_t i = 0; i < ops; i++)
+            FU_LOG(bench_log, fu::WARN) << "value " << i;
+        return now() - start;
+    });
+
+    s.run("logger.line", { { "output", "async" } }, s.ops(200000), [](uint64_t ops) {
+        quiet_stderr quiet;
+        logger::async(fu::DROP_ON_OVERFLOW, 65536);
+        const int64_t start = now();
+        for (uint64_t i = 0; i < ops; i++)
+            FU_LOG(bench_log, fu::WARN) << "value " << i;
+        const int64_t elapsed = now() - start;
+        logger::sync();
+        return elapsed;
+    });
+
+    const char* tmp  = std::getenv("TMPDIR");
+    const string path = string(tmp != nullptr ? tmp : "/tmp") + "/fu-bench-" + to_string(getpid()) + ".fulog";
+
+    s.run("logger.line", { { "output", "binary" } }, s.ops(1000000), [&path](uint64_t ops) {
+        logger::binary_file(path.c_str());
+        const int64_t start = now();
+        for (uint64_t i = 0; i < ops; i++)
+            FU_LOG(bench_log, fu::WARN) << "value " << i;
+        const int64_t elapsed = now() - start;
+        logger::close_binary_file();
+        unlink(path.c_str());
+        return elapsed;
+    });
+
+    logger::level(saved);
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                      Synthetic pipelines                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+namespace {
+
+    /**
+     * Sine tone of a given number of frames.
+     */
+    class tone : public fu::audio::source
+    {
+        uint64_t  _left;
+        unsigned  _block;
+        double    _phase;
+
+    public:
+        tone(uint64_t frames, unsigned block)
+            : _left(frames), _block(block), _phase(0)
+        { }
+
+        bool produce(buffer& buf) override
+        {
+            if (_left == 0)
+                return false;
+
+            const unsigned frames = static_cast<unsigned>(std::min<uint64_t>(_left, _block));
+            buf.reset(frames, CHANNELS, SAMPLE_RATE);
+
+            const double step = 2 * M_PI * 440.0 / SAMPLE_RATE;
+            float*       out  = buf.data();
+            for (unsigned i = 0; i < frames; i++) {
+                const float x = static_cast<float>(0.5 * std::sin(_phase));
+                for (unsigned c = 0; c < CHANNELS; c++)
+                    *out++ = x;
+                _phase += step;
+            }
+            _phase = std::fmod(_phase, 2 * M_PI);
+
+            _left -= frames;
+            if (_left == 0)
+                buf.finish();
+            return true;
+        }
+    };
+
+    /**
+     * Copies its input with a gain.
+     */
+    class gain : public fu::audio::transform
+    {
+    public:
+        void process(const buffer& in, buffer& out) override
+        {
+            out.reset(in.frames(), in.channels(), in.sample_rate(), in.layout());
+            std::memcpy(out.data(), in.cdata(), sizeof(float) * in.frames() * in.channels());
+            fu::audio::kernels::gain(out, 0.99f);
+        }
+    };
+
+    /**
+     * Discards its input.
+     */
+    class null_sink : public fu::audio::sink
+    {
+    public:
+        void consume(const buffer&) override { }
+    };
+
+}
+
+/**
+ * Raw float file read back whole through an async_reader, at a few queue
+ * depths; reported per frame, with the throughput in MB/s.
+ */
+static void __bench_file(suite& s)
+{
+    static const unsigned depths[] = { 1, 4, 16 };
+    static const unsigned block    = 65536;
+
+    const char* tmp  = std::getenv("TMPDIR");
+    const string path = string(tmp != nullptr ? tmp : "/tmp") + "/fu-bench-" + to_string(getpid()) + ".raw";
+
+    // Reads come from the page cache, so this measures the cost of the queue, not
+    // of the device.
+    for (unsigned depth: depths) {
+        string backend;
+        result* r = s.run("file.read", { { "depth", to_string(depth) } }, s.ops(SAMPLE_RATE * 600),
+                          [&](uint64_t frames) {
+            {
+                vector<float> samples(static_cast<size_t>(block) * CHANNELS, 0.25f);
+                std::FILE* f = std::fopen(path.c_str(), "wb");
+                for (uint64_t done = 0; f != nullptr && done < frames; done += block) {
+                    const uint64_t n = std::min<uint64_t>(block, frames - done);
+                    std::fwrite(samples.data(), sizeof(float) * CHANNELS, n, f);
+                }
+                if (f != nullptr)
+                    std::fclose(f);
+            }
+
+            const int64_t start = now();
+            {
+                async_reader reader(path, CHANNELS, SAMPLE_RATE, block, depth);
+                buffer buf;
+                while (reader.produce(buf) && !buf.finished()) { }
+                backend = reader.uring() ? "io_uring" : "threads";
+            }
+            const int64_t elapsed = now() - start;
+            unlink(path.c_str());
+            return elapsed;
+        });
+
+        if (r != nullptr) {
+            r->params.emplace_back("backend", backend);
+            r->extra.emplace_back("mb_per_s", 1e3 * sizeof(float) * CHANNELS / median(*r));
+        }
+    }
+}
+
+/**
+ * Sine blocks of 100 ms fed to a loudness_meter, in stereo and 5.1; reported
+ * per frame, with the speed relative to real time.
+ */
+static void __bench_loudness(suite& s)
+{
+    static const unsigned channels[] = { 2, 6 };
+    static const unsigned block      = 4800;
+
+    for (unsigned n: channels) {
+        result* r = s.run("loudness.consume", { { "channels", to_string(n) } }, s.ops(SAMPLE_RATE * 600),
+                          [&](uint64_t frames) {
+            buffer buf(block, n, SAMPLE_RATE);
+            for (unsigned i = 0; i < block * n; i++)
+                buf.data()[i] = 0.25f * std::sin(0.01f * i);
+
+            loudness_meter meter;
+            const int64_t start = now();
+            for (uint64_t done = 0; done < frames; done += block)
+                meter.consume(buf);
+            return now() - start;
+        });
+
+        if (r != nullptr)
+            r->extra.emplace_back("realtime_factor", 1e9 / SAMPLE_RATE / median(*r));
+    }
+}
+
+/**
+ * Float blocks fed to a process_sink whose encoder discards them, written or
+ * spliced through the ring, at two block sizes; reported per frame, with the
+ * throughput in MB/s.
+ */
+static void __bench_process(suite& s)
+{
+    static const unsigned blocks[] = { 4096, 65536 };
+
+    for (unsigned block: blocks) {
+        for (int splice = 0; splice < 2; splice++) {
+            result* r = s.run("process.sink", { { "block", to_string(block) },
+                                                { "mode", splice ? "vmsplice" : "write" } },
+                              s.ops(SAMPLE_RATE * 600), [&](uint64_t frames) {
+                buffer buf(block, CHANNELS, SAMPLE_RATE);
+                for (unsigned i = 0; i < block * CHANNELS; i++)
+                    buf.data()[i] = 0.25f;
+
+                process_sink sink({ "sh", "-c", "cat > /dev/null" });
+                sink.splice(splice != 0);
+
+                const int64_t start = now();
+                for (uint64_t done = 0; done < frames; done += block) {
+                    if (done + block >= frames)
+                        buf.finish();
+                    sink.consume(buf);
+                }
+                return now() - start;
+            });
+
+            if (r != nullptr)
+                r->extra.emplace_back("mb_per_s", 1e3 * sizeof(float) * CHANNELS / median(*r));
+        }
+    }
+}
+
+/**
+ * Tone generator, then a chain of gain stages, then a null sink, each on a thread
+ * of its own or as tasks on an executor; reported per frame.
+ */
+static void __bench_pipeline(suite& s)
+{
+    static const unsigned stages[] = { 1, 4, 16 };
+    static const unsigned block    = 1024;
+
+    for (int on_executor = 0; on_executor < 2; on_executor++) {
+        for (unsigned n: stages) {
+            result* r = s.run("pipeline.tone_gain_null",
+                              { { "stages", to_string(n) }, { "run", on_executor ? "executor" : "threads" } },
+                              s.ops(SAMPLE_RATE * 60), [&](uint64_t frames) {
+                tone       source(frames, block);
+                vector<unique_ptr<gain>> gains;
+                null_sink  sink;
+
+                graph g;
+                graph::node_id last = g.add(source);
+                for (unsigned i = 0; i < n; i++) {
+                    gains.emplace_back(new gain);
+                    const graph::node_id next = g.add(*gains.back());
+                    g.connect(last, next, 4);
+                    last = next;
+                }
+                g.connect(last, g.add(sink), 4);
+
+                const int64_t start = now();
+                if (on_executor) {
+                    executor ex;
+                    g.run(ex);
+                } else {
+                    g.run();
+                }
+                return now() - start;
+            });
+
+            if (r != nullptr)
+                r->extra.emplace_back("realtime_factor", 1e9 / SAMPLE_RATE / median(*r));
+        }
+    }
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                             main                                              */
+/* --------------------------------------------------------------------------------------------- */
+
+static int __usage(const char* argv0)
+{
+    std::cerr << "usage: " << argv0 << " [--filter TEXT] [--repeat N] [--scale X] [--output FILE] [--list]\n"
+              << "  --filter TEXT   only run benchmarks whose name contains TEXT\n"
+              << "  --repeat N      measured runs per benchmark (default " << DEFAULT_REPEAT << ")\n"
+              << "  --scale X       multiply the number of operations by X\n"
+              << "  --output FILE   write JSON to FILE instead of standard output\n"
+              << "  --list          list benchmarks without running them" << std::endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    options opt;
+
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        const bool   has_value = i + 1 < argc;
+
+        if (arg == "--filter" && has_value) {
+            opt.filter = argv[++i];
+        } else if (arg == "--repeat" && has_value) {
+            opt.repeat = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--scale" && has_value) {
+            opt.scale = std::atof(argv[++i]);
+            if (!(opt.scale > 0))
+                return __usage(argv[0]);
+        } else if (arg == "--output" && has_value) {
+            opt.output = argv[++i];
+        } else if (arg == "--list") {
+            opt.list = true;
+        } else {
+            return __usage(argv[0]);
+        }
+    }
+
+    suite s(opt);
+
+    __bench_semaphore(s);
+    __bench_connection(s);
+    __bench_buffer(s);
+    __bench_logger(s);
+    __bench_file(s);
+    __bench_loudness(s);
+    __bench_process(s);
+    __bench_pipeline(s);
+
+    if (opt.list)
+        return 0;
+
+    if (opt.output.empty()) {
+        s.write(std::cout);
+    } else {
+        std::ofstream out(opt.output);
+        s.write(out);
+        if (!out) {
+            std::cerr << "fu-bench: cannot write " << opt.output << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
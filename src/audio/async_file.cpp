@@ -0,0 +1,268 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../logger.hpp"
+#include "async_file.hpp"
+#include "kernels.hpp"
+
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using fu::io_queue;
+using fu::audio::async_reader;
+using fu::audio::async_writer;
+using fu::audio::buffer;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("async_file");
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                    fu::audio::async_reader                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+async_reader::async_reader(const string& path, unsigned channels, unsigned sample_rate,
+                           unsigned block_frames, unsigned depth, uint64_t offset)
+    : _path(path),
+      _fd(-1),
+      _channels(channels),
+      _sample_rate(sample_rate),
+      _block_frames(block_frames),
+      _next(offset),
+      _end(offset),
+      _slots(depth),
+      _head(0),
+      _busy(0),
+      _queue(depth)
+{
+    if (channels == 0 || sample_rate == 0 || block_frames == 0)
+        throw std::invalid_argument("audio::async_reader::async_reader");
+
+    _fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (_fd < 0)
+        throw runtime_error(path + ": " + strerror(errno));
+
+    struct stat st;
+    if (fstat(_fd, &st) < 0) {
+        const int error = errno;
+        ::close(_fd);
+        throw runtime_error(path + ": " + strerror(error));
+    }
+
+    // A trailing partial frame is ignored.
+    const uint64_t frame = sizeof(float) * channels;
+    const uint64_t size  = static_cast<uint64_t>(st.st_size);
+    if (size > offset)
+        _end = offset + (size - offset) / frame * frame;
+
+    posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    FU_LOG(__log, fu::DEBUG) << "reading " << path << ": " << channels << " channels, "
+                     << sample_rate << " Hz, " << (_end - offset) / frame << " frames, "
+                     << depth << " reads in flight on " << (uring() ? "io_uring" : "threads");
+}
+
+async_reader::~async_reader()
+{
+    _queue.drain();
+    ::close(_fd);
+}
+
+void async_reader::fill()
+{
+    const size_t frame = sizeof(float) * _channels;
+
+    while (_busy < _slots.size() && _next < _end) {
+        const unsigned index = (_head + _busy) % _slots.size();
+        slot& s = _slots[index];
+
+        s.size   = static_cast<size_t>(std::min<uint64_t>(_block_frames * frame, _end - _next));
+        s.offset = _next;
+        s.done   = 0;
+        s.buf.reset(static_cast<unsigned>(s.size / frame), _channels, _sample_rate);
+
+        _queue.read(_fd, s.buf.data(), s.size, s.offset, index);
+        _next += s.size;
+        _busy++;
+    }
+
+    _queue.submit();
+}
+
+void async_reader::complete()
+{
+    const io_queue::completion c = _queue.wait();
+    slot& s = _slots[c.tag];
+
+    if (c.result < 0)
+        throw runtime_error(_path + ": " + strerror(static_cast<int>(-c.result)));
+    if (c.result == 0)
+        throw runtime_error(_path + ": unexpected end of file");
+
+    s.done += static_cast<size_t>(c.result);
+    if (s.done < s.size) {
+        _queue.read(_fd, reinterpret_cast<char*>(s.buf.data()) + s.done, s.size - s.done,
+                    s.offset + s.done, c.tag);
+        _queue.submit();
+    }
+}
+
+__attribute__((hot))
+bool async_reader::produce(buffer& buf)
+{
+    if (__builtin_expect(_busy == 0, 0)) {
+        fill();
+        if (_busy == 0)
+            return false;
+    }
+
+    slot& s = _slots[_head];
+    while (s.done < s.size)
+        complete();
+
+    const bool last = s.offset + s.size >= _end;
+
+    buf.swap(s.buf);
+    _head = (_head + 1) % _slots.size();
+    _busy--;
+
+    // The slot just freed reads ahead into the storage buf came with.
+    fill();
+
+    if (last)
+        buf.finish();
+
+    return true;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                    fu::audio::async_writer                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+async_writer::async_writer(const string& path, unsigned depth)
+    : _path(path),
+      _fd(-1),
+      _offset(0),
+      _slots(depth),
+      _queue(depth)
+{
+    for (unsigned i = depth; i-- > 0; )
+        _idle.push_back(i);
+
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (_fd < 0)
+        throw runtime_error(path + ": " + strerror(errno));
+
+    FU_LOG(__log, fu::DEBUG) << "writing " << path << ": " << depth << " writes in flight on "
+                     << (uring() ? "io_uring" : "threads");
+}
+
+async_writer::~async_writer()
+{
+    if (_fd >= 0) {
+        _queue.drain();
+        ::close(_fd);
+    }
+}
+
+void async_writer::complete()
+{
+    const io_queue::completion c = _queue.wait();
+    slot& s = _slots[c.tag];
+
+    if (c.result < 0)
+        throw runtime_error(_path + ": " + strerror(static_cast<int>(-c.result)));
+    if (c.result == 0)
+        throw runtime_error(_path + ": nothing written");
+
+    s.done += static_cast<size_t>(c.result);
+    if (s.done < s.size) {
+        _queue.write(_fd, reinterpret_cast<const char*>(s.buf.cdata()) + s.done,
+                     s.size - s.done, s.offset + s.done, c.tag);
+        _queue.submit();
+    } else {
+        _idle.push_back(static_cast<unsigned>(c.tag));
+    }
+}
+
+void async_writer::close()
+{
+    while (_queue.pending() > 0)
+        complete();
+
+    const int fd = _fd;
+    _fd = -1;
+    if (::close(fd) < 0)
+        throw runtime_error(_path + ": " + strerror(errno));
+
+    FU_LOG(__log, fu::DEBUG) << "wrote " << _path << ": " << _offset << " bytes";
+}
+
+__attribute__((hot))
+void async_writer::consume(const buffer& buf)
+{
+    if (__builtin_expect(_fd < 0, 0))
+        return; // already closed after the last buffer
+
+    while (_idle.empty())
+        complete();
+
+    const unsigned index = _idle.back();
+    slot& s = _slots[index];
+
+    s.size   = static_cast<size_t>(buf.frames()) * buf.channels() * sizeof(float);
+    s.offset = _offset;
+    s.done   = 0;
+
+    if (s.size > 0) {
+        if (buf.layout() == PLANAR) {
+            kernels::interleave(buf, s.buf);
+        } else {
+            s.buf.reset(buf.frames(), buf.channels(), buf.sample_rate());
+            memcpy(s.buf.data(), buf.cdata(), s.size);
+        }
+
+        _idle.pop_back();
+        _queue.write(_fd, s.buf.cdata(), s.size, s.offset, index);
+        _queue.submit();
+        _offset += s.size;
+    }
+
+    if (buf.finished())
+        close();
+}
@@ -0,0 +1,193 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef U865BD2F5_768B_4C9A_8F90_DF9E530DEE96
+#define U865BD2F5_768B_4C9A_8F90_DF9E530DEE96
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../io_queue.hpp"
+#include "buffer.hpp"
+#include "stage.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                 fu::audio::async_reader                               */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Source stage reading raw interleaved 32-bit float samples, in host byte
+         * order, through a fu::io_queue: up to depth reads of block_frames frames
+         * are kept in flight ahead of the consumer, so the stage thread does not
+         * wait on the disk unless the pipeline outruns it.
+         *
+         * Reads land straight in pool-backed buffers, which are swapped out to the
+         * pipeline whole; the storage sent back is used for the next read.
+         */
+        class async_reader : public source
+        {
+            struct slot {
+                buffer         buf;
+                std::uint64_t  offset;
+                std::size_t    size;
+                std::size_t    done;
+            };
+
+            std::string        _path;
+            int                _fd;
+            unsigned           _channels;
+            unsigned           _sample_rate;
+            unsigned           _block_frames;
+            std::uint64_t      _next;       // offset of the next read
+            std::uint64_t      _end;        // offset past the last whole frame
+            std::vector<slot>  _slots;
+            unsigned           _head;       // slot of the next block to produce
+            unsigned           _busy;       // slots read or being read, from _head on
+            io_queue           _queue;      // after _slots, so it drains before they go
+
+            void fill();
+            void complete();
+
+        public:
+            /**
+             * Opens a file for reading.
+             *
+             * @param path          path of the file
+             * @param channels      number of channels
+             * @param sample_rate   sample rate (Hz)
+             * @param block_frames  number of frames per buffer, and per read
+             * @param depth         number of reads in flight
+             * @param offset        bytes to skip at the start, e.g. a header
+             *
+             * @throws std::runtime_error if the file cannot be opened,
+             *         std::invalid_argument if a parameter is zero.
+             */
+            async_reader(const std::string& path, unsigned channels, unsigned sample_rate,
+                         unsigned block_frames = 65536, unsigned depth = 4,
+                         std::uint64_t offset = 0);
+
+            async_reader(const async_reader&) = delete;
+            async_reader& operator=(const async_reader&) = delete;
+
+            /**
+             * Waits for reads in flight, then closes the file.
+             */
+            virtual ~async_reader();
+
+            /**
+             * Returns true if reads are run by io_uring rather than threads.
+             */
+            __attribute__((always_inline))
+            inline bool uring() const
+            {
+                return _queue.uring();
+            }
+
+            /**
+             * Swaps the next block into buf, waiting for its read if needed, then
+             * reads ahead into the storage buf held. The last block is marked as
+             * finished.
+             *
+             * @throws std::runtime_error on read errors, or if the file shrinks.
+             */
+            virtual bool produce(buffer& buf) override;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                 fu::audio::async_writer                               */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Sink stage writing raw interleaved 32-bit float samples through a
+         * fu::io_queue. Each block is copied (planar ones interleaved) into one of
+         * depth pool-backed buffers and written from there, so the stage only
+         * waits on the disk when depth writes are in flight already.
+         */
+        class async_writer : public sink
+        {
+            struct slot {
+                buffer         buf;
+                std::uint64_t  offset;
+                std::size_t    size;
+                std::size_t    done;
+            };
+
+            std::string            _path;
+            int                    _fd;
+            std::uint64_t          _offset;     // offset of the next write
+            std::vector<slot>      _slots;
+            std::vector<unsigned>  _idle;       // slots free for the next block
+            io_queue               _queue;      // after _slots, so it drains before they go
+
+            void complete();
+            void close();
+
+        public:
+            /**
+             * Creates or truncates a file for writing.
+             *
+             * @param path   path of the file
+             * @param depth  number of writes in flight
+             *
+             * @throws std::runtime_error if the file cannot be created,
+             *         std::invalid_argument if depth is zero.
+             */
+            explicit async_writer(const std::string& path, unsigned depth = 4);
+
+            async_writer(const async_writer&) = delete;
+            async_writer& operator=(const async_writer&) = delete;
+
+            /**
+             * Waits for writes in flight and closes the file, if still open.
+             */
+            virtual ~async_writer();
+
+            /**
+             * Returns true if writes are run by io_uring rather than threads.
+             */
+            __attribute__((always_inline))
+            inline bool uring() const
+            {
+                return _queue.uring();
+            }
+
+            /**
+             * Queues a block for writing; after the last one, waits for every write
+             * and closes the file.
+             *
+             * @throws std::runtime_error on write errors.
+             */
+            virtual void consume(const buffer& buf) override;
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
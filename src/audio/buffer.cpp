@@ -32,32 +32,53 @@ using fu::audio::buffer;
 /* --------------------------------------------------------------------------------------------- */
 
 buffer::buffer(const buffer& other)
-    : _capacity(other._frames * other._channels),
-      _frames(other._frames),
-      _channels(other._channels),
-      _sample_rate(other._sample_rate)
+    : _data(nullptr),
+      _pool(other._pool),
+      _capacity(0),
+      _frames(0),
+      _channels(0),
+      _sample_rate(0),
+      _stride(0),
+      _layout(INTERLEAVED),
+      _finished(false),
+      _borrowed(false)
 {
-    _data = new float[_capacity];
-    __builtin_memcpy(_data, other._data, _capacity * sizeof(float));
+    // Pool storage and its rounded stride, whatever the layout of a borrowed original.
+    assign(other);
 }
 
 buffer::buffer(buffer&& other) noexcept
     : _data(other._data),
+      _pool(other._pool),
       _capacity(other._capacity),
       _frames(other._frames),
       _channels(other._channels),
-      _sample_rate(other._sample_rate)
+      _sample_rate(other._sample_rate),
+      _stride(other._stride),
+      _layout(other._layout),
+      _finished(other._finished),
+      _borrowed(other._borrowed)
 {
     other._data        = nullptr;
     other._capacity    = 0;
     other._frames      = 0;
     other._channels    = 0;
     other._sample_rate = 0;
+    other._stride      = 0;
+    other._finished    = false;
+    other._borrowed    = false;
+}
+
+buffer& buffer::operator=(buffer&& other) noexcept
+{
+    swap(other);
+    return *this;
 }
 
 buffer::~buffer()
 {
-    delete _data;
+    if (!_borrowed)
+        _pool->deallocate(_data, _capacity);
 }
 
 
@@ -65,16 +86,77 @@ buffer::~buffer()
 /*                                     Misc. member functions                                    */
 /* --------------------------------------------------------------------------------------------- */
 
-void buffer::reset(unsigned frames, unsigned channels, unsigned sample_rate)
+void buffer::reset(unsigned frames, unsigned channels, unsigned sample_rate, audio::layout layout)
+{
+    // Planar channels start on cache line boundaries.
+    const unsigned stride = layout == PLANAR ? (frames + 15) & ~15u : frames;
+    const unsigned size   = stride * channels;
+
+    if (_data == nullptr || size > _capacity || _borrowed) {
+        if (!_borrowed)
+            _pool->deallocate(_data, _capacity);
+        _data     = nullptr;
+        _borrowed = false;
+        _data     = _pool->allocate(size, _capacity);
+    }
+    _frames      = frames;
+    _channels    = channels;
+    _sample_rate = sample_rate;
+    _stride      = stride;
+    _layout      = layout;
+    _finished    = false;
+}
+
+void buffer::assign(const buffer& other)
 {
-    if (_data == nullptr || (frames * channels) > _capacity) {
-        delete _data;
-        _capacity = frames * channels;
-        _data = new float[_capacity];
+    if (&other == this)
+        return;
+
+    reset(other._frames, other._channels, other._sample_rate, other._layout);
+
+    if (_layout == PLANAR) {
+        for (unsigned c = 0; c < _channels; c++)
+            __builtin_memcpy(data(c), other.cdata(c), _frames * sizeof(float));
+    } else {
+        __builtin_memcpy(_data, other._data, static_cast<size_t>(_frames) * _channels * sizeof(float));
     }
+    _finished = other._finished;
+}
+
+void buffer::reserve(unsigned frames, unsigned channels, audio::layout layout)
+{
+    const unsigned stride = layout == PLANAR ? (frames + 15) & ~15u : frames;
+    const unsigned size   = stride * channels;
+
+    if (_data != nullptr && size <= _capacity && !_borrowed)
+        return;
+
+    if (!_borrowed)
+        _pool->deallocate(_data, _capacity);
+    _data     = nullptr;
+    _borrowed = false;
+    _data     = _pool->allocate(size, _capacity);
+    _frames   = 0;
+}
+
+void buffer::borrow(float* data, unsigned frames, unsigned channels, unsigned sample_rate,
+                    audio::layout layout, unsigned stride)
+{
+    if (layout == PLANAR && stride != 0 && stride < frames)
+        throw std::invalid_argument("audio::buffer::borrow");
+
+    if (!_borrowed)
+        _pool->deallocate(_data, _capacity);
+
+    _data        = data;
+    _capacity    = 0;
     _frames      = frames;
     _channels    = channels;
     _sample_rate = sample_rate;
+    _stride      = layout == PLANAR && stride != 0 ? stride : frames;
+    _layout      = layout;
+    _finished    = false;
+    _borrowed    = true;
 }
 
 void buffer::trunc(unsigned frames)
@@ -90,21 +172,28 @@ void buffer::swap(buffer& other)
     using std::swap;
 
     swap(_data, other._data);
+    swap(_pool, other._pool);
     swap(_capacity, other._capacity);
     swap(_frames, other._frames);
     swap(_channels, other._channels);
     swap(_sample_rate, other._sample_rate);
+    swap(_stride, other._stride);
+    swap(_layout, other._layout);
+    swap(_finished, other._finished);
+    swap(_borrowed, other._borrowed);
 }
 
-float* buffer::release()
+void buffer::release()
 {
-    float* data = _data;
+    if (!_borrowed)
+        _pool->deallocate(_data, _capacity);
 
     _data        = nullptr;
     _capacity    = 0;
     _frames      = 0;
     _channels    = 0;
     _sample_rate = 0;
-
-    return data;
+    _stride      = 0;
+    _finished    = false;
+    _borrowed    = false;
 }
@@ -25,10 +25,41 @@
 #include <utility>
 #include <stdexcept>
 
+#include "buffer_pool.hpp"
+
 namespace fu {
 
     namespace audio {
 
+        /**
+         * Sample layouts an audio::buffer may have.
+         */
+        enum layout {
+            INTERLEAVED = 0,   ///< frame after frame, channels adjacent
+            PLANAR      = 1    ///< channel after channel, frames adjacent
+        };
+
+        /**
+         * Non-owning view of the samples of one channel in a buffer, valid until
+         * the buffer is reset, swapped or destroyed.
+         */
+        template <class T>
+        struct basic_channel_view
+        {
+            T*       data;     ///< first sample
+            unsigned frames;   ///< number of samples
+            unsigned step;     ///< distance between consecutive samples, 1 if planar
+
+            __attribute__((always_inline))
+            inline T& operator[](unsigned frame) const
+            {
+                return data[frame * step];
+            }
+        };
+
+        typedef basic_channel_view<float>       channel_view;
+        typedef basic_channel_view<const float> const_channel_view;
+
         class buffer
         {
 
@@ -36,12 +67,16 @@ namespace fu {
             /*                                Internal properties                                */
             /* --------------------------------------------------------------------------------- */
 
-            float*   _data;
-            unsigned _capacity;
-            unsigned _frames;
-            unsigned _channels;
-            unsigned _sample_rate;
-            bool     _finished;
+            float*        _data;
+            buffer_pool*  _pool;
+            unsigned      _capacity;
+            unsigned      _frames;
+            unsigned      _channels;
+            unsigned      _sample_rate;
+            unsigned      _stride;
+            audio::layout _layout;
+            bool          _finished;
+            bool          _borrowed;    ///< _data belongs to someone else, e.g. a file mapping
 
         public:
 
@@ -50,30 +85,67 @@ namespace fu {
             /* --------------------------------------------------------------------------------- */
 
             /**
-             * Constructs a zero-length buffer object.
+             * Constructs a zero-length buffer object, whose storage will come from
+             * the global pool.
              */
             __attribute__((always_inline))
             inline buffer() noexcept
                 : _data(nullptr),
+                  _pool(&buffer_pool::global()),
+                  _capacity(0),
+                  _frames(0),
+                  _channels(0),
+                  _sample_rate(0),
+                  _stride(0),
+                  _layout(INTERLEAVED),
+                  _finished(false),
+                  _borrowed(false)
+            { }
+
+            /**
+             * Constructs a zero-length buffer object, whose storage will come from
+             * a given pool. The pool must outlive the storage.
+             */
+            __attribute__((always_inline))
+            inline explicit buffer(buffer_pool& pool) noexcept
+                : _data(nullptr),
+                  _pool(&pool),
                   _capacity(0),
                   _frames(0),
                   _channels(0),
                   _sample_rate(0),
-                  _finished(false)
+                  _stride(0),
+                  _layout(INTERLEAVED),
+                  _finished(false),
+                  _borrowed(false)
             { }
 
             /**
              * Constructs an buffer object, sets its properties and initializes its buffer.
              */
             __attribute__((always_inline))
-            inline buffer(unsigned frames, unsigned channels, unsigned sample_rate)
-                : _data(nullptr), _finished(false)
+            inline buffer(unsigned frames, unsigned channels, unsigned sample_rate,
+                          audio::layout layout = INTERLEAVED)
+                : _data(nullptr), _pool(&buffer_pool::global()), _capacity(0), _finished(false), _borrowed(false)
             {
-                reset(frames, channels, sample_rate);
+                reset(frames, channels, sample_rate, layout);
             }
 
             /**
-             * Copy constructor.
+             * Constructs an buffer object, sets its properties and initializes its buffer
+             * with storage from a given pool.
+             */
+            __attribute__((always_inline))
+            inline buffer(unsigned frames, unsigned channels, unsigned sample_rate, buffer_pool& pool,
+                          audio::layout layout = INTERLEAVED)
+                : _data(nullptr), _pool(&pool), _capacity(0), _finished(false), _borrowed(false)
+            {
+                reset(frames, channels, sample_rate, layout);
+            }
+
+            /**
+             * Copy constructor; the copy owns its samples, in pool storage (see
+             * assign()).
              */
             buffer(const buffer& other);
 
@@ -82,6 +154,11 @@ namespace fu {
              */
             buffer(buffer&& other) noexcept;
 
+            /**
+             * Move assignment operator.
+             */
+            buffer& operator=(buffer&& other) noexcept;
+
             /**
              * Destructor.
              */
@@ -110,6 +187,85 @@ namespace fu {
                 return _data;
             }
 
+            /**
+             * Access to the first sample of a channel.
+             */
+            __attribute__((always_inline))
+            inline float* data(unsigned channel)
+            {
+                return _data + (_layout == PLANAR ? channel * _stride : channel);
+            }
+
+            /**
+             * Const access to the first sample of a channel.
+             */
+            __attribute__((always_inline))
+            inline const float* cdata(unsigned channel) const
+            {
+                return _data + (_layout == PLANAR ? channel * _stride : channel);
+            }
+
+            /**
+             * Returns a view of the samples of a channel.
+             */
+            __attribute__((always_inline))
+            inline channel_view channel(unsigned channel)
+            {
+                channel_view view = { data(channel), _frames, _layout == PLANAR ? 1 : _channels };
+                return view;
+            }
+
+            /**
+             * Returns a const view of the samples of a channel.
+             */
+            __attribute__((always_inline))
+            inline const_channel_view channel(unsigned channel) const
+            {
+                const_channel_view view = { cdata(channel), _frames, _layout == PLANAR ? 1 : _channels };
+                return view;
+            }
+
+            /**
+             * Returns the sample layout of the buffer.
+             */
+            __attribute__((always_inline))
+            inline audio::layout layout() const
+            {
+                return _layout;
+            }
+
+            /**
+             * Returns the distance, in floats, between the first samples of two
+             * consecutive channels: 1 if interleaved; if planar, a multiple of 16
+             * (one cache line) for storage from the pool, and whatever was given
+             * to borrow() otherwise, so code copying planar samples must go by
+             * each buffer's own stride.
+             */
+            __attribute__((always_inline))
+            inline unsigned channel_stride() const
+            {
+                return _layout == PLANAR ? _stride : 1;
+            }
+
+            /**
+             * Returns the pool the storage of the buffer comes from.
+             */
+            __attribute__((always_inline))
+            inline buffer_pool& pool() const
+            {
+                return *_pool;
+            }
+
+            /**
+             * Returns the number of floats the storage can hold without reallocation,
+             * zero if it is borrowed.
+             */
+            __attribute__((always_inline))
+            inline unsigned capacity() const
+            {
+                return _capacity;
+            }
+
             /**
              * Returns the number of frames in the buffer.
              */
@@ -159,13 +315,63 @@ namespace fu {
             /* --------------------------------------------------------------------------------- */
 
             /**
-             * Resets buffer properties, reallocating only when necessary.
+             * Resets buffer properties, reallocating only when necessary, and clears
+             * the finished flag.
              *
              * @param frames        number of frames
              * @param channels      number of channels
              * @param sample_rate   sample rate (Hz)
+             * @param layout        sample layout
              */
-            void reset(unsigned frames, unsigned channels, unsigned sample_rate);
+            void reset(unsigned frames, unsigned channels, unsigned sample_rate,
+                       audio::layout layout = INTERLEAVED);
+
+            /**
+             * Copies the samples and properties of another buffer, finished flag
+             * included, reusing storage when large enough. Planar samples are
+             * copied channel by channel, since the strides of the two may differ.
+             */
+            void assign(const buffer& other);
+
+            /**
+             * Makes sure the buffer has storage for a block, allocating only if it
+             * has not, so that a later reset() to that size or smaller never
+             * allocates. Properties are kept unless storage grows, which leaves
+             * the buffer empty (zero frames).
+             *
+             * @param frames        number of frames
+             * @param channels      number of channels
+             * @param layout        sample layout
+             */
+            void reserve(unsigned frames, unsigned channels, audio::layout layout = INTERLEAVED);
+
+            /**
+             * Makes the buffer a view of samples it does not own, e.g. pages of a
+             * mapped file, giving its own storage back to the pool. The samples
+             * must stay valid until the buffer is reset, released or destroyed,
+             * wherever swaps take it; reset() replaces them with pool storage.
+             *
+             * @param data          first sample
+             * @param frames        number of frames
+             * @param channels      number of channels
+             * @param sample_rate   sample rate (Hz)
+             * @param layout        sample layout
+             * @param stride        planar only: floats between the first samples of
+             *                      two channels, at least frames; zero for frames
+             *
+             * @throws std::invalid_argument if a planar stride is below frames.
+             */
+            void borrow(float* data, unsigned frames, unsigned channels, unsigned sample_rate,
+                        audio::layout layout = INTERLEAVED, unsigned stride = 0);
+
+            /**
+             * Returns true if the samples are borrowed (see borrow()).
+             */
+            __attribute__((always_inline))
+            inline bool borrowed() const
+            {
+                return _borrowed;
+            }
 
             /**
              * Truncates the buffer.
@@ -180,9 +386,9 @@ namespace fu {
             void swap(buffer& other);
 
             /**
-             * Releases its internal buffer.
+             * Gives its internal storage back to the pool.
              */
-            float* release();
+            void release();
 
             /**
              * Tells the receiver this is the last buffer in a stream.
@@ -0,0 +1,199 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <cstdlib>
+#include <new>
+
+#include "buffer_pool.hpp"
+
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::size_t;
+using fu::audio::buffer_pool;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 Module-local static functions                                 */
+/* --------------------------------------------------------------------------------------------- */
+
+__attribute__((always_inline))
+inline static void lock(std::atomic_flag& flag)
+{
+    while (flag.test_and_set(memory_order_acquire)) {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+__attribute__((always_inline))
+inline static void unlock(std::atomic_flag& flag)
+{
+    flag.clear(memory_order_release);
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Constructors and destructor                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+buffer_pool::buffer_pool()
+    : _hits(0),
+      _misses(0),
+      _bytes_in_use(0),
+      _bytes_cached(0),
+      _peak_bytes(0)
+{
+    for (auto& list: _free) {
+        list.lock.clear();
+        list.head = nullptr;
+    }
+}
+
+buffer_pool::~buffer_pool()
+{
+    trim();
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                    Private member functions                                   */
+/* --------------------------------------------------------------------------------------------- */
+
+/**
+ * Returns the index of the smallest class holding count floats.
+ */
+unsigned buffer_pool::size_class(size_t count)
+{
+    if (count <= (size_t(1) << _min_class_shift))
+        return 0;
+
+    const unsigned shift = 64 - __builtin_clzll(static_cast<unsigned long long>(count - 1));
+    if (shift - _min_class_shift >= _classes)
+        throw std::bad_alloc();
+
+    return shift - _min_class_shift;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Misc. member functions                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+__attribute__((hot))
+float* buffer_pool::allocate(size_t count, unsigned& capacity)
+{
+    const unsigned cls   = size_class(count);
+    const size_t   bytes = (size_t(1) << (cls + _min_class_shift)) * sizeof(float);
+    free_list&     list  = _free[cls];
+
+    lock(list.lock);
+    block* blk = list.head;
+    if (blk != nullptr)
+        list.head = blk->next;
+    unlock(list.lock);
+
+    if (__builtin_expect(blk != nullptr, 1)) {
+        _hits.fetch_add(1, memory_order_relaxed);
+        _bytes_cached.fetch_sub(bytes, memory_order_relaxed);
+    } else {
+        void* ptr;
+        if (posix_memalign(&ptr, alignment, bytes) != 0)
+            throw std::bad_alloc();
+        blk = static_cast<block*>(ptr);
+
+        _misses.fetch_add(1, memory_order_relaxed);
+
+        // Only misses make the pool grow, so this is the only place to track the peak.
+        const size_t total = _bytes_in_use.load(memory_order_relaxed)
+                           + _bytes_cached.load(memory_order_relaxed)
+                           + bytes;
+        size_t peak = _peak_bytes.load(memory_order_relaxed);
+        while (peak < total && !_peak_bytes.compare_exchange_weak(peak, total, memory_order_relaxed))
+            ;
+    }
+
+    _bytes_in_use.fetch_add(bytes, memory_order_relaxed);
+    capacity = static_cast<unsigned>(bytes / sizeof(float));
+
+    return reinterpret_cast<float*>(blk);
+}
+
+__attribute__((hot))
+void buffer_pool::deallocate(float* data, unsigned capacity)
+{
+    if (data == nullptr)
+        return;
+
+    const unsigned cls   = size_class(capacity);
+    const size_t   bytes = size_t(capacity) * sizeof(float);
+    free_list&     list  = _free[cls];
+    block*         blk   = reinterpret_cast<block*>(data);
+
+    lock(list.lock);
+    blk->next = list.head;
+    list.head = blk;
+    unlock(list.lock);
+
+    _bytes_in_use.fetch_sub(bytes, memory_order_relaxed);
+    _bytes_cached.fetch_add(bytes, memory_order_relaxed);
+}
+
+void buffer_pool::trim()
+{
+    for (unsigned cls = 0; cls < _classes; cls++) {
+        free_list& list = _free[cls];
+
+        lock(list.lock);
+        block* blk = list.head;
+        list.head = nullptr;
+        unlock(list.lock);
+
+        while (blk != nullptr) {
+            block* next = blk->next;
+            std::free(blk);
+            _bytes_cached.fetch_sub((size_t(1) << (cls + _min_class_shift)) * sizeof(float),
+                                    memory_order_relaxed);
+            blk = next;
+        }
+    }
+}
+
+buffer_pool::stats buffer_pool::statistics() const
+{
+    stats result;
+
+    result.hits         = _hits.load(memory_order_relaxed);
+    result.misses       = _misses.load(memory_order_relaxed);
+    result.bytes_in_use = _bytes_in_use.load(memory_order_relaxed);
+    result.bytes_cached = _bytes_cached.load(memory_order_relaxed);
+    result.peak_bytes   = _peak_bytes.load(memory_order_relaxed);
+
+    return result;
+}
+
+buffer_pool& buffer_pool::global()
+{
+    // Never destroyed, so buffers with static storage duration can outlive it safely.
+    static buffer_pool* pool = new buffer_pool;
+    return *pool;
+}
@@ -0,0 +1,151 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef UE2EA409C_4837_429C_93F2_C4806B21F34A
+#define UE2EA409C_4837_429C_93F2_C4806B21F34A
+
+#include <atomic>
+#include <cstddef>
+
+namespace fu {
+
+    namespace audio {
+
+        /**
+         * Pool of 64-byte-aligned sample blocks backing audio::buffer storage.
+         *
+         * Blocks are grouped in power-of-two size classes (16 floats and up) and
+         * kept in per-class free lists when released, so that a pipeline whose
+         * buffers change shape between files reuses storage instead of going back
+         * to the system allocator. Blocks may be released from any thread.
+         */
+        class buffer_pool
+        {
+        public:
+
+            /**
+             * Alignment, in bytes, of every block handed out by the pool.
+             */
+            static const std::size_t alignment = 64;
+
+            /**
+             * Snapshot of pool counters.
+             */
+            struct stats {
+                unsigned long hits;         ///< allocations served from a free list
+                unsigned long misses;       ///< allocations served by the system
+                std::size_t   bytes_in_use; ///< bytes currently held by buffers
+                std::size_t   bytes_cached; ///< bytes currently held in free lists
+                std::size_t   peak_bytes;   ///< maximum of bytes_in_use + bytes_cached
+            };
+
+        private:
+
+            /* --------------------------------------------------------------------------------- */
+            /*                                Internal properties                                */
+            /* --------------------------------------------------------------------------------- */
+
+            static const unsigned _min_class_shift = 4;
+            static const unsigned _classes         = 28;
+
+            struct block {
+                block* next;
+            };
+
+            struct free_list {
+                std::atomic_flag lock;
+                block*           head;
+            };
+
+            free_list                 _free[_classes];
+            std::atomic<unsigned long> _hits;
+            std::atomic<unsigned long> _misses;
+            std::atomic<std::size_t>   _bytes_in_use;
+            std::atomic<std::size_t>   _bytes_cached;
+            std::atomic<std::size_t>   _peak_bytes;
+
+            static unsigned size_class(std::size_t count);
+
+        public:
+
+            /* --------------------------------------------------------------------------------- */
+            /*                            Constructors and destructor                            */
+            /* --------------------------------------------------------------------------------- */
+
+            /**
+             * Constructs an empty pool.
+             */
+            buffer_pool();
+
+            buffer_pool(const buffer_pool&) = delete;
+            buffer_pool& operator=(const buffer_pool&) = delete;
+
+            /**
+             * Destructor, frees cached blocks. Every block must have been given back
+             * to the pool by then.
+             */
+            ~buffer_pool();
+
+
+            /* --------------------------------------------------------------------------------- */
+            /*                               Misc member functions                               */
+            /* --------------------------------------------------------------------------------- */
+
+            /**
+             * Allocates a block of at least count floats.
+             *
+             * @param count     minimum number of floats
+             * @param capacity  receives the actual number of floats in the block
+             *
+             * @return          64-byte-aligned block
+             */
+            float* allocate(std::size_t count, unsigned& capacity);
+
+            /**
+             * Gives a block back to the pool.
+             *
+             * @param data      block returned by allocate
+             * @param capacity  capacity reported by allocate
+             */
+            void deallocate(float* data, unsigned capacity);
+
+            /**
+             * Frees every cached block.
+             */
+            void trim();
+
+            /**
+             * Returns a snapshot of the pool counters.
+             */
+            stats statistics() const;
+
+            /**
+             * Returns the process-wide pool, used by buffers not given a pool.
+             */
+            static buffer_pool& global();
+
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
@@ -19,38 +19,166 @@
 // DEALINGS IN THE SOFTWARE.
 
 
+#include <algorithm>
+#include <atomic>
+#include <string>
+
 #include "buffer.hpp"
 #include "connection.hpp"
 
+using std::string;
 using fu::audio::connection;
 using fu::audio::buffer;
+using fu::metrics::now;
+
+/**
+ * Returns a name for a new connection.
+ */
+static string __next_name()
+{
+    static std::atomic<unsigned> count(0);
+    return "connection." + std::to_string(count.fetch_add(1, std::memory_order_relaxed));
+}
 
 connection::connection()
-    : _send_buf(nullptr)
+    : connection(0)
 { }
 
+connection::connection(unsigned depth)
+    : _send_buf(nullptr),
+      _send_count(0),
+      _ring(depth > 0 ? new ring(depth) : nullptr),
+      _send_semaphore(depth),
+      _receiver(nullptr),
+      _sender(nullptr),
+      _name(__next_name()),
+      _buffers(_name + ".buffers"),
+      _frames(_name + ".frames"),
+      _send_wait(_name + ".send_wait_ns"),
+      _recv_wait(_name + ".recv_wait_ns"),
+      _queued(_name + ".queued")
+{ }
+
+connection::~connection()
+{
+    delete _ring;
+}
+
+void connection::name(const string& name)
+{
+    _name = name;
+    _buffers.rename(name + ".buffers");
+    _frames.rename(name + ".frames");
+    _send_wait.rename(name + ".send_wait_ns");
+    _recv_wait.rename(name + ".recv_wait_ns");
+    _queued.rename(name + ".queued");
+}
+
+void connection::reserve(unsigned frames, unsigned channels, audio::layout layout)
+{
+    if (_ring != nullptr)
+        _ring->reserve(frames, channels, layout);
+}
+
 void connection::close()
 {
     _send_buf = nullptr;
     _recv_semaphore.post();
+    if (_receiver != nullptr)
+        _receiver->notify();
 }
 
-void connection::send(buffer& buf)
+/**
+ * Waits for a semaphore, recording how long it blocked, if it did.
+ */
+__attribute__((always_inline))
+inline static void __wait(fu::semaphore& sem, fu::metrics::histogram& blocked)
 {
-    _send_buf = &buf;
-    _recv_semaphore.post();
-    _send_semaphore.wait();
+    if (__builtin_expect(!sem.try_wait(), 0)) {
+        const std::int64_t start = now();
+        sem.wait();
+        blocked.record(static_cast<std::uint64_t>(now() - start));
+    }
 }
 
-bool connection::recv(buffer& buf)
+void connection::send(buffer* bufs, unsigned count)
 {
-    _recv_semaphore.wait();
-    if (__builtin_expect(_send_buf != nullptr, 1)) {
-        std::swap(*_send_buf, buf);
-        _send_semaphore.post();
-        return true;
+    _buffers.add(count);
+    for (unsigned i = 0; i < count; i++)
+        _frames.add(bufs[i].frames());
+
+    if (_ring != nullptr) {
+        // _send_semaphore counts free slots, _recv_semaphore counts filled ones.
+        while (count > 0) {
+            __wait(_send_semaphore, _send_wait);
+            const unsigned n = 1 + _send_semaphore.try_wait(static_cast<int>(count - 1));
+            for (unsigned i = 0; i < n; i++)
+                _ring->try_push(bufs[i]);
+            _queued.add(n);
+            _recv_semaphore.post(static_cast<int>(n));
+            if (_receiver != nullptr)
+                _receiver->notify();
+            bufs  += n;
+            count -= n;
+        }
+    } else if (count > 0) {
+        // The receiver takes the batch in as many calls as it needs, and posts
+        // _send_semaphore once it took the last buffer.
+        _send_buf   = bufs;
+        _send_count = count;
+        _recv_semaphore.post();
+        if (_receiver != nullptr)
+            _receiver->notify();
+        __wait(_send_semaphore, _send_wait);
+    }
+}
+
+unsigned connection::recv(buffer* bufs, unsigned max)
+{
+    if (max == 0)
+        return 0;
+
+    __wait(_recv_semaphore, _recv_wait);
+    if (_ring != nullptr) {
+        const unsigned taken = 1 + _recv_semaphore.try_wait(static_cast<int>(max - 1));
+
+        // The post from connection::close comes after every buffer sent, so
+        // running out of buffers here means the connection was closed.
+        unsigned n = 0;
+        while (n < taken && _ring->try_pop(bufs[n]))
+            n++;
+
+        if (__builtin_expect(n < taken, 0)) {
+            // Leave the close posted, so that readable() stays true.
+            _recv_semaphore.post();
+        }
+        if (n > 0) {
+            _queued.add(-static_cast<int64_t>(n));
+            _send_semaphore.post(static_cast<int>(n));
+            if (_sender != nullptr)
+                _sender->notify();
+        }
+        return n;
+    } else if (__builtin_expect(_send_buf != nullptr, 1)) {
+        const unsigned n = std::min(max, _send_count);
+        for (unsigned i = 0; i < n; i++)
+            std::swap(_send_buf[i], bufs[i]);
+        _send_buf   += n;
+        _send_count -= n;
+
+        if (_send_count > 0) {
+            // More of the batch is waiting.
+            _recv_semaphore.post();
+        } else {
+            _send_buf = nullptr;
+            _send_semaphore.post();
+            if (_sender != nullptr)
+                _sender->notify();
+        }
+        return n;
     } else {
         // connection::close was called by the sender.
-        return false;
+        _recv_semaphore.post();
+        return 0;
     }
 }
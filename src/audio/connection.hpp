@@ -22,8 +22,12 @@
 #ifndef U68FB47BA_560F_4F14_9DD5_523062854D8A
 #define U68FB47BA_560F_4F14_9DD5_523062854D8A
 
+#include <string>
+
+#include "../metrics.hpp"
 #include "../semaphore.hpp"
 #include "buffer.hpp"
+#include "ring.hpp"
 
 namespace fu {
 
@@ -32,16 +36,129 @@ namespace fu {
         /**
          * Swaps audio::buffer instances between different threads,
          * used to construct audio pipes.
+         *
+         * With depth zero (the default), send and recv rendezvous: the sender
+         * blocks until the receiver has taken its buffer. With depth N > 0,
+         * buffers are queued in an audio::ring and the sender may run up to N
+         * buffers ahead of the receiver.
+         *
+         * Every connection keeps metrics named after it: buffers and frames sent,
+         * ns blocked in send and in recv (one value per time either blocked), and
+         * the number of buffers queued.
          */
         class connection {
 
-            buffer*    _send_buf;
+        public:
+            /**
+             * Interface of objects told when a connection may have become readable
+             * or writable, e.g. tasks scheduled on a fu::executor.
+             */
+            class watcher
+            {
+            public:
+                virtual ~watcher() { }
+
+                /**
+                 * Called after the state of a watched connection changed; may be
+                 * called from any thread, and must not block.
+                 */
+                virtual void notify() = 0;
+            };
+
+        private:
+            buffer*    _send_buf;       // buffers offered by a rendezvous sender
+            unsigned   _send_count;
+            ring*      _ring;
             semaphore  _send_semaphore;
             semaphore  _recv_semaphore;
+            watcher*   _receiver;
+            watcher*   _sender;
+
+            std::string           _name;
+            metrics::counter      _buffers;
+            metrics::counter      _frames;
+            metrics::histogram    _send_wait;
+            metrics::histogram    _recv_wait;
+            metrics::gauge        _queued;
 
         public:
+            /**
+             * Creates a rendezvous connection.
+             */
             connection();
 
+            /**
+             * Creates a connection with a given depth.
+             *
+             * @param depth  number of buffers the sender may queue ahead of
+             *               the receiver, zero for a rendezvous connection.
+             */
+            explicit connection(unsigned depth);
+
+            connection(const connection&) = delete;
+            connection& operator=(const connection&) = delete;
+
+            /**
+             * Destructor.
+             */
+            ~connection();
+
+            /**
+             * Returns the depth of the connection, zero if rendezvous.
+             */
+            __attribute__((always_inline))
+            inline unsigned depth() const
+            {
+                return _ring != nullptr ? _ring->size() : 0;
+            }
+
+            /**
+             * Returns the name of the connection, "connection.N" by default.
+             */
+            __attribute__((always_inline))
+            inline const std::string& name() const
+            {
+                return _name;
+            }
+
+            /**
+             * Renames the connection and its metrics, which are named after it
+             * (e.g. name + ".frames").
+             */
+            void name(const std::string& name);
+
+            /**
+             * Sets the watchers told when a buffer or the end of the stream becomes
+             * available (receiver) and when a slot is freed (sender); either may
+             * be null. Must be set before the connection is used.
+             */
+            __attribute__((always_inline))
+            inline void watch(watcher* receiver, watcher* sender)
+            {
+                _receiver = receiver;
+                _sender   = sender;
+            }
+
+            /**
+             * Returns true if recv would not block, i.e. a buffer is waiting or the
+             * connection was closed. Exact when called by the receiver.
+             */
+            __attribute__((always_inline))
+            inline bool readable()
+            {
+                return _recv_semaphore.value() > 0;
+            }
+
+            /**
+             * Returns true if send would not block. Exact when called by the sender;
+             * a rendezvous connection is never writable.
+             */
+            __attribute__((always_inline))
+            inline bool writable()
+            {
+                return _ring != nullptr && _send_semaphore.value() > 0;
+            }
+
             /**
              * Sends data to a receiver thread, and recycles storage already used
              * by that thread.
@@ -49,7 +166,22 @@ namespace fu {
              * @param buf  audio::buffer containing data to be send, and which
              *             will receive a buffer to be recycled.
              */
-            void send(buffer& buf);
+            __attribute__((always_inline))
+            inline void send(buffer& buf)
+            {
+                send(&buf, 1);
+            }
+
+            /**
+             * Sends a batch of buffers, in order, as send(buffer&) does for each;
+             * the receiver is woken once per batch, or once per run of free slots
+             * if the batch does not fit in the ring.
+             *
+             * @param bufs   buffers containing data, which receive buffers to be
+             *               recycled.
+             * @param count  number of buffers.
+             */
+            void send(buffer* bufs, unsigned count);
 
             /**
              * Receives data from a sender thread, and sends back used storage
@@ -60,7 +192,31 @@ namespace fu {
              *
              * @return     true if success, false if connection closed.
              */
-            bool recv(buffer& buf);
+            __attribute__((always_inline))
+            inline bool recv(buffer& buf)
+            {
+                return recv(&buf, 1) > 0;
+            }
+
+            /**
+             * Receives a batch of buffers: blocks until at least one is available,
+             * then takes every one available, up to max, and hands back their
+             * storage to the sender in one go.
+             *
+             * @param bufs  used buffers which receive fresh data, and whose storage
+             *              is recycled.
+             * @param max   number of buffers in bufs.
+             *
+             * @return      number of buffers received, zero if connection closed.
+             */
+            unsigned recv(buffer* bufs, unsigned max);
+
+            /**
+             * Reserves storage for a block in every queued slot (see ring::reserve());
+             * a rendezvous connection holds no storage of its own. Only before the
+             * connection is used.
+             */
+            void reserve(unsigned frames, unsigned channels, audio::layout layout = INTERLEAVED);
 
             /**
              * Closes a connection.
@@ -0,0 +1,687 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "../logger.hpp"
+#include "../metrics.hpp"
+#include "../realtime.hpp"
+#include "graph.hpp"
+#include "kernels.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using fu::audio::buffer;
+using fu::audio::connection;
+using fu::audio::graph;
+using fu::audio::sink;
+using fu::audio::source;
+using fu::audio::transform;
+using fu::metrics::histogram;
+using fu::metrics::timer;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Configurable constants                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+#define STEP_BUDGET   16      // blocks a node handles on an executor before yielding
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("graph");
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                        Internal types                                         */
+/* --------------------------------------------------------------------------------------------- */
+
+struct graph::edge {
+    node_id                 from;
+    node_id                 to;
+    unsigned                depth;
+    unique_ptr<connection>  conn;
+};
+
+struct graph::node : public fu::executor::task, public connection::watcher {
+    enum kind_t { SOURCE, TRANSFORM, SINK, TEE, MIX };
+
+    graph&                owner;
+    kind_t                kind;
+    source*               src;
+    transform*            xform;
+    sink*                 snk;
+    unsigned              max_inputs;
+    unsigned              max_outputs;
+    vector<unsigned>      inputs;      // edge indices, in port order
+    vector<unsigned>      outputs;
+    int                   thread;      // index in _workers, or -1 for a thread of its own
+    string                name;
+
+    // Run-time state, set up by start().
+    vector<connection*>   in;
+    vector<connection*>   out;
+    vector<buffer>        bufs;        // one per input (at least one)
+    vector<bool>          open;        // inputs not yet closed or finished
+    vector<buffer*>       srcs;        // inputs mixed in a step, for MIX nodes
+    buffer                scratch;
+    unique_ptr<histogram> work;        // ns spent in the stage per block
+    bool                  done;
+    bool                  failed;
+
+    node(graph& g, kind_t k, unsigned n_inputs, unsigned n_outputs)
+        : owner(g), kind(k), src(nullptr), xform(nullptr), snk(nullptr),
+          max_inputs(n_inputs), max_outputs(n_outputs), thread(-1), done(false), failed(false)
+    { }
+
+    void close_outputs()
+    {
+        for (auto c: out)
+            c->close();
+    }
+
+    // A connection of this node changed, on an executor.
+    void notify() override
+    {
+        owner._executor->schedule(*this);
+    }
+
+    result run() override
+    {
+        for (unsigned i = 0; i < STEP_BUDGET; i++) {
+            if (!owner.ready(*this))
+                return WAIT;
+            owner.step_guarded(*this);
+            if (done)
+                return DONE;
+        }
+        return YIELD;
+    }
+
+    void finished() override
+    {
+        // Last access to the graph from this task; join() may return right after.
+        if (owner._live.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            owner._finished.post();
+    }
+};
+
+struct graph::worker {
+    int            cpu;
+    int            priority;       // SCHED_FIFO priority, or zero
+    string         name;
+    vector<node*>  nodes;          // in topological order
+};
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                       Helper functions                                        */
+/* --------------------------------------------------------------------------------------------- */
+
+/**
+ * Extends a buffer to a number of frames with silence.
+ */
+static void __pad(buffer& buf, unsigned frames, buffer& scratch)
+{
+    scratch.reset(frames, buf.channels(), buf.sample_rate(), buf.layout());
+
+    if (buf.layout() == fu::audio::PLANAR) {
+        for (unsigned c = 0; c < buf.channels(); c++) {
+            std::memcpy(scratch.data(c), buf.cdata(c), buf.frames() * sizeof(float));
+            std::memset(scratch.data(c) + buf.frames(), 0, (frames - buf.frames()) * sizeof(float));
+        }
+    } else {
+        const size_t used = static_cast<size_t>(buf.frames()) * buf.channels();
+        std::memcpy(scratch.data(), buf.cdata(), used * sizeof(float));
+        std::memset(scratch.data() + used, 0,
+                    (static_cast<size_t>(frames) * buf.channels() - used) * sizeof(float));
+    }
+
+    if (buf.finished())
+        scratch.finish();
+    std::swap(buf, scratch);
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Construction of graphs                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+graph::graph()
+    : _executor(nullptr), _live(0), _started(false), _joined(false),
+      _reserve_frames(0), _reserve_channels(0), _reserve_layout(INTERLEAVED)
+{
+    static std::atomic<unsigned> count(0);
+    _name = "graph." + to_string(count.fetch_add(1, std::memory_order_relaxed));
+}
+
+graph::~graph()
+{
+    for (auto& t: _threads) {
+        if (t.joinable())
+            t.join();
+    }
+
+    if (_executor != nullptr && !_joined)
+        _finished.wait();
+}
+
+graph::node_id graph::add(node* n)
+{
+    if (_started)
+        throw std::logic_error("audio::graph: already started");
+
+    static const char* const kinds[] = { "source", "transform", "sink", "tee", "mix" };
+
+    n->name = kinds[n->kind] + to_string(_nodes.size());
+    _nodes.emplace_back(n);
+    return static_cast<node_id>(_nodes.size() - 1);
+}
+
+graph::node_id graph::add(source& stage)
+{
+    node* n = new node(*this, node::SOURCE, 0, 1);
+    n->src = &stage;
+    return add(n);
+}
+
+graph::node_id graph::add(transform& stage)
+{
+    node* n = new node(*this, node::TRANSFORM, 1, 1);
+    n->xform = &stage;
+    return add(n);
+}
+
+graph::node_id graph::add(sink& stage)
+{
+    node* n = new node(*this, node::SINK, 1, 0);
+    n->snk = &stage;
+    return add(n);
+}
+
+graph::node_id graph::tee(unsigned outputs)
+{
+    if (outputs == 0)
+        throw std::invalid_argument("audio::graph::tee");
+
+    return add(new node(*this, node::TEE, 1, outputs));
+}
+
+graph::node_id graph::mix(unsigned inputs)
+{
+    if (inputs == 0)
+        throw std::invalid_argument("audio::graph::mix");
+
+    return add(new node(*this, node::MIX, inputs, 1));
+}
+
+void graph::connect(node_id from, node_id to, unsigned depth)
+{
+    if (_started)
+        throw std::logic_error("audio::graph: already started");
+    if (from >= _nodes.size() || to >= _nodes.size())
+        throw std::invalid_argument("audio::graph::connect: no such node");
+
+    node& up   = *_nodes[from];
+    node& down = *_nodes[to];
+    if (up.outputs.size() >= up.max_outputs)
+        throw std::logic_error("audio::graph::connect: node " + to_string(from) + " has no free output");
+    if (down.inputs.size() >= down.max_inputs)
+        throw std::logic_error("audio::graph::connect: node " + to_string(to) + " has no free input");
+
+    edge* e = new edge;
+    e->from  = from;
+    e->to    = to;
+    e->depth = depth;
+    _edges.emplace_back(e);
+
+    up.outputs.push_back(static_cast<unsigned>(_edges.size() - 1));
+    down.inputs.push_back(static_cast<unsigned>(_edges.size() - 1));
+}
+
+void graph::name(const string& name)
+{
+    if (_started)
+        throw std::logic_error("audio::graph: already started");
+
+    _name = name;
+}
+
+void graph::name(node_id node, const string& name)
+{
+    if (_started)
+        throw std::logic_error("audio::graph: already started");
+    if (node >= _nodes.size())
+        throw std::invalid_argument("audio::graph::name: no such node");
+
+    _nodes[node]->name = name;
+}
+
+graph::thread_id graph::thread(int cpu, int priority)
+{
+    if (_started)
+        throw std::logic_error("audio::graph: already started");
+    if (cpu < ANY_CPU)
+        throw std::invalid_argument("audio::graph::thread: bad cpu");
+    if (priority < 0)
+        throw std::invalid_argument("audio::graph::thread: bad priority");
+
+    worker* w = new worker;
+    w->cpu      = cpu;
+    w->priority = priority;
+    w->name     = "graph-" + to_string(_workers.size());
+    _workers.emplace_back(w);
+    return static_cast<thread_id>(_workers.size() - 1);
+}
+
+void graph::reserve(unsigned frames, unsigned channels, audio::layout layout)
+{
+    if (_started)
+        throw std::logic_error("audio::graph: already started");
+
+    _reserve_frames   = frames;
+    _reserve_channels = channels;
+    _reserve_layout   = layout;
+}
+
+void graph::place(node_id node, thread_id thread)
+{
+    if (_started)
+        throw std::logic_error("audio::graph: already started");
+    if (node >= _nodes.size() || thread >= _workers.size())
+        throw std::invalid_argument("audio::graph::place: no such node or thread");
+
+    _nodes[node]->thread = static_cast<int>(thread);
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                       Running the graph                                       */
+/* --------------------------------------------------------------------------------------------- */
+
+vector<graph::node_id> graph::prepare()
+{
+    if (_started)
+        throw std::logic_error("audio::graph: already started");
+
+    for (node_id i = 0; i < _nodes.size(); i++) {
+        const node& n = *_nodes[i];
+        if (n.inputs.size() != n.max_inputs || n.outputs.size() != n.max_outputs)
+            throw std::logic_error("audio::graph: node " + to_string(i) + " has unconnected ports");
+    }
+
+    // Topological order (Kahn), so that a shared thread steps producers before consumers.
+    vector<unsigned> pending(_nodes.size());
+    vector<node_id>  order;
+    for (node_id i = 0; i < _nodes.size(); i++) {
+        pending[i] = static_cast<unsigned>(_nodes[i]->inputs.size());
+        if (pending[i] == 0)
+            order.push_back(i);
+    }
+    for (size_t k = 0; k < order.size(); k++) {
+        for (unsigned e: _nodes[order[k]]->outputs) {
+            if (--pending[_edges[e]->to] == 0)
+                order.push_back(_edges[e]->to);
+        }
+    }
+    if (order.size() != _nodes.size())
+        throw std::logic_error("audio::graph: graph has a cycle");
+
+    return order;
+}
+
+void graph::wire(const vector<node_id>& order)
+{
+    for (auto& e: _edges) {
+        e->conn->name(_name + "." + _nodes[e->from]->name + "->" + _nodes[e->to]->name);
+        if (_reserve_frames > 0)
+            e->conn->reserve(_reserve_frames, _reserve_channels, _reserve_layout);
+    }
+
+    for (node_id i: order) {
+        node& n = *_nodes[i];
+        for (unsigned e: n.inputs)
+            n.in.push_back(_edges[e]->conn.get());
+        for (unsigned e: n.outputs)
+            n.out.push_back(_edges[e]->conn.get());
+        n.bufs.resize(std::max(n.max_inputs, 1u));
+        n.open.assign(n.max_inputs, true);
+        n.srcs.resize(n.max_inputs);
+        n.work.reset(new histogram(_name + "." + n.name + ".work_ns"));
+        if (_reserve_frames > 0) {
+            for (auto& b: n.bufs)
+                b.reserve(_reserve_frames, _reserve_channels, _reserve_layout);
+            n.scratch.reserve(_reserve_frames, _reserve_channels, _reserve_layout);
+        }
+    }
+}
+
+void graph::start()
+{
+    const vector<node_id> order = prepare();
+
+    // Nodes not placed anywhere get a thread of their own.
+    for (auto& n: _nodes) {
+        if (n->thread < 0)
+            n->thread = static_cast<int>(thread(ANY_CPU));
+    }
+
+    // A thread cannot rendezvous with itself.
+    for (auto& e: _edges) {
+        const bool shared = _nodes[e->from]->thread == _nodes[e->to]->thread;
+        e->conn.reset(new connection(shared && e->depth == 0 ? 1 : e->depth));
+    }
+
+    wire(order);
+    for (node_id i: order)
+        _workers[_nodes[i]->thread]->nodes.push_back(_nodes[i].get());
+
+    _started = true;
+    for (auto& w: _workers) {
+        if (!w->nodes.empty())
+            _threads.emplace_back(&graph::run_worker, this, std::ref(*w));
+    }
+}
+
+void graph::start(executor& ex)
+{
+    const vector<node_id> order = prepare();
+
+    // Tasks never block, so there is no rendezvous.
+    for (auto& e: _edges) {
+        e->conn.reset(new connection(std::max(e->depth, 1u)));
+        e->conn->watch(_nodes[e->to].get(), _nodes[e->from].get());
+    }
+
+    wire(order);
+
+    _executor = &ex;
+    _live.store(static_cast<unsigned>(_nodes.size()));
+    _started = true;
+    if (_nodes.empty())
+        _finished.post();
+
+    for (node_id i: order)
+        ex.schedule(*_nodes[i]);
+}
+
+void graph::join()
+{
+    for (auto& t: _threads)
+        t.join();
+    _threads.clear();
+
+    if (_executor != nullptr && !_joined)
+        _finished.wait();
+    _joined = true;
+
+    if (_error != nullptr)
+        std::rethrow_exception(_error);
+}
+
+void graph::run_worker(worker& w)
+{
+    fu::logger::thread_name(w.name.c_str());
+
+    if (w.cpu != ANY_CPU) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w.cpu, &set);
+        const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0)
+            FU_LOG(__log, fu::WARN) << "cannot pin to cpu " << w.cpu << ": " << std::strerror(err);
+#else
+        FU_LOG(__log, fu::WARN) << "thread pinning is not supported on this platform";
+#endif
+    }
+
+    if (w.priority > 0) {
+        try {
+            fu::realtime::set_fifo(w.priority);
+        } catch (const std::exception& e) {
+            FU_LOG(__log, fu::WARN) << "cannot set priority " << w.priority << ": " << e;
+        }
+    }
+
+    for (bool active = true; active; ) {
+        active = false;
+        for (node* n: w.nodes) {
+            if (!n->done)
+                step_guarded(*n);
+            active |= !n->done;
+        }
+    }
+}
+
+void graph::step_guarded(node& n)
+{
+    try {
+        step(n);
+    } catch (const std::exception& e) {
+        FU_LOG(__log, fu::ERROR) << "stage failed: " << e;
+        fail(n);
+    } catch (...) {
+        FU_LOG(__log, fu::ERROR) << "stage failed";
+        fail(n);
+    }
+}
+
+bool graph::ready(node& n)
+{
+    if (n.failed) {
+        for (size_t i = 0; i < n.in.size(); i++) {
+            if (n.open[i] && n.in[i]->readable())
+                return true;
+        }
+        return false;
+    }
+
+    for (auto c: n.out) {
+        if (!c->writable())
+            return false;
+    }
+
+    switch (n.kind) {
+    case node::SOURCE:
+        return true;
+    case node::MIX:
+        for (size_t i = 0; i < n.in.size(); i++) {
+            if (n.open[i] && !n.in[i]->readable())
+                return false;
+        }
+        return true;
+    default:
+        return n.in[0]->readable();
+    }
+}
+
+void graph::fail(node& n)
+{
+    {
+        lock_guard<mutex> lock(_error_lock);
+        if (_error == nullptr)
+            _error = std::current_exception();
+    }
+
+    // Downstream sees the end of its stream; upstream is drained so it is not left blocked.
+    n.failed = true;
+    n.close_outputs();
+    if (n.in.empty())
+        n.done = true;
+}
+
+void graph::step(node& n)
+{
+    if (n.failed) {
+        bool any = false;
+        for (size_t i = 0; i < n.in.size(); i++) {
+            // Tasks on an executor must not block.
+            const bool would_block = _executor != nullptr && !n.in[i]->readable();
+            if (n.open[i] && !would_block && !n.in[i]->recv(n.bufs[i]))
+                n.open[i] = false;
+            any |= n.open[i];
+        }
+        n.done = !any;
+        return;
+    }
+
+    switch (n.kind) {
+    case node::SOURCE: {
+        buffer& buf = n.bufs[0];
+        bool produced;
+        {
+            timer t(*n.work);
+            produced = n.src->produce(buf);
+        }
+        if (!produced) {
+            n.close_outputs();
+            n.done = true;
+            return;
+        }
+        const bool last = buf.finished();
+        n.out[0]->send(buf);
+        if (last) {
+            n.close_outputs();
+            n.done = true;
+        }
+        break;
+    }
+
+    case node::TRANSFORM: {
+        buffer& in = n.bufs[0];
+        if (!n.in[0]->recv(in)) {
+            n.close_outputs();
+            n.done = true;
+            return;
+        }
+        {
+            timer t(*n.work);
+            n.xform->process(in, n.scratch);
+        }
+        if (in.finished())
+            n.scratch.finish();
+        const bool last = n.scratch.finished();
+        n.out[0]->send(n.scratch);
+        if (last) {
+            n.close_outputs();
+            n.done = true;
+        }
+        break;
+    }
+
+    case node::SINK: {
+        buffer& buf = n.bufs[0];
+        if (!n.in[0]->recv(buf)) {
+            n.done = true;
+            return;
+        }
+        {
+            timer t(*n.work);
+            n.snk->consume(buf);
+        }
+        n.done = buf.finished();
+        break;
+    }
+
+    case node::TEE: {
+        buffer& in = n.bufs[0];
+        if (!n.in[0]->recv(in)) {
+            n.close_outputs();
+            n.done = true;
+            return;
+        }
+        const bool last = in.finished();
+        for (size_t i = 0; i + 1 < n.out.size(); i++) {
+            {
+                timer t(*n.work);
+                n.scratch.assign(in);
+            }
+            n.out[i]->send(n.scratch);
+        }
+        n.out.back()->send(in);
+        if (last) {
+            n.close_outputs();
+            n.done = true;
+        }
+        break;
+    }
+
+    case node::MIX: {
+        buffer**  srcs   = n.srcs.data();
+        unsigned  count  = 0;
+        unsigned  frames = 0;
+        bool      more   = false;
+
+        for (size_t i = 0; i < n.in.size(); i++) {
+            if (!n.open[i])
+                continue;
+            if (!n.in[i]->recv(n.bufs[i])) {
+                n.open[i] = false;
+                continue;
+            }
+            if (n.bufs[i].finished())
+                n.open[i] = false;
+            more |= n.open[i];
+            frames = std::max(frames, n.bufs[i].frames());
+            srcs[count++] = &n.bufs[i];
+        }
+
+        if (count == 0) {
+            n.close_outputs();
+            n.done = true;
+            return;
+        }
+
+        {
+            timer t(*n.work);
+            for (unsigned k = 0; k < count; k++) {
+                if (srcs[k]->frames() < frames)
+                    __pad(*srcs[k], frames, n.scratch);
+            }
+            kernels::mix(n.scratch, srcs, count);
+        }
+        if (!more)
+            n.scratch.finish();
+        n.out[0]->send(n.scratch);
+        if (!more) {
+            n.close_outputs();
+            n.done = true;
+        }
+        break;
+    }
+    }
+}
@@ -0,0 +1,238 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef U538567CE_740A_4C55_BACC_43B339B26A78
+#define U538567CE_740A_4C55_BACC_43B339B26A78
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../executor.hpp"
+#include "../semaphore.hpp"
+#include "connection.hpp"
+#include "stage.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /**
+         * Declarative pipeline of stages.
+         *
+         * Stages are added as nodes and wired with connect(); fan-out and fan-in
+         * are provided by tee() and mix() nodes. Every node runs on its own thread
+         * unless placed on a shared one with place(); threads may be pinned to a
+         * core. A thread shared by several nodes steps them in topological order,
+         * one block each per round, so connections between nodes of the same
+         * thread are given a depth of at least one.
+         *
+         * Alternatively, the graph can be run on a fu::executor, where each node is
+         * a task run only when its inputs have data and its outputs have room, so
+         * many graphs share a fixed number of threads; connections are then given
+         * a depth of at least one.
+         *
+         * For bounded latency, threads may run under SCHED_FIFO, and reserve()
+         * preallocates the buffers the graph holds; audio::rt_connection links a
+         * graph to a real-time thread of its own, e.g. one driving a device.
+         *
+         * Stages are not owned by the graph and must outlive join().
+         *
+         * Once started, each node records the ns spent in its stage per block in a
+         * histogram named after the graph and the node (e.g. "graph.0.source0.work_ns"),
+         * and connections are named after the nodes they link (see
+         * audio::connection for their metrics).
+         */
+        class graph
+        {
+        public:
+            typedef unsigned node_id;
+            typedef unsigned thread_id;
+
+            /**
+             * CPU number meaning "not pinned".
+             */
+            static const int ANY_CPU = -1;
+
+        private:
+            struct node;
+            struct edge;
+            struct worker;
+
+            std::vector<std::unique_ptr<node>>    _nodes;
+            std::vector<std::unique_ptr<edge>>    _edges;
+            std::vector<std::unique_ptr<worker>>  _workers;
+            std::vector<std::thread>              _threads;
+            std::string                           _name;
+            std::mutex                            _error_lock;
+            std::exception_ptr                    _error;
+            executor*                             _executor;
+            std::atomic<unsigned>                 _live;          // nodes not done, on an executor
+            semaphore                             _finished;
+            bool                                  _started;
+            bool                                  _joined;
+            unsigned                              _reserve_frames;    // zero if none
+            unsigned                              _reserve_channels;
+            audio::layout                         _reserve_layout;
+
+            node_id add(node* n);
+            std::vector<node_id> prepare();
+            void wire(const std::vector<node_id>& order);
+            void run_worker(worker& w);
+            bool ready(node& n);
+            void step(node& n);
+            void step_guarded(node& n);
+            void fail(node& n);
+
+        public:
+            /**
+             * Creates an empty graph.
+             */
+            graph();
+
+            graph(const graph&) = delete;
+            graph& operator=(const graph&) = delete;
+
+            /**
+             * Destructor; waits for running threads or tasks, discarding their errors.
+             */
+            ~graph();
+
+            /**
+             * Adds a source node, with one output.
+             */
+            node_id add(source& stage);
+
+            /**
+             * Adds a transform node, with one input and one output.
+             */
+            node_id add(transform& stage);
+
+            /**
+             * Adds a sink node, with one input.
+             */
+            node_id add(sink& stage);
+
+            /**
+             * Adds a node copying its input to a number of outputs.
+             */
+            node_id tee(unsigned outputs);
+
+            /**
+             * Adds a node summing a number of inputs into one output. Inputs must
+             * agree in channels, sample rate and layout; shorter blocks are padded
+             * with silence, and inputs that end early stop contributing.
+             */
+            node_id mix(unsigned inputs);
+
+            /**
+             * Connects the next free output of a node to the next free input of
+             * another.
+             *
+             * @param from   upstream node
+             * @param to     downstream node
+             * @param depth  depth of the connection (see audio::connection)
+             */
+            void connect(node_id from, node_id to, unsigned depth = 0);
+
+            /**
+             * Names the graph, "graph.N" by default; metrics are named after it.
+             */
+            void name(const std::string& name);
+
+            /**
+             * Names a node, "<kind><id>" by default (e.g. "transform2"); metrics are
+             * named after it.
+             */
+            void name(node_id node, const std::string& name);
+
+            /**
+             * Declares a thread, on which nodes may be placed.
+             *
+             * @param cpu       core the thread is pinned to, or ANY_CPU
+             * @param priority  SCHED_FIFO priority of the thread (see
+             *                  realtime::set_fifo()), zero for the default policy
+             *
+             * @return          id of the thread
+             */
+            thread_id thread(int cpu = ANY_CPU, int priority = 0);
+
+            /**
+             * Runs a node on a declared thread, along with other nodes placed there.
+             */
+            void place(node_id node, thread_id thread);
+
+            /**
+             * Preallocates, when the graph starts, the storage of the buffers it
+             * holds, i.e. those of nodes and the slots of connections, for blocks
+             * of up to a given size, so that passing such blocks never allocates.
+             * Stages reserve their own buffers.
+             */
+            void reserve(unsigned frames, unsigned channels, audio::layout layout = INTERLEAVED);
+
+            /**
+             * Checks the graph and starts its threads.
+             */
+            void start();
+
+            /**
+             * Checks the graph and schedules its nodes on an executor, which must
+             * outlive join().
+             */
+            void start(executor& ex);
+
+            /**
+             * Waits for every thread or task to end, and rethrows the first exception thrown
+             * by a stage, if any.
+             */
+            void join();
+
+            /**
+             * Starts the graph and waits for it.
+             */
+            __attribute__((always_inline))
+            inline void run()
+            {
+                start();
+                join();
+            }
+
+            /**
+             * Starts the graph on an executor and waits for it.
+             */
+            __attribute__((always_inline))
+            inline void run(executor& ex)
+            {
+                start(ex);
+                join();
+            }
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
@@ -0,0 +1,995 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "kernels.hpp"
+
+using std::int16_t;
+using std::int32_t;
+using std::size_t;
+using std::uint32_t;
+using std::uint8_t;
+using std::uintptr_t;
+using fu::audio::buffer;
+
+namespace kernels = fu::audio::kernels;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Configurable constants                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+#define INT16_SCALE    32768.0f
+#define INT16_HIGH     32767.0f
+#define INT24_SCALE    8388608.0f
+#define INT24_HIGH     8388607.0f
+#define INT32_SCALE    2147483648.0f
+#define INT32_HIGH     2147483520.0f    // largest float below 2^31
+#define DITHER_LANES   16               // lanes in the widest vector
+#define PACK_CHUNK     256              // samples converted at once for packed 24-bit
+#define LOCAL_ITEMS    32               // channels or sources handled without allocating
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Scalar reference implementation                              */
+/* --------------------------------------------------------------------------------------------- */
+
+namespace {
+
+    /**
+     * Table of kernels over raw arrays, one instance per instruction set.
+     */
+    struct table {
+        kernels::isa id;
+        void (*gain)(float* data, size_t n, float gain);
+        void (*gain_ramp)(float* data, size_t frames, unsigned channels, float start, float step);
+        void (*mix)(float* dst, const float* const* srcs, unsigned count, size_t n);
+        void (*clamp)(float* data, size_t n, float low, float high);
+        void (*to_int)(const float* src, int32_t* dst, size_t n, float scale, float high, uint32_t* dither);
+        void (*to_int16)(const float* src, int16_t* dst, size_t n, uint32_t* dither);
+        void (*from_int)(const int32_t* src, float* dst, size_t n, float scale);
+        void (*from_int16)(const int16_t* src, float* dst, size_t n);
+        void (*peak_sumsq)(const float* data, size_t frames, unsigned channels, float* peak, double* sumsq);
+        void (*interleave)(const float* const* src, float* dst, size_t frames, unsigned channels);
+        void (*deinterleave)(const float* src, float* const* dst, size_t frames, unsigned channels);
+    };
+
+    /**
+     * Scalar kernels. Functions taking a first index start there, so that vector
+     * kernels can hand them their tails and still match the reference exactly.
+     */
+    struct scalar {
+
+        __attribute__((always_inline))
+        static inline uint32_t xorshift(uint32_t& state)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+
+        __attribute__((always_inline))
+        static inline float tpdf(uint32_t& state)
+        {
+            const float a = (xorshift(state) >> 8) * (1.0f / 16777216.0f);
+            const float b = (xorshift(state) >> 8) * (1.0f / 16777216.0f);
+            return a - b;
+        }
+
+        __attribute__((always_inline))
+        static inline int32_t quantize(float x, float scale, float high, uint32_t* dither)
+        {
+            x *= scale;
+            if (dither != nullptr)
+                x += tpdf(*dither);
+            x = x < -scale ? -scale : x;
+            x = x > high ? high : x;
+            x += x >= 0.0f ? 0.5f : -0.5f;
+            return static_cast<int32_t>(x);
+        }
+
+        static void gain(float* data, size_t first, size_t n, float gain)
+        {
+            for (size_t i = first; i < n; i++)
+                data[i] *= gain;
+        }
+
+        static void gain_ramp(float* data, size_t first, size_t frames, unsigned channels,
+                              float start, float step)
+        {
+            for (size_t f = first; f < frames; f++) {
+                const float g = start + step * static_cast<float>(f);
+                for (unsigned c = 0; c < channels; c++)
+                    data[f * channels + c] *= g;
+            }
+        }
+
+        static void mix(float* dst, const float* const* srcs, unsigned count, size_t first, size_t n)
+        {
+            for (size_t i = first; i < n; i++) {
+                float sum = srcs[0][i];
+                for (unsigned k = 1; k < count; k++)
+                    sum += srcs[k][i];
+                dst[i] = sum;
+            }
+        }
+
+        static void clamp(float* data, size_t first, size_t n, float low, float high)
+        {
+            for (size_t i = first; i < n; i++) {
+                const float x = data[i] < low ? low : data[i];
+                data[i] = x > high ? high : x;
+            }
+        }
+
+        static void to_int(const float* src, int32_t* dst, size_t first, size_t n,
+                           float scale, float high, uint32_t* dither)
+        {
+            for (size_t i = first; i < n; i++)
+                dst[i] = quantize(src[i], scale, high, dither);
+        }
+
+        static void to_int16(const float* src, int16_t* dst, size_t first, size_t n, uint32_t* dither)
+        {
+            for (size_t i = first; i < n; i++)
+                dst[i] = static_cast<int16_t>(quantize(src[i], INT16_SCALE, INT16_HIGH, dither));
+        }
+
+        static void from_int(const int32_t* src, float* dst, size_t first, size_t n, float scale)
+        {
+            for (size_t i = first; i < n; i++)
+                dst[i] = static_cast<float>(src[i]) * scale;
+        }
+
+        static void from_int16(const int16_t* src, float* dst, size_t first, size_t n)
+        {
+            for (size_t i = first; i < n; i++)
+                dst[i] = static_cast<float>(src[i]) * (1.0f / INT16_SCALE);
+        }
+
+        static void peak_sumsq(const float* data, size_t first, size_t frames, unsigned channels,
+                               float* peak, double* sumsq)
+        {
+            for (size_t f = first; f < frames; f++) {
+                for (unsigned c = 0; c < channels; c++) {
+                    const float x = data[f * channels + c];
+                    const float a = std::fabs(x);
+                    if (a > peak[c])
+                        peak[c] = a;
+                    sumsq[c] += static_cast<double>(x) * x;
+                }
+            }
+        }
+
+        static void interleave(const float* const* src, float* dst, size_t first, size_t frames,
+                               unsigned channels)
+        {
+            // Blocks of 64 frames keep the strided writes within a few cache lines.
+            for (size_t block = first; block < frames; block += 64) {
+                const size_t end = frames - block < 64 ? frames : block + 64;
+                for (unsigned c = 0; c < channels; c++)
+                    for (size_t f = block; f < end; f++)
+                        dst[f * channels + c] = src[c][f];
+            }
+        }
+
+        static void deinterleave(const float* src, float* const* dst, size_t first, size_t frames,
+                                 unsigned channels)
+        {
+            for (size_t block = first; block < frames; block += 64) {
+                const size_t end = frames - block < 64 ? frames : block + 64;
+                for (unsigned c = 0; c < channels; c++)
+                    for (size_t f = block; f < end; f++)
+                        dst[c][f] = src[f * channels + c];
+            }
+        }
+
+        // Entry points for the dispatch table.
+
+        static void gain_entry(float* data, size_t n, float g)
+        {
+            gain(data, 0, n, g);
+        }
+
+        static void gain_ramp_entry(float* data, size_t frames, unsigned channels, float start, float step)
+        {
+            gain_ramp(data, 0, frames, channels, start, step);
+        }
+
+        static void mix_entry(float* dst, const float* const* srcs, unsigned count, size_t n)
+        {
+            mix(dst, srcs, count, 0, n);
+        }
+
+        static void clamp_entry(float* data, size_t n, float low, float high)
+        {
+            clamp(data, 0, n, low, high);
+        }
+
+        static void to_int_entry(const float* src, int32_t* dst, size_t n, float scale, float high,
+                                 uint32_t* dither)
+        {
+            to_int(src, dst, 0, n, scale, high, dither);
+        }
+
+        static void to_int16_entry(const float* src, int16_t* dst, size_t n, uint32_t* dither)
+        {
+            to_int16(src, dst, 0, n, dither);
+        }
+
+        static void from_int_entry(const int32_t* src, float* dst, size_t n, float scale)
+        {
+            from_int(src, dst, 0, n, scale);
+        }
+
+        static void from_int16_entry(const int16_t* src, float* dst, size_t n)
+        {
+            from_int16(src, dst, 0, n);
+        }
+
+        static void peak_sumsq_entry(const float* data, size_t frames, unsigned channels,
+                                     float* peak, double* sumsq)
+        {
+            peak_sumsq(data, 0, frames, channels, peak, sumsq);
+        }
+
+        static void interleave_entry(const float* const* src, float* dst, size_t frames, unsigned channels)
+        {
+            interleave(src, dst, 0, frames, channels);
+        }
+
+        static void deinterleave_entry(const float* src, float* const* dst, size_t frames, unsigned channels)
+        {
+            deinterleave(src, dst, 0, frames, channels);
+        }
+
+    };
+
+    const table scalar_table = {
+        kernels::SCALAR,
+        scalar::gain_entry,
+        scalar::gain_ramp_entry,
+        scalar::mix_entry,
+        scalar::clamp_entry,
+        scalar::to_int_entry,
+        scalar::to_int16_entry,
+        scalar::from_int_entry,
+        scalar::from_int16_entry,
+        scalar::peak_sumsq_entry,
+        scalar::interleave_entry,
+        scalar::deinterleave_entry
+    };
+
+} // namespace
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                   Vector implementation (x86)                                 */
+/* --------------------------------------------------------------------------------------------- */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Every helper below returning a vector is always_inline, so the ABI change GCC warns
+// about for vector arguments and returns never materializes.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+namespace {
+
+    /**
+     * GCC vector types holding W lanes.
+     */
+    template <int W>
+    struct vector_types {
+        typedef float    vf __attribute__((vector_size(W * 4)));
+        typedef int32_t  vi __attribute__((vector_size(W * 4)));
+        typedef uint32_t vu __attribute__((vector_size(W * 4)));
+        typedef int16_t  vs __attribute__((vector_size(W * 2)));
+    };
+
+    /**
+     * Constant shuffle masks: zip_lo/zip_hi interleave the low/high halves of two
+     * vectors, even/odd pick the even/odd lanes of their concatenation.
+     */
+    template <int W>
+    struct shuffles;
+
+    template <>
+    struct shuffles<4> {
+        typedef vector_types<4>::vi vi;
+        __attribute__((always_inline)) static inline vi zip_lo() { return vi{ 0, 4, 1, 5 }; }
+        __attribute__((always_inline)) static inline vi zip_hi() { return vi{ 2, 6, 3, 7 }; }
+        __attribute__((always_inline)) static inline vi even()   { return vi{ 0, 2, 4, 6 }; }
+        __attribute__((always_inline)) static inline vi odd()    { return vi{ 1, 3, 5, 7 }; }
+    };
+
+    template <>
+    struct shuffles<8> {
+        typedef vector_types<8>::vi vi;
+        __attribute__((always_inline)) static inline vi zip_lo() { return vi{ 0, 8, 1, 9, 2, 10, 3, 11 }; }
+        __attribute__((always_inline)) static inline vi zip_hi() { return vi{ 4, 12, 5, 13, 6, 14, 7, 15 }; }
+        __attribute__((always_inline)) static inline vi even()   { return vi{ 0, 2, 4, 6, 8, 10, 12, 14 }; }
+        __attribute__((always_inline)) static inline vi odd()    { return vi{ 1, 3, 5, 7, 9, 11, 13, 15 }; }
+    };
+
+    template <>
+    struct shuffles<16> {
+        typedef vector_types<16>::vi vi;
+        __attribute__((always_inline)) static inline vi zip_lo()
+        { return vi{ 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23 }; }
+        __attribute__((always_inline)) static inline vi zip_hi()
+        { return vi{ 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31 }; }
+        __attribute__((always_inline)) static inline vi even()
+        { return vi{ 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30 }; }
+        __attribute__((always_inline)) static inline vi odd()
+        { return vi{ 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31 }; }
+    };
+
+    /**
+     * Kernels over W-float GCC vectors. Everything here is always_inline and only
+     * instantiated from functions carrying the matching target attribute, so the
+     * same source compiles to SSE2, AVX2 or AVX-512 code. Loads and stores are
+     * unaligned, since buffers may borrow storage that is not from the pool.
+     */
+    template <int W>
+    struct simd {
+
+        typedef typename vector_types<W>::vf vf;
+        typedef typename vector_types<W>::vi vi;
+        typedef typename vector_types<W>::vu vu;
+        typedef typename vector_types<W>::vs vs;
+
+        template <class V, class T>
+        __attribute__((always_inline))
+        static inline V load(const T* ptr)
+        {
+            V v;
+            __builtin_memcpy(&v, ptr, sizeof(V));
+            return v;
+        }
+
+        template <class V, class T>
+        __attribute__((always_inline))
+        static inline void store(T* ptr, const V& v)
+        {
+            __builtin_memcpy(ptr, &v, sizeof(V));
+        }
+
+        __attribute__((always_inline))
+        static inline vf splat(float x)
+        {
+            return vf{} + x;
+        }
+
+        __attribute__((always_inline))
+        static inline vf tpdf(vu& state)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            const vf a = __builtin_convertvector(state >> 8, vf);
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            const vf b = __builtin_convertvector(state >> 8, vf);
+            return (a - b) * (1.0f / 16777216.0f);
+        }
+
+        __attribute__((always_inline))
+        static inline vi quantize(const vf& in, float scale, float high, uint32_t* dither, vu& state)
+        {
+            vf x = in * scale;
+            if (dither != nullptr)
+                x += tpdf(state);
+            x = x < -scale ? splat(-scale) : x;
+            x = x > high ? splat(high) : x;
+            x += x >= 0.0f ? splat(0.5f) : splat(-0.5f);
+            return __builtin_convertvector(x, vi);
+        }
+
+        __attribute__((always_inline))
+        static inline void gain(float* data, size_t n, float g)
+        {
+            size_t i = 0;
+            for (; i + W <= n; i += W)
+                store(data + i, load<vf>(data + i) * g);
+            scalar::gain(data, i, n, g);
+        }
+
+        __attribute__((always_inline))
+        static inline void gain_ramp(float* data, size_t frames, unsigned channels, float start, float step)
+        {
+            if (W % channels != 0) {
+                scalar::gain_ramp(data, 0, frames, channels, start, step);
+                return;
+            }
+
+            // Each vector spans W / channels whole frames; lane l is in frame l / channels.
+            const unsigned per_vector = W / channels;
+            vf offset;
+            for (int l = 0; l < W; l++)
+                offset[l] = static_cast<float>(l / channels);
+
+            size_t f = 0;
+            for (; f + per_vector <= frames; f += per_vector) {
+                const vf g = start + step * (splat(static_cast<float>(f)) + offset);
+                store(data + f * channels, load<vf>(data + f * channels) * g);
+            }
+            scalar::gain_ramp(data, f, frames, channels, start, step);
+        }
+
+        __attribute__((always_inline))
+        static inline void mix(float* dst, const float* const* srcs, unsigned count, size_t n)
+        {
+            size_t i = 0;
+            for (; i + W <= n; i += W) {
+                vf sum = load<vf>(srcs[0] + i);
+                for (unsigned k = 1; k < count; k++)
+                    sum += load<vf>(srcs[k] + i);
+                store(dst + i, sum);
+            }
+            scalar::mix(dst, srcs, count, i, n);
+        }
+
+        __attribute__((always_inline))
+        static inline void clamp(float* data, size_t n, float low, float high)
+        {
+            size_t i = 0;
+            for (; i + W <= n; i += W) {
+                vf x = load<vf>(data + i);
+                x = x < low ? splat(low) : x;
+                x = x > high ? splat(high) : x;
+                store(data + i, x);
+            }
+            scalar::clamp(data, i, n, low, high);
+        }
+
+        __attribute__((always_inline))
+        static inline void to_int(const float* src, int32_t* dst, size_t n, float scale, float high,
+                                  uint32_t* dither)
+        {
+            vu state = dither != nullptr ? load<vu>(dither) : vu{};
+            size_t i = 0;
+            for (; i + W <= n; i += W)
+                store(dst + i, quantize(load<vf>(src + i), scale, high, dither, state));
+            if (dither != nullptr)
+                store(dither, state);
+            scalar::to_int(src, dst, i, n, scale, high, dither);
+        }
+
+        __attribute__((always_inline))
+        static inline void to_int16(const float* src, int16_t* dst, size_t n, uint32_t* dither)
+        {
+            vu state = dither != nullptr ? load<vu>(dither) : vu{};
+            size_t i = 0;
+            for (; i + W <= n; i += W) {
+                const vi x = quantize(load<vf>(src + i), INT16_SCALE, INT16_HIGH, dither, state);
+                store(dst + i, __builtin_convertvector(x, vs));
+            }
+            if (dither != nullptr)
+                store(dither, state);
+            scalar::to_int16(src, dst, i, n, dither);
+        }
+
+        __attribute__((always_inline))
+        static inline void from_int(const int32_t* src, float* dst, size_t n, float scale)
+        {
+            size_t i = 0;
+            for (; i + W <= n; i += W)
+                store(dst + i, __builtin_convertvector(load<vi>(src + i), vf) * scale);
+            scalar::from_int(src, dst, i, n, scale);
+        }
+
+        __attribute__((always_inline))
+        static inline void from_int16(const int16_t* src, float* dst, size_t n)
+        {
+            size_t i = 0;
+            for (; i + W <= n; i += W)
+                store(dst + i, __builtin_convertvector(load<vs>(src + i), vf) * (1.0f / INT16_SCALE));
+            scalar::from_int16(src, dst, i, n);
+        }
+
+        __attribute__((always_inline))
+        static inline void peak_sumsq(const float* data, size_t frames, unsigned channels,
+                                      float* peak, double* sumsq)
+        {
+            if (W % channels != 0) {
+                scalar::peak_sumsq(data, 0, frames, channels, peak, sumsq);
+                return;
+            }
+
+            // Lane l always holds channel l % channels. Squares are summed in float
+            // and flushed to double every 256 vectors to bound the rounding error.
+            const unsigned per_vector = W / channels;
+            vf     pk  = vf{};
+            vf     acc = vf{};
+            double sums[W] = { };
+            size_t f = 0;
+            unsigned pending = 0;
+
+            for (; f + per_vector <= frames; f += per_vector) {
+                const vf x  = load<vf>(data + f * channels);
+                const vf ax = x < 0.0f ? -x : x;
+                pk   = pk < ax ? ax : pk;
+                acc += x * x;
+                if (++pending == 256) {
+                    for (int l = 0; l < W; l++)
+                        sums[l] += acc[l];
+                    acc = vf{};
+                    pending = 0;
+                }
+            }
+
+            for (int l = 0; l < W; l++) {
+                const unsigned c = l % channels;
+                sumsq[c] += sums[l] + acc[l];
+                if (pk[l] > peak[c])
+                    peak[c] = pk[l];
+            }
+
+            scalar::peak_sumsq(data, f, frames, channels, peak, sumsq);
+        }
+
+        __attribute__((always_inline))
+        static inline void zip(const vf& a, const vf& b, vf& lo, vf& hi)
+        {
+            lo = __builtin_shuffle(a, b, shuffles<W>::zip_lo());
+            hi = __builtin_shuffle(a, b, shuffles<W>::zip_hi());
+        }
+
+        __attribute__((always_inline))
+        static inline void unzip(const vf& a, const vf& b, vf& even, vf& odd)
+        {
+            even = __builtin_shuffle(a, b, shuffles<W>::even());
+            odd  = __builtin_shuffle(a, b, shuffles<W>::odd());
+        }
+
+        __attribute__((always_inline))
+        static inline void interleave(const float* const* src, float* dst, size_t frames, unsigned channels)
+        {
+            size_t f = 0;
+
+            if (channels == 2) {
+                for (; f + W <= frames; f += W) {
+                    vf lo, hi;
+                    zip(load<vf>(src[0] + f), load<vf>(src[1] + f), lo, hi);
+                    store(dst + 2 * f,     lo);
+                    store(dst + 2 * f + W, hi);
+                }
+            } else if (channels == 4) {
+                for (; f + W <= frames; f += W) {
+                    vf ac_lo, ac_hi, bd_lo, bd_hi, out0, out1, out2, out3;
+                    zip(load<vf>(src[0] + f), load<vf>(src[2] + f), ac_lo, ac_hi);
+                    zip(load<vf>(src[1] + f), load<vf>(src[3] + f), bd_lo, bd_hi);
+                    zip(ac_lo, bd_lo, out0, out1);
+                    zip(ac_hi, bd_hi, out2, out3);
+                    store(dst + 4 * f,         out0);
+                    store(dst + 4 * f + W,     out1);
+                    store(dst + 4 * f + 2 * W, out2);
+                    store(dst + 4 * f + 3 * W, out3);
+                }
+            }
+
+            scalar::interleave(src, dst, f, frames, channels);
+        }
+
+        __attribute__((always_inline))
+        static inline void deinterleave(const float* src, float* const* dst, size_t frames, unsigned channels)
+        {
+            size_t f = 0;
+
+            if (channels == 2) {
+                for (; f + W <= frames; f += W) {
+                    vf a, b;
+                    unzip(load<vf>(src + 2 * f), load<vf>(src + 2 * f + W), a, b);
+                    store(dst[0] + f, a);
+                    store(dst[1] + f, b);
+                }
+            } else if (channels == 4) {
+                for (; f + W <= frames; f += W) {
+                    vf ac0, bd0, ac1, bd1, a, b, c, d;
+                    unzip(load<vf>(src + 4 * f),         load<vf>(src + 4 * f + W),     ac0, bd0);
+                    unzip(load<vf>(src + 4 * f + 2 * W), load<vf>(src + 4 * f + 3 * W), ac1, bd1);
+                    unzip(ac0, ac1, a, c);
+                    unzip(bd0, bd1, b, d);
+                    store(dst[0] + f, a);
+                    store(dst[1] + f, b);
+                    store(dst[2] + f, c);
+                    store(dst[3] + f, d);
+                }
+            }
+
+            scalar::deinterleave(src, dst, f, frames, channels);
+        }
+
+    };
+
+} // namespace
+
+#define DEFINE_SIMD_TABLE(prefix, id, target_name, width)                                           \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_gain(float* data, size_t n, float g)                                       \
+    { simd<width>::gain(data, n, g); }                                                              \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_gain_ramp(float* data, size_t frames, unsigned channels, float start,      \
+                                   float step)                                                      \
+    { simd<width>::gain_ramp(data, frames, channels, start, step); }                                \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_mix(float* dst, const float* const* srcs, unsigned count, size_t n)        \
+    { simd<width>::mix(dst, srcs, count, n); }                                                      \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_clamp(float* data, size_t n, float low, float high)                        \
+    { simd<width>::clamp(data, n, low, high); }                                                     \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_to_int(const float* src, int32_t* dst, size_t n, float scale, float high,  \
+                                uint32_t* dither)                                                   \
+    { simd<width>::to_int(src, dst, n, scale, high, dither); }                                      \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_to_int16(const float* src, int16_t* dst, size_t n, uint32_t* dither)       \
+    { simd<width>::to_int16(src, dst, n, dither); }                                                 \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_from_int(const int32_t* src, float* dst, size_t n, float scale)            \
+    { simd<width>::from_int(src, dst, n, scale); }                                                  \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_from_int16(const int16_t* src, float* dst, size_t n)                       \
+    { simd<width>::from_int16(src, dst, n); }                                                       \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_peak_sumsq(const float* data, size_t frames, unsigned channels,            \
+                                    float* peak, double* sumsq)                                     \
+    { simd<width>::peak_sumsq(data, frames, channels, peak, sumsq); }                               \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_interleave(const float* const* src, float* dst, size_t frames,             \
+                                    unsigned channels)                                              \
+    { simd<width>::interleave(src, dst, frames, channels); }                                        \
+    __attribute__((target(target_name)))                                                            \
+    static void prefix##_deinterleave(const float* src, float* const* dst, size_t frames,           \
+                                      unsigned channels)                                            \
+    { simd<width>::deinterleave(src, dst, frames, channels); }                                      \
+    static const table prefix##_table = {                                                           \
+        id, prefix##_gain, prefix##_gain_ramp, prefix##_mix, prefix##_clamp, prefix##_to_int,       \
+        prefix##_to_int16, prefix##_from_int, prefix##_from_int16, prefix##_peak_sumsq,             \
+        prefix##_interleave, prefix##_deinterleave                                                  \
+    };
+
+DEFINE_SIMD_TABLE(sse2,   kernels::SSE2,   "sse2",    4)
+DEFINE_SIMD_TABLE(avx2,   kernels::AVX2,   "avx2",    8)
+DEFINE_SIMD_TABLE(avx512, kernels::AVX512, "avx512f", 16)
+
+#undef DEFINE_SIMD_TABLE
+
+#endif
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                       Runtime dispatch                                        */
+/* --------------------------------------------------------------------------------------------- */
+
+// Constant-initialized, so kernels called during static initialization get the scalar ones.
+static const table* __table = &scalar_table;
+
+static const table* __table_for(kernels::isa value)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    switch (value) {
+        case kernels::SCALAR: return &scalar_table;
+        case kernels::SSE2:   return __builtin_cpu_supports("sse2")    ? &sse2_table   : nullptr;
+        case kernels::AVX2:   return __builtin_cpu_supports("avx2")    ? &avx2_table   : nullptr;
+        case kernels::AVX512: return __builtin_cpu_supports("avx512f") ? &avx512_table : nullptr;
+    }
+    return nullptr;
+#else
+    return value == kernels::SCALAR ? &scalar_table : nullptr;
+#endif
+}
+
+__attribute__((constructor, cold))
+static void __select_best_table()
+{
+    for (int value = kernels::AVX512; value >= kernels::SCALAR; value--) {
+        const table* t = __table_for(static_cast<kernels::isa>(value));
+        if (t != nullptr) {
+            __table = t;
+            break;
+        }
+    }
+}
+
+kernels::isa kernels::active()
+{
+    return __table->id;
+}
+
+const char* kernels::name(isa value)
+{
+    switch (value) {
+        case SCALAR: return "scalar";
+        case SSE2:   return "sse2";
+        case AVX2:   return "avx2";
+        case AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+bool kernels::select(isa value)
+{
+    const table* t = __table_for(value);
+    if (t != nullptr)
+        __table = t;
+    return t != nullptr;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 Module-local static functions                                 */
+/* --------------------------------------------------------------------------------------------- */
+
+/**
+ * Returns the calling thread's dither generator state, one lane per vector lane.
+ */
+static uint32_t* __dither_state(kernels::dither mode)
+{
+    thread_local static uint32_t state[DITHER_LANES];
+    thread_local static bool     seeded = false;
+
+    if (mode == kernels::NO_DITHER)
+        return nullptr;
+
+    if (__builtin_expect(!seeded, 0)) {
+        const uint32_t seed = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(state) >> 4);
+        for (unsigned l = 0; l < DITHER_LANES; l++)
+            state[l] = (seed ^ (0x9E3779B9u * (l + 1))) | 1;
+        seeded = true;
+    }
+
+    return state;
+}
+
+__attribute__((always_inline))
+inline static size_t __samples(const buffer& buf)
+{
+    return static_cast<size_t>(buf.frames()) * buf.channels();
+}
+
+
+/**
+ * Throws unless buf is interleaved, for kernels dealing with interleaved external formats.
+ */
+__attribute__((always_inline))
+inline static void __require_interleaved(const buffer& buf, const char* what)
+{
+    if (__builtin_expect(buf.layout() != fu::audio::INTERLEAVED, 0))
+        throw std::invalid_argument(what);
+}
+
+/**
+ * Array of n items, on the stack up to LOCAL_ITEMS and on the heap beyond, in
+ * place of a variable-length array.
+ */
+template <typename T>
+class __scratch
+{
+    T               _local[LOCAL_ITEMS];
+    std::vector<T>  _heap;
+    T*              _data;
+
+public:
+    explicit __scratch(size_t n)
+        : _heap(n > LOCAL_ITEMS ? n : 0),
+          _data(n > LOCAL_ITEMS ? _heap.data() : _local)
+    { }
+
+    __scratch(const __scratch&) = delete;
+    __scratch& operator=(const __scratch&) = delete;
+
+    __attribute__((always_inline))
+    inline operator T*()
+    {
+        return _data;
+    }
+};
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                          Kernels                                              */
+/* --------------------------------------------------------------------------------------------- */
+
+void kernels::gain(buffer& buf, float gain)
+{
+    if (buf.layout() == PLANAR) {
+        for (unsigned c = 0; c < buf.channels(); c++)
+            __table->gain(buf.data(c), buf.frames(), gain);
+    } else {
+        __table->gain(buf.data(), __samples(buf), gain);
+    }
+}
+
+void kernels::gain_ramp(buffer& buf, float start, float end)
+{
+    if (buf.frames() == 0)
+        return;
+
+    const float step = (end - start) / static_cast<float>(buf.frames());
+
+    if (buf.layout() == PLANAR) {
+        for (unsigned c = 0; c < buf.channels(); c++)
+            __table->gain_ramp(buf.data(c), buf.frames(), 1, start, step);
+    } else {
+        __table->gain_ramp(buf.data(), buf.frames(), buf.channels(), start, step);
+    }
+}
+
+void kernels::mix(buffer& dst, const buffer* const* srcs, unsigned count)
+{
+    if (count == 0)
+        throw std::invalid_argument("audio::kernels::mix");
+
+    const buffer& first = *srcs[0];
+    for (unsigned k = 0; k < count; k++) {
+        if (srcs[k]->frames() != first.frames() || srcs[k]->channels() != first.channels()
+                || srcs[k]->layout() != first.layout())
+            throw std::invalid_argument("audio::kernels::mix");
+    }
+
+    // reset may reallocate dst, which may be one of the sources, so pointers are taken after.
+    dst.reset(first.frames(), first.channels(), first.sample_rate(), first.layout());
+
+    __scratch<const float*> ptrs(count);
+
+    if (dst.layout() == PLANAR) {
+        for (unsigned c = 0; c < dst.channels(); c++) {
+            for (unsigned k = 0; k < count; k++)
+                ptrs[k] = srcs[k]->cdata(c);
+            __table->mix(dst.data(c), ptrs, count, dst.frames());
+        }
+    } else {
+        for (unsigned k = 0; k < count; k++)
+            ptrs[k] = srcs[k]->cdata();
+        __table->mix(dst.data(), ptrs, count, __samples(dst));
+    }
+}
+
+void kernels::clamp(buffer& buf, float low, float high)
+{
+    if (buf.layout() == PLANAR) {
+        for (unsigned c = 0; c < buf.channels(); c++)
+            __table->clamp(buf.data(c), buf.frames(), low, high);
+    } else {
+        __table->clamp(buf.data(), __samples(buf), low, high);
+    }
+}
+
+void kernels::to_int16(const buffer& buf, int16_t* out, dither mode)
+{
+    __require_interleaved(buf, "audio::kernels::to_int16");
+    __table->to_int16(buf.cdata(), out, __samples(buf), __dither_state(mode));
+}
+
+void kernels::to_int24(const buffer& buf, uint8_t* out, dither mode)
+{
+    __require_interleaved(buf, "audio::kernels::to_int24");
+
+    int32_t       temp[PACK_CHUNK];
+    const size_t  n      = __samples(buf);
+    uint32_t*     dither = __dither_state(mode);
+
+    for (size_t i = 0; i < n; i += PACK_CHUNK) {
+        const size_t len = n - i < PACK_CHUNK ? n - i : PACK_CHUNK;
+        __table->to_int(buf.cdata() + i, temp, len, INT24_SCALE, INT24_HIGH, dither);
+        for (size_t j = 0; j < len; j++, out += 3) {
+            out[0] = static_cast<uint8_t>(temp[j]);
+            out[1] = static_cast<uint8_t>(temp[j] >> 8);
+            out[2] = static_cast<uint8_t>(temp[j] >> 16);
+        }
+    }
+}
+
+void kernels::to_int32(const buffer& buf, int32_t* out, dither mode)
+{
+    __require_interleaved(buf, "audio::kernels::to_int32");
+    __table->to_int(buf.cdata(), out, __samples(buf), INT32_SCALE, INT32_HIGH, __dither_state(mode));
+}
+
+void kernels::from_int16(buffer& buf, const int16_t* in)
+{
+    __require_interleaved(buf, "audio::kernels::from_int16");
+    __table->from_int16(in, buf.data(), __samples(buf));
+}
+
+void kernels::from_int24(buffer& buf, const uint8_t* in)
+{
+    __require_interleaved(buf, "audio::kernels::from_int24");
+
+    int32_t       temp[PACK_CHUNK];
+    const size_t  n = __samples(buf);
+
+    for (size_t i = 0; i < n; i += PACK_CHUNK) {
+        const size_t len = n - i < PACK_CHUNK ? n - i : PACK_CHUNK;
+        for (size_t j = 0; j < len; j++, in += 3) {
+            // Place the 24 bits at the top and shift back down to sign-extend.
+            const uint32_t raw = (uint32_t(in[0]) << 8) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 24);
+            temp[j] = static_cast<int32_t>(raw) >> 8;
+        }
+        __table->from_int(temp, buf.data() + i, len, 1.0f / INT24_SCALE);
+    }
+}
+
+void kernels::from_int32(buffer& buf, const int32_t* in)
+{
+    __require_interleaved(buf, "audio::kernels::from_int32");
+    __table->from_int(in, buf.data(), __samples(buf), 1.0f / INT32_SCALE);
+}
+
+void kernels::peak_rms(const buffer& buf, float* peak, float* rms)
+{
+    const unsigned     channels = buf.channels();
+    __scratch<double>  sumsq(channels);
+
+    for (unsigned c = 0; c < channels; c++) {
+        peak[c]  = 0.0f;
+        sumsq[c] = 0.0;
+    }
+
+    if (buf.layout() == PLANAR) {
+        for (unsigned c = 0; c < channels; c++)
+            __table->peak_sumsq(buf.cdata(c), buf.frames(), 1, peak + c, sumsq + c);
+    } else {
+        __table->peak_sumsq(buf.cdata(), buf.frames(), channels, peak, sumsq);
+    }
+
+    for (unsigned c = 0; c < channels; c++)
+        rms[c] = buf.frames() > 0 ? static_cast<float>(std::sqrt(sumsq[c] / buf.frames())) : 0.0f;
+}
+
+void kernels::interleave(const buffer& src, buffer& dst)
+{
+    if (src.layout() != PLANAR || &src == &dst)
+        throw std::invalid_argument("audio::kernels::interleave");
+
+    const unsigned          channels = src.channels();
+    __scratch<const float*> ptrs(channels);
+
+    dst.reset(src.frames(), channels, src.sample_rate(), INTERLEAVED);
+    for (unsigned c = 0; c < channels; c++)
+        ptrs[c] = src.cdata(c);
+
+    __table->interleave(ptrs, dst.data(), src.frames(), channels);
+}
+
+void kernels::deinterleave(const buffer& src, buffer& dst)
+{
+    if (src.layout() != INTERLEAVED || &src == &dst)
+        throw std::invalid_argument("audio::kernels::deinterleave");
+
+    const unsigned    channels = src.channels();
+    __scratch<float*> ptrs(channels);
+
+    dst.reset(src.frames(), channels, src.sample_rate(), PLANAR);
+    for (unsigned c = 0; c < channels; c++)
+        ptrs[c] = dst.data(c);
+
+    __table->deinterleave(src.cdata(), ptrs, src.frames(), channels);
+}
@@ -0,0 +1,162 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef U543E836D_0320_4CFC_A9C6_BD22C3D402C6
+#define U543E836D_0320_4CFC_A9C6_BD22C3D402C6
+
+#include <cstdint>
+
+#include "buffer.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /**
+         * Vectorized operations on audio::buffer contents.
+         *
+         * Every kernel has a scalar reference implementation and SSE2, AVX2 and
+         * AVX-512 variants; the widest one supported by the CPU is selected once,
+         * at startup. Kernels operate on frames() * channels() samples, and
+         * honour the buffer layout; conversions from and to integer samples,
+         * which are always interleaved, require interleaved buffers.
+         */
+        namespace kernels {
+
+            /**
+             * Instruction sets kernels may be compiled for.
+             */
+            enum isa {
+                SCALAR = 0,
+                SSE2   = 1,
+                AVX2   = 2,
+                AVX512 = 3
+            };
+
+            /**
+             * Dither applied when converting to integer samples.
+             */
+            enum dither {
+                NO_DITHER   = 0,
+                TPDF_DITHER = 1   ///< triangular, ±1 LSB
+            };
+
+            /**
+             * Returns the instruction set currently in use.
+             */
+            isa active();
+
+            /**
+             * Returns a printable name for an instruction set.
+             */
+            const char* name(isa value);
+
+            /**
+             * Selects the instruction set to use, e.g. to compare against the
+             * scalar reference.
+             *
+             * @return  true if the CPU supports it, false otherwise (in which case
+             *          nothing changes).
+             */
+            bool select(isa value);
+
+            /**
+             * Multiplies every sample by gain.
+             */
+            void gain(buffer& buf, float gain);
+
+            /**
+             * Multiplies every frame by a gain varying linearly from start (first
+             * frame) towards end (reached one frame past the last one), so that
+             * consecutive ramps join seamlessly.
+             */
+            void gain_ramp(buffer& buf, float start, float end);
+
+            /**
+             * Sums count buffers of identical shape and layout into dst, which is reset to
+             * that shape. dst may be one of the sources.
+             */
+            void mix(buffer& dst, const buffer* const* srcs, unsigned count);
+
+            /**
+             * Clamps every sample to [low, high].
+             */
+            void clamp(buffer& buf, float low = -1.0f, float high = 1.0f);
+
+            /**
+             * Converts samples to signed 16-bit integers, saturating.
+             */
+            void to_int16(const buffer& buf, std::int16_t* out, dither mode = NO_DITHER);
+
+            /**
+             * Converts samples to packed little-endian signed 24-bit integers
+             * (three bytes per sample), saturating.
+             */
+            void to_int24(const buffer& buf, std::uint8_t* out, dither mode = NO_DITHER);
+
+            /**
+             * Converts samples to signed 32-bit integers, saturating.
+             */
+            void to_int32(const buffer& buf, std::int32_t* out, dither mode = NO_DITHER);
+
+            /**
+             * Fills buf, already reset to the wanted shape, from 16-bit integers.
+             */
+            void from_int16(buffer& buf, const std::int16_t* in);
+
+            /**
+             * Fills buf, already reset to the wanted shape, from packed little-endian
+             * 24-bit integers.
+             */
+            void from_int24(buffer& buf, const std::uint8_t* in);
+
+            /**
+             * Fills buf, already reset to the wanted shape, from 32-bit integers.
+             */
+            void from_int32(buffer& buf, const std::int32_t* in);
+
+            /**
+             * Computes peak absolute value and RMS of each channel.
+             *
+             * @param peak  array of channels() floats receiving the peaks
+             * @param rms   array of channels() floats receiving the RMS values
+             */
+            void peak_rms(const buffer& buf, float* peak, float* rms);
+
+            /**
+             * Converts a planar buffer into dst, which is reset to the same shape
+             * with interleaved layout.
+             */
+            void interleave(const buffer& src, buffer& dst);
+
+            /**
+             * Converts an interleaved buffer into dst, which is reset to the same
+             * shape with planar layout.
+             */
+            void deinterleave(const buffer& src, buffer& dst);
+
+        } // namespace kernels
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
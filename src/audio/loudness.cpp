@@ -0,0 +1,512 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "kernels.hpp"
+#include "loudness.hpp"
+
+using std::size_t;
+using std::uint64_t;
+using fu::audio::buffer;
+using fu::audio::loudness_meter;
+
+namespace kernels = fu::audio::kernels;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                    Configurable constants                                     */
+/* --------------------------------------------------------------------------------------------- */
+
+#define LANES               4       // channels filtered together, as doubles
+#define TP_TAPS             12      // taps per phase of the true-peak interpolator
+#define MOMENTARY_BLOCKS    4       // 100 ms sub-blocks per momentary (gating) block
+#define SHORT_TERM_BLOCKS   30      // 100 ms sub-blocks per short-term block
+#define ABSOLUTE_GATE       -70.0   // LUFS
+#define RELATIVE_GATE       -10.0   // LU, for the integrated loudness
+#define RANGE_GATE          -20.0   // LU, for the loudness range
+#define HIST_MIN            -70.0   // LUFS, lower edge of the first bin
+#define HIST_STEP           0.01    // LU per bin
+#define HIST_BINS           8000    // up to +10 LUFS; louder blocks go in the last bin
+#define DENORMAL_FLOOR      1e-30   // filter states below this are flushed at block ends
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+// Every helper below taking or returning a vector is always_inline, so the ABI change
+// GCC warns about for vector arguments and returns never materializes.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+namespace {
+
+    /**
+     * Offsets, in vectors of LANES doubles, of the state of a group of channels.
+     */
+    enum {
+        Z1A, Z2A,               // first K-weighting section (high shelf)
+        Z1B, Z2B,               // second section (high pass)
+        ENERGY,                 // sum of squares since the last sub-block
+        PEAK,                   // largest interpolated magnitude
+        HISTORY,                // 2 * TP_TAPS input samples, newest first from the position
+        GROUP_SIZE = HISTORY + 2 * TP_TAPS
+    };
+
+    typedef double vd __attribute__((vector_size(LANES * sizeof(double))));
+    typedef float  vf __attribute__((vector_size(LANES * sizeof(float))));
+
+    typedef void (*run_function)(const float* data, size_t frames, unsigned channels,
+                                 const double* coefs, const double* taps, unsigned factor,
+                                 double* state, unsigned& position);
+
+}
+
+static const double __minus_inf = -std::numeric_limits<double>::infinity();
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 Module-local static functions                                 */
+/* --------------------------------------------------------------------------------------------- */
+
+static inline double __lufs(double energy)
+{
+    return energy > 0.0 ? -0.691 + 10.0 * std::log10(energy) : __minus_inf;
+}
+
+static inline unsigned __bin(double lufs)
+{
+    const double i = std::floor((lufs - HIST_MIN) / HIST_STEP);
+    return i < 0.0 ? 0 : i >= HIST_BINS ? HIST_BINS - 1 : static_cast<unsigned>(i);
+}
+
+static inline double __bin_lufs(unsigned bin)
+{
+    return HIST_MIN + (bin + 0.5) * HIST_STEP;
+}
+
+__attribute__((always_inline))
+static inline vd __load(const double* p)
+{
+    vd v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+__attribute__((always_inline))
+static inline void __store(double* p, const vd& v)
+{
+    __builtin_memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * K-weights and squares frames of interleaved samples, and tracks their true peak,
+ * LANES channels at a time: each group keeps its filter states in registers for
+ * the whole run, so only the recursion over time is sequential.
+ */
+__attribute__((always_inline))
+static inline void __run(const float* data, size_t frames, unsigned channels, const double* coefs,
+                         const double* taps, unsigned factor, double* state, unsigned& position)
+{
+    const unsigned groups = (channels + LANES - 1) / LANES;
+    unsigned       pos    = position;
+
+    for (unsigned g = 0; g < groups; g++) {
+        double* const  s     = state + g * GROUP_SIZE * LANES;
+        double* const  hist  = s + HISTORY * LANES;
+        const unsigned first = g * LANES;
+        const unsigned used  = std::min(channels - first, static_cast<unsigned>(LANES));
+
+        vd z1a = __load(s + Z1A * LANES), z2a = __load(s + Z2A * LANES);
+        vd z1b = __load(s + Z1B * LANES), z2b = __load(s + Z2B * LANES);
+        vd energy = __load(s + ENERGY * LANES);
+        vd peak   = __load(s + PEAK * LANES);
+
+        pos = position;
+        for (size_t f = 0; f < frames; f++) {
+            const float* frame = data + f * channels + first;
+            vf in;
+            if (used == LANES) {
+                __builtin_memcpy(&in, frame, sizeof(in));
+            } else {
+                in = vf{};
+                for (unsigned l = 0; l < used; l++)
+                    in[l] = frame[l];
+            }
+            const vd x = __builtin_convertvector(in, vd);
+
+            // Transposed direct form II, in double: the high pass sits at 38 Hz,
+            // which float coefficients would move at high sample rates.
+            const vd y1 = coefs[0] * x + z1a;
+            z1a = coefs[1] * x - coefs[3] * y1 + z2a;
+            z2a = coefs[2] * x - coefs[4] * y1;
+            const vd y  = coefs[5] * y1 + z1b;
+            z1b = coefs[6] * y1 - coefs[8] * y + z2b;
+            z2b = coefs[7] * y1 - coefs[9] * y;
+            energy += y * y;
+
+            // The history is stored twice, so the last TP_TAPS samples are contiguous
+            // from pos, newest first.
+            pos = (pos == 0 ? TP_TAPS : pos) - 1;
+            __store(hist + pos * LANES, x);
+            __store(hist + (pos + TP_TAPS) * LANES, x);
+
+            for (unsigned p = 0; p < factor; p++) {
+                const double* t = taps + p * TP_TAPS;
+                vd acc = t[0] * __load(hist + pos * LANES);
+                for (unsigned k = 1; k < TP_TAPS; k++)
+                    acc += t[k] * __load(hist + (pos + k) * LANES);
+                const vd mag = acc < 0.0 ? -acc : acc;
+                peak = peak < mag ? mag : peak;
+            }
+        }
+
+        __store(s + Z1A * LANES, z1a);
+        __store(s + Z2A * LANES, z2a);
+        __store(s + Z1B * LANES, z1b);
+        __store(s + Z2B * LANES, z2b);
+        __store(s + ENERGY * LANES, energy);
+        __store(s + PEAK * LANES, peak);
+    }
+
+    position = pos;
+}
+
+static void __run_default(const float* data, size_t frames, unsigned channels, const double* coefs,
+                          const double* taps, unsigned factor, double* state, unsigned& position)
+{
+    __run(data, frames, channels, coefs, taps, factor, state, position);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static void __run_avx2(const float* data, size_t frames, unsigned channels, const double* coefs,
+                       const double* taps, unsigned factor, double* state, unsigned& position)
+{
+    __run(data, frames, channels, coefs, taps, factor, state, position);
+}
+
+#endif
+
+/**
+ * Returns the variant matching the instruction set kernels currently use.
+ */
+static run_function __run_for(kernels::isa isa)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (isa >= kernels::AVX2)
+        return __run_avx2;
+#else
+    (void) isa;
+#endif
+    return __run_default;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                   fu::audio::loudness_meter                                   */
+/* --------------------------------------------------------------------------------------------- */
+
+loudness_meter::loudness_meter()
+    : _gating_counts(HIST_BINS),
+      _gating_energy(HIST_BINS),
+      _range_counts(HIST_BINS),
+      _range_energy(HIST_BINS)
+{
+    reset();
+}
+
+void loudness_meter::reset()
+{
+    _channels    = 0;
+    _sample_rate = 0;
+    _factor      = 1;
+    _position    = 0;
+    _frames      = 0;
+    _next_block  = 0;
+    _blocks      = 0;
+
+    _taps.clear();
+    _weights.clear();
+    _state.clear();
+    _block_energy.assign(SHORT_TERM_BLOCKS, 0.0);
+    _block_frames.assign(SHORT_TERM_BLOCKS, 0);
+
+    std::fill(_gating_counts.begin(), _gating_counts.end(), 0);
+    std::fill(_gating_energy.begin(), _gating_energy.end(), 0.0);
+    std::fill(_range_counts.begin(), _range_counts.end(), 0);
+    std::fill(_range_energy.begin(), _range_energy.end(), 0.0);
+
+    _momentary      = __minus_inf;
+    _short_term     = __minus_inf;
+    _max_momentary  = __minus_inf;
+    _max_short_term = __minus_inf;
+}
+
+void loudness_meter::configure(unsigned channels, unsigned sample_rate)
+{
+    if (channels == 0 || sample_rate < 10)
+        throw std::invalid_argument("audio::loudness_meter::configure");
+
+    _channels    = channels;
+    _sample_rate = sample_rate;
+    _next_block  = sample_rate / 10;
+    _factor      = sample_rate < 96000 ? 4 : sample_rate < 192000 ? 2 : 1;
+
+    // K-weighting, from the BS.1770 analog prototypes, for any sample rate.
+    const double pi = 3.14159265358979323846;
+    double K  = std::tan(pi * 1681.974450955533 / sample_rate);
+    double Q  = 0.7071752369554196;
+    double Vh = std::pow(10.0, 3.999843853973347 / 20.0);
+    double Vb = std::pow(Vh, 0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+    _coefs[0] = (Vh + Vb * K / Q + K * K) / a0;
+    _coefs[1] = 2.0 * (K * K - Vh) / a0;
+    _coefs[2] = (Vh - Vb * K / Q + K * K) / a0;
+    _coefs[3] = 2.0 * (K * K - 1.0) / a0;
+    _coefs[4] = (1.0 - K / Q + K * K) / a0;
+
+    K  = std::tan(pi * 38.13547087602444 / sample_rate);
+    Q  = 0.5003270373238773;
+    a0 = 1.0 + K / Q + K * K;
+    _coefs[5] = 1.0;
+    _coefs[6] = -2.0;
+    _coefs[7] = 1.0;
+    _coefs[8] = 2.0 * (K * K - 1.0) / a0;
+    _coefs[9] = (1.0 - K / Q + K * K) / a0;
+
+    // Hann-windowed sinc interpolator, split in phases each normalized to unity
+    // gain; without oversampling, a plain delay.
+    const unsigned length = TP_TAPS * _factor;
+    _taps.assign(length, 0.0);
+    if (_factor == 1) {
+        _taps[0] = 1.0;
+    } else {
+        for (unsigned p = 0; p < _factor; p++) {
+            double sum = 0.0;
+            for (unsigned k = 0; k < TP_TAPS; k++) {
+                const unsigned n = k * _factor + p;
+                const double   t = (n - (length - 1) / 2.0) / _factor;
+                const double   w = 0.5 - 0.5 * std::cos(2.0 * pi * (n + 1) / (length + 1));
+                const double   h = (t == 0.0 ? 1.0 : std::sin(pi * t) / (pi * t)) * w;
+                _taps[p * TP_TAPS + k] = h;
+                sum += h;
+            }
+            for (unsigned k = 0; k < TP_TAPS; k++)
+                _taps[p * TP_TAPS + k] /= sum;
+        }
+    }
+
+    _weights.assign(channels, 1.0);
+    for (unsigned c = 0; c < channels; c++) {
+        if (channels == 5 && c >= 3)
+            _weights[c] = 1.41;
+        else if ((channels == 6 || channels == 8) && c == 3)
+            _weights[c] = 0.0;
+        else if ((channels == 6 || channels == 8) && c > 3)
+            _weights[c] = 1.41;
+    }
+
+    const unsigned groups = (channels + LANES - 1) / LANES;
+    _state.assign(static_cast<size_t>(groups) * GROUP_SIZE * LANES, 0.0);
+    _position = 0;
+}
+
+void loudness_meter::end_block()
+{
+    const uint64_t start = _blocks * _sample_rate / 10;
+
+    double sum = 0.0;
+    for (unsigned c = 0; c < _channels; c++) {
+        double* s = &_state[(c / LANES) * GROUP_SIZE * LANES];
+        sum += _weights[c] * s[ENERGY * LANES + c % LANES];
+        s[ENERGY * LANES + c % LANES] = 0.0;
+    }
+    for (double& z: _state) {
+        if (std::fabs(z) < DENORMAL_FLOOR)
+            z = 0.0;
+    }
+
+    const unsigned slot = _blocks % SHORT_TERM_BLOCKS;
+    _block_energy[slot] = sum;
+    _block_frames[slot] = static_cast<unsigned>(_frames - start);
+    _blocks++;
+    _next_block = (_blocks + 1) * _sample_rate / 10;
+
+    // Momentary blocks are the gating blocks: 400 ms, every 100 ms.
+    if (_blocks >= MOMENTARY_BLOCKS) {
+        double   energy = 0.0;
+        uint64_t frames = 0;
+        for (unsigned i = 1; i <= MOMENTARY_BLOCKS; i++) {
+            const unsigned j = (_blocks - i) % SHORT_TERM_BLOCKS;
+            energy += _block_energy[j];
+            frames += _block_frames[j];
+        }
+        const double z = energy / frames;
+        _momentary     = __lufs(z);
+        _max_momentary = std::max(_max_momentary, _momentary);
+        if (_momentary > ABSOLUTE_GATE) {
+            const unsigned bin = __bin(_momentary);
+            _gating_counts[bin]++;
+            _gating_energy[bin] += z;
+        }
+    }
+
+    if (_blocks >= SHORT_TERM_BLOCKS) {
+        double   energy = 0.0;
+        uint64_t frames = 0;
+        for (unsigned j = 0; j < SHORT_TERM_BLOCKS; j++) {
+            energy += _block_energy[j];
+            frames += _block_frames[j];
+        }
+        const double z  = energy / frames;
+        _short_term     = __lufs(z);
+        _max_short_term = std::max(_max_short_term, _short_term);
+        if (_short_term > ABSOLUTE_GATE) {
+            const unsigned bin = __bin(_short_term);
+            _range_counts[bin]++;
+            _range_energy[bin] += z;
+        }
+    }
+}
+
+__attribute__((hot))
+void loudness_meter::consume(const buffer& buf)
+{
+    if (buf.frames() == 0)
+        return;
+
+    if (__builtin_expect(_channels == 0, 0))
+        configure(buf.channels(), buf.sample_rate());
+    else if (buf.channels() != _channels || buf.sample_rate() != _sample_rate)
+        throw std::invalid_argument("audio::loudness_meter::consume");
+
+    const buffer* src = &buf;
+    if (buf.layout() == PLANAR) {
+        kernels::interleave(buf, _interleaved);
+        src = &_interleaved;
+    }
+
+    const run_function run  = __run_for(kernels::active());
+    const float*       data = src->cdata();
+    size_t             left = src->frames();
+
+    while (left > 0) {
+        const size_t n = static_cast<size_t>(std::min<uint64_t>(left, _next_block - _frames));
+        run(data, n, _channels, _coefs, _taps.data(), _factor, _state.data(), _position);
+
+        data   += n * _channels;
+        left   -= n;
+        _frames += n;
+        if (_frames == _next_block)
+            end_block();
+    }
+}
+
+double loudness_meter::integrated() const
+{
+    uint64_t count  = 0;
+    double   energy = 0.0;
+    for (unsigned i = 0; i < HIST_BINS; i++) {
+        count  += _gating_counts[i];
+        energy += _gating_energy[i];
+    }
+    if (count == 0)
+        return __minus_inf;
+
+    const double gate = __lufs(energy / count) + RELATIVE_GATE;
+
+    count  = 0;
+    energy = 0.0;
+    for (unsigned i = __bin(gate); i < HIST_BINS; i++) {
+        if (__bin_lufs(i) > gate) {
+            count  += _gating_counts[i];
+            energy += _gating_energy[i];
+        }
+    }
+
+    return count > 0 ? __lufs(energy / count) : __minus_inf;
+}
+
+double loudness_meter::range() const
+{
+    uint64_t count  = 0;
+    double   energy = 0.0;
+    for (unsigned i = 0; i < HIST_BINS; i++) {
+        count  += _range_counts[i];
+        energy += _range_energy[i];
+    }
+    if (count == 0)
+        return 0.0;
+
+    const double gate  = __lufs(energy / count) + RANGE_GATE;
+    unsigned     first = __bin(gate);
+    if (__bin_lufs(first) <= gate)
+        first++;
+
+    count = 0;
+    for (unsigned i = first; i < HIST_BINS; i++)
+        count += _range_counts[i];
+    if (count == 0)
+        return 0.0;
+
+    // 10th and 95th percentiles of the short-term values above the gate.
+    const uint64_t low_rank  = static_cast<uint64_t>(0.10 * (count - 1));
+    const uint64_t high_rank = static_cast<uint64_t>(0.95 * (count - 1));
+    double   low = 0.0, high = 0.0;
+    uint64_t seen = 0;
+    for (unsigned i = first; i < HIST_BINS; i++) {
+        const uint64_t before = seen;
+        seen += _range_counts[i];
+        if (before <= low_rank && low_rank < seen)
+            low = __bin_lufs(i);
+        if (before <= high_rank && high_rank < seen) {
+            high = __bin_lufs(i);
+            break;
+        }
+    }
+
+    return high - low;
+}
+
+double loudness_meter::true_peak(unsigned channel) const
+{
+    if (channel >= _channels)
+        throw std::invalid_argument("audio::loudness_meter::true_peak");
+
+    const double peak = _state[(channel / LANES) * GROUP_SIZE * LANES + PEAK * LANES + channel % LANES];
+    return 20.0 * std::log10(peak);
+}
+
+double loudness_meter::true_peak() const
+{
+    double peak = __minus_inf;
+    for (unsigned c = 0; c < _channels; c++)
+        peak = std::max(peak, true_peak(c));
+    return peak;
+}
@@ -0,0 +1,169 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef UDDFD56BD_15FC_478F_8F98_9F563FBCC4BC
+#define UDDFD56BD_15FC_478F_8F98_9F563FBCC4BC
+
+#include <cstdint>
+#include <vector>
+
+#include "buffer.hpp"
+#include "stage.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                fu::audio::loudness_meter                              */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Sink stage measuring loudness as ITU-R BS.1770-4 and EBU R128 define it:
+         * integrated, momentary (400 ms) and short-term (3 s) loudness in LUFS,
+         * loudness range in LU (EBU Tech 3342) and true peak in dBTP.
+         *
+         * The stream is K-weighted and squared in 100 ms sub-blocks, from which the
+         * gating blocks are summed; gated quantities come from histograms of 0.01
+         * LU bins, so memory does not grow with the length of the stream. Filters
+         * and the true-peak interpolator (4x below 96 kHz, 2x below 192 kHz) run
+         * on groups of channels in vector lanes.
+         *
+         * Channels are weighted as in BS.1770: with 5 channels, the last two are
+         * taken as surrounds (+1.5 dB); with 6 or 8, the fourth is taken as LFE and
+         * ignored, and the ones after it as surrounds.
+         * Results are meant to be read once the stream is over, or from the thread
+         * running the sink.
+         */
+        class loudness_meter : public sink
+        {
+            unsigned               _channels;
+            unsigned               _sample_rate;
+            unsigned               _factor;         // true-peak oversampling
+            double                 _coefs[10];      // b0 b1 b2 a1 a2 of both K-weighting sections
+            std::vector<double>    _taps;           // true-peak interpolator, phase by phase
+            std::vector<double>    _weights;
+            std::vector<double>    _state;          // filters, energies and peaks, by group of lanes
+            unsigned               _position;       // in the true-peak history
+
+            std::uint64_t          _frames;         // since the start of the stream
+            std::uint64_t          _next_block;     // frame ending the current sub-block
+            std::uint64_t          _blocks;         // sub-blocks completed
+            std::vector<double>    _block_energy;   // last sub-blocks, weighted, in a ring
+            std::vector<unsigned>  _block_frames;
+
+            std::vector<std::uint64_t> _gating_counts;  // momentary blocks, by loudness bin
+            std::vector<double>        _gating_energy;
+            std::vector<std::uint64_t> _range_counts;   // short-term values, by loudness bin
+            std::vector<double>        _range_energy;
+
+            double                 _momentary;
+            double                 _short_term;
+            double                 _max_momentary;
+            double                 _max_short_term;
+
+            buffer                 _interleaved;
+
+            void configure(unsigned channels, unsigned sample_rate);
+            void end_block();
+
+        public:
+            /**
+             * Creates a meter, set up by the first buffer it consumes.
+             */
+            loudness_meter();
+
+            /**
+             * Forgets everything measured, so that the meter can take another stream.
+             */
+            void reset();
+
+            /**
+             * Measures a block; planar buffers are interleaved first.
+             *
+             * @throws std::invalid_argument if the shape of the stream changes.
+             */
+            virtual void consume(const buffer& buf) override;
+
+            /**
+             * Returns the integrated loudness (LUFS) of the stream so far, -inf if no
+             * block passed the gates.
+             */
+            double integrated() const;
+
+            /**
+             * Returns the loudness range (LU) of the stream so far, zero if too short.
+             */
+            double range() const;
+
+            /**
+             * Returns the loudness (LUFS) of the last 400 ms, -inf before the first.
+             */
+            __attribute__((always_inline))
+            inline double momentary() const
+            {
+                return _momentary;
+            }
+
+            /**
+             * Returns the loudness (LUFS) of the last 3 s, -inf before the first.
+             */
+            __attribute__((always_inline))
+            inline double short_term() const
+            {
+                return _short_term;
+            }
+
+            /**
+             * Returns the largest momentary loudness (LUFS) so far.
+             */
+            __attribute__((always_inline))
+            inline double max_momentary() const
+            {
+                return _max_momentary;
+            }
+
+            /**
+             * Returns the largest short-term loudness (LUFS) so far.
+             */
+            __attribute__((always_inline))
+            inline double max_short_term() const
+            {
+                return _max_short_term;
+            }
+
+            /**
+             * Returns the true peak (dBTP) of a channel, -inf if silent.
+             */
+            double true_peak(unsigned channel) const;
+
+            /**
+             * Returns the true peak (dBTP) over every channel.
+             */
+            double true_peak() const;
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
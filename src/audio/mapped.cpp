@@ -0,0 +1,277 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../logger.hpp"
+#include "mapped.hpp"
+
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint16_t;
+using std::uint32_t;
+using std::uint64_t;
+using fu::audio::buffer;
+using fu::audio::mapped_reader;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                    Configurable constants                                     */
+/* --------------------------------------------------------------------------------------------- */
+
+#define READ_AHEAD      (8 << 20)   // bytes asked ahead of the position with MADV_WILLNEED
+#define DROP_LAG        (32 << 20)  // bytes kept behind the position before MADV_DONTNEED
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("mapped");
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 Module-local static functions                                 */
+/* --------------------------------------------------------------------------------------------- */
+
+static inline uint16_t __read16(const char* p)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint16_t>(u[0] | u[1] << 8);
+}
+
+static inline uint32_t __read32(const char* p)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(u[0]) | static_cast<uint32_t>(u[1]) << 8
+         | static_cast<uint32_t>(u[2]) << 16 | static_cast<uint32_t>(u[3]) << 24;
+}
+
+static inline size_t __page_floor(size_t offset)
+{
+    static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return offset & ~(page - 1);
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                   fu::audio::mapped_reader                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+mapped_reader::mapped_reader(const string& path, unsigned block_frames)
+    : _path(path),
+      _map(nullptr),
+      _map_size(0),
+      _data(nullptr),
+      _frames(0),
+      _channels(0),
+      _sample_rate(0),
+      _block_frames(block_frames),
+      _position(0),
+      _ahead(0),
+      _dropped(0)
+{
+    if (block_frames == 0)
+        throw std::invalid_argument("audio::mapped_reader::mapped_reader");
+
+    map();
+    try {
+        parse_wav();
+    } catch (...) {
+        munmap(_map, _map_size);
+        throw;
+    }
+
+    FU_LOG(__log, fu::DEBUG) << "mapped " << path << ": " << _channels << " channels, "
+                     << _sample_rate << " Hz, " << _frames << " frames";
+}
+
+mapped_reader::mapped_reader(const string& path, unsigned channels, unsigned sample_rate,
+                             unsigned block_frames)
+    : _path(path),
+      _map(nullptr),
+      _map_size(0),
+      _data(nullptr),
+      _frames(0),
+      _channels(channels),
+      _sample_rate(sample_rate),
+      _block_frames(block_frames),
+      _position(0),
+      _ahead(0),
+      _dropped(0)
+{
+    if (channels == 0 || sample_rate == 0 || block_frames == 0)
+        throw std::invalid_argument("audio::mapped_reader::mapped_reader");
+
+    map();
+    _data   = _map;
+    _frames = _map_size / (sizeof(float) * channels); // a trailing partial frame is ignored
+
+    FU_LOG(__log, fu::DEBUG) << "mapped " << path << ": " << _channels << " channels, "
+                     << _sample_rate << " Hz, " << _frames << " frames (raw)";
+}
+
+mapped_reader::~mapped_reader()
+{
+    if (_map != nullptr)
+        munmap(_map, _map_size);
+}
+
+void mapped_reader::map()
+{
+    const int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw runtime_error(_path + ": " + strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        const int error = errno;
+        ::close(fd);
+        throw runtime_error(_path + ": " + strerror(error));
+    }
+
+    _map_size = static_cast<size_t>(st.st_size);
+    if (_map_size == 0) {
+        ::close(fd);
+        return;
+    }
+
+    // Private and writable: stages may scale samples in place, and the first write
+    // to a page copies it instead of reaching the file.
+    void* map = mmap(nullptr, _map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    const int error = errno;
+    ::close(fd);
+    if (map == MAP_FAILED)
+        throw runtime_error(_path + ": " + strerror(error));
+
+    _map = static_cast<char*>(map);
+    madvise(_map, _map_size, MADV_SEQUENTIAL);
+}
+
+void mapped_reader::parse_wav()
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    throw std::invalid_argument(_path + ": WAV files can only be mapped on little-endian hosts");
+#endif
+
+    const char* const end = _map + _map_size;
+    if (_map_size < 12 || memcmp(_map, "RIFF", 4) != 0 || memcmp(_map + 8, "WAVE", 4) != 0)
+        throw std::invalid_argument(_path + ": not a WAV file");
+
+    bool format = false;
+    for (const char* chunk = _map + 12; end - chunk >= 8; ) {
+        const uint32_t size = __read32(chunk + 4);
+        const char*    body = chunk + 8;
+
+        if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16 && end - body >= 16) {
+            uint16_t tag = __read16(body);
+            if (tag == 0xFFFE && size >= 40 && end - body >= 40)
+                tag = __read16(body + 24); // WAVE_FORMAT_EXTENSIBLE: first bytes of the subformat GUID
+            if (tag != 3 || __read16(body + 14) != 32)
+                throw std::invalid_argument(_path + ": not 32-bit float samples");
+
+            _channels    = __read16(body + 2);
+            _sample_rate = __read32(body + 4);
+            if (_channels == 0 || _sample_rate == 0)
+                throw std::invalid_argument(_path + ": bad format chunk");
+            format = true;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!format)
+                throw std::invalid_argument(_path + ": data chunk before format chunk");
+
+            // Writers that could not seek back leave the size at zero or 0xFFFFFFFF;
+            // either way, the data stops at the end of the file.
+            size_t bytes = static_cast<size_t>(end - body);
+            if (size != 0 && size != 0xFFFFFFFF)
+                bytes = std::min(bytes, static_cast<size_t>(size));
+
+            _data   = body;
+            _frames = bytes / (sizeof(float) * _channels);
+            return;
+        }
+
+        if (static_cast<size_t>(end - body) < size)
+            break;
+        chunk = body + size + (size & 1);
+    }
+
+    throw std::invalid_argument(_path + ": no data chunk");
+}
+
+void mapped_reader::advise(size_t begin, size_t end)
+{
+    // Asks for the next window when the position gets halfway through the current one,
+    // so the disk stays busy while the pipeline works on what has been read.
+    if (end + READ_AHEAD / 2 > _ahead && _ahead < _map_size) {
+        const size_t from = __page_floor(std::max(_ahead, begin));
+        _ahead = std::min(end + READ_AHEAD, _map_size);
+        madvise(_map + from, _ahead - from, MADV_WILLNEED);
+    }
+
+    // Dropping pages instead of unmapping them keeps late views readable: their
+    // samples are faulted back in from the file.
+    if (begin > DROP_LAG) {
+        const size_t drop = __page_floor(begin - DROP_LAG);
+        if (drop > _dropped) {
+            madvise(_map + _dropped, drop - _dropped, MADV_DONTNEED);
+            _dropped = drop;
+        }
+    }
+}
+
+__attribute__((hot))
+bool mapped_reader::produce(buffer& buf)
+{
+    if (_position >= _frames)
+        return false;
+
+    const unsigned frames = static_cast<unsigned>(
+        std::min<uint64_t>(_block_frames, _frames - _position));
+    const size_t bytes = static_cast<size_t>(frames) * _channels * sizeof(float);
+    const char*  first = _data + _position * _channels * sizeof(float);
+
+    advise(static_cast<size_t>(first - _map), static_cast<size_t>(first - _map) + bytes);
+
+    if (__builtin_expect(reinterpret_cast<uintptr_t>(first) % alignof(float) == 0, 1)) {
+        buf.borrow(reinterpret_cast<float*>(const_cast<char*>(first)), frames, _channels,
+                   _sample_rate);
+    } else {
+        buf.reset(frames, _channels, _sample_rate);
+        memcpy(buf.data(), first, bytes);
+    }
+
+    _position += frames;
+    if (_position >= _frames)
+        buf.finish();
+
+    return true;
+}
@@ -0,0 +1,141 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef UB6D5B6FE_3856_407D_9936_0D2B96D25C70
+#define UB6D5B6FE_3856_407D_9936_0D2B96D25C70
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "buffer.hpp"
+#include "stage.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                fu::audio::mapped_reader                               */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Source stage reading 32-bit float WAV or raw files through a memory
+         * mapping, without copying: buffers it produces borrow the pages of the
+         * data chunk (see buffer::borrow()), so the reader must outlive them.
+         *
+         * The mapping is private, so stages may modify samples in place without
+         * touching the file. Pages are read ahead of the position, and dropped
+         * well behind it, so memory use stays flat; samples dropped are read
+         * from the file again if touched, losing changes made to them.
+         */
+        class mapped_reader : public source
+        {
+            std::string    _path;
+            char*          _map;
+            std::size_t    _map_size;
+            const char*    _data;           // first byte of the samples
+            std::uint64_t  _frames;
+            unsigned       _channels;
+            unsigned       _sample_rate;
+            unsigned       _block_frames;
+            std::uint64_t  _position;
+            std::size_t    _ahead;          // end of the pages read ahead, from _map
+            std::size_t    _dropped;        // end of the pages dropped, from _map
+
+            void map();
+            void parse_wav();
+            void advise(std::size_t begin, std::size_t end);
+
+        public:
+            /**
+             * Opens a WAV file of 32-bit float samples.
+             *
+             * @param path          path of the file
+             * @param block_frames  number of frames per buffer
+             *
+             * @throws std::runtime_error if the file cannot be mapped,
+             *         std::invalid_argument if it is not a float WAV file.
+             */
+            explicit mapped_reader(const std::string& path, unsigned block_frames = 4096);
+
+            /**
+             * Opens a raw file of interleaved 32-bit float samples, in host byte order.
+             *
+             * @param path          path of the file
+             * @param channels      number of channels
+             * @param sample_rate   sample rate (Hz)
+             * @param block_frames  number of frames per buffer
+             *
+             * @throws std::runtime_error if the file cannot be mapped.
+             */
+            mapped_reader(const std::string& path, unsigned channels, unsigned sample_rate,
+                          unsigned block_frames = 4096);
+
+            mapped_reader(const mapped_reader&) = delete;
+            mapped_reader& operator=(const mapped_reader&) = delete;
+
+            /**
+             * Unmaps the file.
+             */
+            virtual ~mapped_reader();
+
+            /**
+             * Returns the number of channels of the file.
+             */
+            __attribute__((always_inline))
+            inline unsigned channels() const
+            {
+                return _channels;
+            }
+
+            /**
+             * Returns the sample rate (Hz) of the file.
+             */
+            __attribute__((always_inline))
+            inline unsigned sample_rate() const
+            {
+                return _sample_rate;
+            }
+
+            /**
+             * Returns the number of frames in the file.
+             */
+            __attribute__((always_inline))
+            inline std::uint64_t frames() const
+            {
+                return _frames;
+            }
+
+            /**
+             * Makes buf a view of the next block_frames frames (fewer for the last
+             * block, which is marked as finished). Samples not 4-byte aligned in
+             * the file are copied instead.
+             */
+            virtual bool produce(buffer& buf) override;
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
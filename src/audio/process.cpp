@@ -0,0 +1,606 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../logger.hpp"
+#include "kernels.hpp"
+#include "process.hpp"
+
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::to_string;
+using std::uint8_t;
+using std::vector;
+using fu::audio::buffer;
+using fu::audio::child_process;
+using fu::audio::pcm_format;
+using fu::audio::process_sink;
+using fu::audio::process_source;
+using fu::audio::process_transform;
+
+namespace kernels = fu::audio::kernels;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Configurable constants                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+#define PIPE_SIZE     (1 << 20)     // bytes asked for with F_SETPIPE_SZ
+#define READ_CHUNK    (1 << 16)     // bytes read at once from a filter
+#define SPLICE_RING   PIPE_SIZE     // bytes a sink keeps spliced into the pipe at most
+#define DRAIN_SPINS   64            // yields before sleeping while a spliced pipe drains
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("process");
+
+static std::once_flag __sigpipe_once;
+
+// libpipeline keeps global state, and our ends of the pipes must be close-on-exec
+// before another child is forked, or it would hold them open.
+static std::mutex     __start_lock;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                       Helper functions                                        */
+/* --------------------------------------------------------------------------------------------- */
+
+/**
+ * Makes writes to a pipe whose reader exited fail with EPIPE instead of killing us,
+ * unless the application installed its own handler.
+ */
+static void __ignore_sigpipe()
+{
+    std::call_once(__sigpipe_once, [] {
+        struct sigaction old;
+        if (sigaction(SIGPIPE, nullptr, &old) == 0 && old.sa_handler == SIG_DFL)
+            signal(SIGPIPE, SIG_IGN);
+    });
+}
+
+static runtime_error __error(const string& what)
+{
+    return runtime_error(what + ": " + std::strerror(errno));
+}
+
+static void __grow_pipe(int fd)
+{
+    if (fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE) < 0)
+        FU_LOG(__log, fu::DEBUG) << "cannot grow pipe to " << PIPE_SIZE << " bytes: " << std::strerror(errno);
+}
+
+static void __set_nonblocking(int fd)
+{
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        throw __error("audio::process_transform: fcntl");
+}
+
+/**
+ * Closes our end of a pipe, while keeping the descriptor number valid for
+ * pipeline_wait, which closes it.
+ */
+static void __replace_with_null(int fd, int flags)
+{
+    const int null = open("/dev/null", flags | O_CLOEXEC);
+    if (null >= 0) {
+        dup3(null, fd, O_CLOEXEC);
+        close(null);
+    }
+}
+
+/**
+ * Reads until size bytes or end of file.
+ *
+ * @return  number of bytes read.
+ */
+static size_t __read_full(int fd, uint8_t* data, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        const ssize_t n = read(fd, data + done, size - done);
+        if (n > 0)
+            done += static_cast<size_t>(n);
+        else if (n == 0)
+            break;
+        else if (errno != EINTR)
+            throw __error("audio::process_source: read");
+    }
+
+    return done;
+}
+
+static void __write_full(int fd, const uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t n = write(fd, data, size);
+        if (n >= 0) {
+            data += n;
+            size -= static_cast<size_t>(n);
+        } else if (errno != EINTR) {
+            throw __error("audio::process_sink: write");
+        }
+    }
+}
+
+/**
+ * Hands memory to a pipe with vmsplice, which makes the pipe reference the pages
+ * instead of copying them.
+ *
+ * @return  number of bytes spliced, less than size if vmsplice is not supported
+ *          for this descriptor.
+ */
+static size_t __vmsplice(int fd, const uint8_t* data, size_t size)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<uint8_t*>(data);
+    iov.iov_len  = size;
+
+    while (iov.iov_len > 0) {
+        const ssize_t n = vmsplice(fd, &iov, 1, 0);
+        if (n >= 0) {
+            iov.iov_base = static_cast<uint8_t*>(iov.iov_base) + n;
+            iov.iov_len -= static_cast<size_t>(n);
+        } else if (errno == EINVAL || errno == ENOSYS) {
+            break;
+        } else if (errno != EINTR) {
+            throw __error("audio::process_sink: vmsplice");
+        }
+    }
+
+    return size - iov.iov_len;
+}
+
+/**
+ * Waits until at most max bytes are left in a pipe, i.e. until the reader took
+ * the older ones, so that memory spliced for those may be reused.
+ */
+static void __wait_queued(int fd, size_t max)
+{
+    for (unsigned spins = 0; ; spins++) {
+        int queued = 0;
+        if (ioctl(fd, FIONREAD, &queued) < 0)
+            throw __error("audio::process_sink: FIONREAD");
+        if (static_cast<size_t>(queued) <= max)
+            return;
+
+        // The write end of a pipe reports POLLERR once the reader is gone.
+        struct pollfd pfd = { fd, 0, 0 };
+        if (poll(&pfd, 1, spins < DRAIN_SPINS ? 0 : 1) > 0 && (pfd.revents & POLLERR))
+            throw runtime_error("audio::process_sink: encoder closed its input");
+        if (spins < DRAIN_SPINS)
+            sched_yield();
+    }
+}
+
+/**
+ * Appends whatever is ready on a non-blocking descriptor to bytes.
+ *
+ * @return  false at end of file.
+ */
+static bool __read_available(int fd, vector<uint8_t>& bytes)
+{
+    for (;;) {
+        const size_t old = bytes.size();
+        bytes.resize(old + READ_CHUNK);
+
+        const ssize_t n = read(fd, bytes.data() + old, READ_CHUNK);
+        bytes.resize(old + (n > 0 ? static_cast<size_t>(n) : 0));
+
+        if (n == 0)
+            return false;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            if (errno != EINTR)
+                throw __error("audio::process_transform: read");
+        }
+    }
+}
+
+/**
+ * Converts raw samples into an interleaved buffer, whose size is already set.
+ */
+static void __decode(pcm_format format, const uint8_t* bytes, buffer& buf)
+{
+    switch (format) {
+    case fu::audio::PCM_FLOAT:
+        std::memcpy(buf.data(), bytes, static_cast<size_t>(buf.frames()) * buf.channels() * sizeof(float));
+        break;
+    case fu::audio::PCM_INT16:
+        kernels::from_int16(buf, reinterpret_cast<const std::int16_t*>(bytes));
+        break;
+    case fu::audio::PCM_INT24:
+        kernels::from_int24(buf, bytes);
+        break;
+    case fu::audio::PCM_INT32:
+        kernels::from_int32(buf, reinterpret_cast<const std::int32_t*>(bytes));
+        break;
+    }
+}
+
+/**
+ * Converts an interleaved buffer into raw integer samples.
+ */
+static void __encode(pcm_format format, const buffer& buf, vector<uint8_t>& bytes)
+{
+    bytes.resize(static_cast<size_t>(buf.frames()) * buf.channels() * fu::audio::sample_bytes(format));
+
+    switch (format) {
+    case fu::audio::PCM_FLOAT:
+        std::memcpy(bytes.data(), buf.cdata(), bytes.size());
+        break;
+    case fu::audio::PCM_INT16:
+        kernels::to_int16(buf, reinterpret_cast<std::int16_t*>(bytes.data()));
+        break;
+    case fu::audio::PCM_INT24:
+        kernels::to_int24(buf, bytes.data());
+        break;
+    case fu::audio::PCM_INT32:
+        kernels::to_int32(buf, reinterpret_cast<std::int32_t*>(bytes.data()));
+        break;
+    }
+}
+
+unsigned fu::audio::sample_bytes(pcm_format format)
+{
+    switch (format) {
+    case PCM_INT16: return 2;
+    case PCM_INT24: return 3;
+    default:        return 4;
+    }
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                   fu::audio::child_process                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+child_process::child_process(const vector<string>& argv, bool want_in, bool want_out)
+    : _pipeline(nullptr), _waited(false)
+{
+    if (argv.empty())
+        throw std::invalid_argument("audio::child_process: empty command");
+
+    __ignore_sigpipe();
+
+    pipecmd* cmd = pipecmd_new(argv[0].c_str());
+    for (size_t i = 1; i < argv.size(); i++)
+        pipecmd_arg(cmd, argv[i].c_str());
+
+    _name     = argv[0];
+    _pipeline = pipeline_new();
+    pipeline_command(_pipeline, cmd);
+    if (want_in)
+        pipeline_want_in(_pipeline, -1);
+    if (want_out)
+        pipeline_want_out(_pipeline, -1);
+
+    {
+        std::lock_guard<std::mutex> lock(__start_lock);
+        pipeline_start(_pipeline);
+        if (want_in)
+            fcntl(infd(), F_SETFD, FD_CLOEXEC);
+        if (want_out)
+            fcntl(outfd(), F_SETFD, FD_CLOEXEC);
+    }
+
+    if (want_in)
+        __grow_pipe(infd());
+    if (want_out)
+        __grow_pipe(outfd());
+
+    FU_LOG(__log, fu::DEBUG) << "started " << _name;
+}
+
+child_process::~child_process()
+{
+    if (!_waited) {
+        // A child still writing gets SIGPIPE, one still reading gets end of file.
+        if (infd() >= 0)
+            __replace_with_null(infd(), O_WRONLY);
+        if (outfd() >= 0)
+            __replace_with_null(outfd(), O_RDONLY);
+        pipeline_wait(_pipeline);
+    }
+
+    pipeline_free(_pipeline);
+}
+
+int child_process::infd() const
+{
+    return pipeline_get_infd(_pipeline);
+}
+
+int child_process::outfd() const
+{
+    return pipeline_get_outfd(_pipeline);
+}
+
+void child_process::close_input()
+{
+    if (infd() >= 0)
+        __replace_with_null(infd(), O_WRONLY);
+}
+
+void child_process::wait()
+{
+    if (_waited)
+        return;
+
+    _waited = true;
+    const int status = pipeline_wait(_pipeline);
+    if (status != 0)
+        throw runtime_error("audio::child_process: " + _name + " exited with status " + to_string(status));
+
+    FU_LOG(__log, fu::DEBUG) << _name << " exited";
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                   fu::audio::process_source                                   */
+/* --------------------------------------------------------------------------------------------- */
+
+process_source::process_source(const vector<string>& argv, unsigned channels, unsigned sample_rate,
+                               pcm_format format, unsigned block_frames)
+    : _child(argv, false, true),
+      _channels(channels),
+      _sample_rate(sample_rate),
+      _format(format),
+      _block_frames(block_frames),
+      _eof(false)
+{
+    if (channels == 0 || block_frames == 0)
+        throw std::invalid_argument("audio::process_source");
+}
+
+bool process_source::produce(buffer& buf)
+{
+    if (_eof)
+        return false;
+
+    const size_t frame_bytes = static_cast<size_t>(sample_bytes(_format)) * _channels;
+    const size_t wanted      = _block_frames * frame_bytes;
+
+    // Float samples go straight into buffer storage; the others are converted after.
+    buf.reset(_block_frames, _channels, _sample_rate);
+    uint8_t* dst;
+    if (_format == PCM_FLOAT) {
+        dst = reinterpret_cast<uint8_t*>(buf.data());
+    } else {
+        _bytes.resize(wanted);
+        dst = _bytes.data();
+    }
+
+    const size_t got = __read_full(_child.outfd(), dst, wanted);
+    if (got % frame_bytes != 0)
+        FU_LOG(__log, fu::WARN) << "discarding " << got % frame_bytes << " bytes of a partial frame";
+
+    // Shrinking keeps storage and samples.
+    buf.reset(static_cast<unsigned>(got / frame_bytes), _channels, _sample_rate);
+    if (_format != PCM_FLOAT)
+        __decode(_format, dst, buf);
+
+    if (got < wanted) {
+        _eof = true;
+        _child.wait();
+        buf.finish();
+    }
+
+    return true;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                    fu::audio::process_sink                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+process_sink::process_sink(const vector<string>& argv, pcm_format format)
+    : _argv(argv),
+      _format(format),
+      _splice(true),
+      _spliced(0)
+{ }
+
+void process_sink::write_spliced(int fd, const uint8_t* data, size_t size)
+{
+    if (_ring.empty())
+        _ring.resize(SPLICE_RING);
+
+    while (size > 0 && _splice) {
+        const size_t pos = static_cast<size_t>(_spliced % SPLICE_RING);
+        const size_t n   = std::min(size, SPLICE_RING - pos);
+
+        // Whatever is still in the pipe sits in the ring just behind pos, so the
+        // n bytes about to be overwritten are free once SPLICE_RING - n are left.
+        __wait_queued(fd, SPLICE_RING - n);
+        std::memcpy(&_ring[pos], data, n);
+
+        const size_t spliced = __vmsplice(fd, &_ring[pos], n);
+        _spliced += spliced;
+        if (spliced < n) {
+            FU_LOG(__log, fu::DEBUG) << "vmsplice not supported, writing instead";
+            _splice = false;
+            __write_full(fd, &_ring[pos] + spliced, n - spliced);
+        }
+        data += n;
+        size -= n;
+    }
+
+    __write_full(fd, data, size);
+}
+
+void process_sink::consume(const buffer& buf)
+{
+    if (!_child)
+        _child.reset(new child_process(_argv, true, false));
+
+    const buffer* src = &buf;
+    if (buf.layout() == PLANAR) {
+        kernels::interleave(buf, _interleaved);
+        src = &_interleaved;
+    }
+
+    const int fd = _child->infd();
+    if (_format == PCM_FLOAT) {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(src->cdata());
+        const size_t   size = static_cast<size_t>(src->frames()) * src->channels() * sizeof(float);
+
+        if (_splice)
+            write_spliced(fd, data, size);
+        else
+            __write_full(fd, data, size);
+    } else {
+        __encode(_format, *src, _bytes);
+        __write_full(fd, _bytes.data(), _bytes.size());
+    }
+
+    if (buf.finished()) {
+        // An encoder exiting with spliced bytes unread must not pass for a success.
+        if (_spliced > 0)
+            __wait_queued(fd, 0);
+        _child->close_input();
+        _child->wait();
+    }
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 fu::audio::process_transform                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+process_transform::process_transform(const vector<string>& argv, unsigned channels, unsigned sample_rate,
+                                     pcm_format format)
+    : _argv(argv),
+      _channels(channels),
+      _sample_rate(sample_rate),
+      _format(format)
+{
+    if (channels == 0)
+        throw std::invalid_argument("audio::process_transform");
+}
+
+void process_transform::pump(const uint8_t* data, size_t size)
+{
+    const int in  = _child->infd();
+    const int out = _child->outfd();
+
+    // Writing and reading are interleaved, so a filter blocked on a full output
+    // pipe never leaves us blocked on its full input pipe.
+    while (size > 0) {
+        struct pollfd fds[2] = { { in, POLLOUT, 0 }, { out, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw __error("audio::process_transform: poll");
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP))
+            __read_available(out, _out_bytes);
+        if (fds[0].revents & POLLERR)
+            throw runtime_error("audio::process_transform: filter closed its input");
+
+        if (fds[0].revents & POLLOUT) {
+            const ssize_t n = write(in, data, size);
+            if (n >= 0) {
+                data += n;
+                size -= static_cast<size_t>(n);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                throw __error("audio::process_transform: write");
+            }
+        }
+    }
+
+    __read_available(out, _out_bytes);
+}
+
+void process_transform::drain()
+{
+    const int out = _child->outfd();
+
+    for (;;) {
+        struct pollfd pfd = { out, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw __error("audio::process_transform: poll");
+        }
+        if (!__read_available(out, _out_bytes))
+            return;
+    }
+}
+
+void process_transform::process(const buffer& in, buffer& out)
+{
+    if (!_child) {
+        _child.reset(new child_process(_argv, true, true));
+        __set_nonblocking(_child->infd());
+        __set_nonblocking(_child->outfd());
+    }
+
+    const buffer* src = &in;
+    if (in.layout() == PLANAR) {
+        kernels::interleave(in, _interleaved);
+        src = &_interleaved;
+    }
+
+    if (_format == PCM_FLOAT) {
+        pump(reinterpret_cast<const uint8_t*>(src->cdata()),
+             static_cast<size_t>(src->frames()) * src->channels() * sizeof(float));
+    } else {
+        __encode(_format, *src, _in_bytes);
+        pump(_in_bytes.data(), _in_bytes.size());
+    }
+
+    if (in.finished()) {
+        _child->close_input();
+        drain();
+        _child->wait();
+    }
+
+    // Whole frames go out; a partial one waits for the rest.
+    const size_t   frame_bytes = static_cast<size_t>(sample_bytes(_format)) * _channels;
+    const unsigned frames      = static_cast<unsigned>(_out_bytes.size() / frame_bytes);
+
+    out.reset(frames, _channels, _sample_rate);
+    if (frames > 0)
+        __decode(_format, _out_bytes.data(), out);
+    _out_bytes.erase(_out_bytes.begin(), _out_bytes.begin() + frames * frame_bytes);
+}
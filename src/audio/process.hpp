@@ -0,0 +1,266 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef U7CC8931A_C6C0_4E18_9C18_D94EEB2FCF58
+#define U7CC8931A_C6C0_4E18_9C18_D94EEB2FCF58
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <pipeline.h>
+
+#include "buffer.hpp"
+#include "stage.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /**
+         * Raw PCM sample formats exchanged with external processes, interleaved and
+         * in host byte order, except PCM_INT24 which is packed little-endian.
+         */
+        enum pcm_format {
+            PCM_FLOAT,
+            PCM_INT16,
+            PCM_INT24,
+            PCM_INT32
+        };
+
+        /**
+         * Returns the size in bytes of one sample in a given format.
+         */
+        unsigned sample_bytes(pcm_format format);
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                fu::audio::child_process                               */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * External command run with libpipeline, with its standard input and/or output
+         * connected to pipes enlarged with F_SETPIPE_SZ.
+         */
+        class child_process
+        {
+            ::pipeline*  _pipeline;
+            std::string  _name;
+            bool         _waited;
+
+        public:
+            /**
+             * Starts a command.
+             *
+             * @param argv       command and its arguments; the command is looked up in PATH
+             * @param want_in    connect a pipe to its standard input?
+             * @param want_out   connect a pipe to its standard output?
+             *
+             * @throws std::invalid_argument if argv is empty.
+             */
+            child_process(const std::vector<std::string>& argv, bool want_in, bool want_out);
+
+            child_process(const child_process&) = delete;
+            child_process& operator=(const child_process&) = delete;
+
+            /**
+             * Closes the pipes, and waits for the command if not done yet, ignoring
+             * its status.
+             */
+            ~child_process();
+
+            /**
+             * Returns the descriptor writing to the standard input of the command.
+             */
+            int infd() const;
+
+            /**
+             * Returns the descriptor reading from the standard output of the command.
+             */
+            int outfd() const;
+
+            /**
+             * Closes the standard input of the command, which sees the end of file.
+             */
+            void close_input();
+
+            /**
+             * Waits for the command to exit.
+             *
+             * @throws std::runtime_error if it did not exit with status zero.
+             */
+            void wait();
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                fu::audio::process_source                              */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Source stage running a decoder which writes raw PCM to its standard output,
+         * e.g. { "flac", "-dcs", "--force-raw-format", "--endian=little", "--sign=signed", "in.flac" }.
+         * Float samples are read straight into buffer storage.
+         */
+        class process_source : public source
+        {
+            child_process              _child;
+            unsigned                   _channels;
+            unsigned                   _sample_rate;
+            pcm_format                 _format;
+            unsigned                   _block_frames;
+            std::vector<std::uint8_t>  _bytes;
+            bool                       _eof;
+
+        public:
+            /**
+             * Starts the decoder.
+             *
+             * @param argv          command and its arguments
+             * @param channels      number of channels it outputs
+             * @param sample_rate   sample rate (Hz) it outputs
+             * @param format        sample format it outputs
+             * @param block_frames  number of frames per buffer
+             */
+            process_source(const std::vector<std::string>& argv, unsigned channels, unsigned sample_rate,
+                           pcm_format format = PCM_FLOAT, unsigned block_frames = 4096);
+
+            /**
+             * Reads the next block into buf; the last one is marked as finished, after
+             * the decoder exited successfully.
+             *
+             * @throws std::runtime_error on read errors or if the decoder failed.
+             */
+            virtual bool produce(buffer& buf) override;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                 fu::audio::process_sink                               */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Sink stage running an encoder which reads raw PCM from its standard input,
+         * e.g. { "lame", "-r", "--little-endian", "-s", "44.1", "-", "out.mp3" }. The
+         * encoder is started when the first buffer arrives.
+         *
+         * Float samples of interleaved buffers are copied into a ring as large as
+         * the pipe and handed to it with vmsplice, so the pipe references the ring
+         * instead of copying it again; consume only waits for the encoder when the
+         * part of the ring it is about to reuse has not been read yet, which lets
+         * the pipe fill up while the encoder works. splice(false) makes it write()
+         * instead, e.g. to compare the two.
+         */
+        class process_sink : public sink
+        {
+            std::vector<std::string>        _argv;
+            std::unique_ptr<child_process>  _child;
+            pcm_format                      _format;
+            buffer                          _interleaved;
+            std::vector<std::uint8_t>       _bytes;
+            bool                            _splice;
+            std::vector<std::uint8_t>       _ring;      // spliced bytes, until the encoder reads them
+            std::uint64_t                   _spliced;   // bytes spliced so far
+
+            void write_spliced(int fd, const std::uint8_t* data, std::size_t size);
+
+        public:
+            /**
+             * Prepares to run an encoder.
+             *
+             * @param argv    command and its arguments
+             * @param format  sample format it reads
+             */
+            explicit process_sink(const std::vector<std::string>& argv, pcm_format format = PCM_FLOAT);
+
+            /**
+             * Sets whether float samples are spliced (the default) or written; falls
+             * back to writing on its own if the pipe does not support vmsplice.
+             * Before the first block only.
+             */
+            __attribute__((always_inline))
+            inline void splice(bool enable)
+            {
+                _splice = enable;
+            }
+
+            /**
+             * Writes a block to the encoder; after the last one, closes its input and
+             * waits for it.
+             *
+             * @throws std::runtime_error on write errors or if the encoder failed.
+             */
+            virtual void consume(const buffer& buf) override;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                              fu::audio::process_transform                             */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Transform stage running a filter which reads raw PCM from its standard input
+         * and writes raw PCM to its standard output, in the same format. Each call
+         * writes a block and collects whatever output is ready, so output buffers may
+         * be empty or lag behind; everything is flushed after the last block. The
+         * filter is started when the first buffer arrives.
+         */
+        class process_transform : public transform
+        {
+            std::vector<std::string>        _argv;
+            std::unique_ptr<child_process>  _child;
+            unsigned                        _channels;
+            unsigned                        _sample_rate;
+            pcm_format                      _format;
+            buffer                          _interleaved;
+            std::vector<std::uint8_t>       _in_bytes;
+            std::vector<std::uint8_t>       _out_bytes;
+
+            void pump(const std::uint8_t* data, std::size_t size);
+            void drain();
+
+        public:
+            /**
+             * Prepares to run a filter.
+             *
+             * @param argv         command and its arguments
+             * @param channels     number of channels it outputs
+             * @param sample_rate  sample rate (Hz) it outputs
+             * @param format       sample format it reads and writes
+             */
+            process_transform(const std::vector<std::string>& argv, unsigned channels, unsigned sample_rate,
+                              pcm_format format = PCM_FLOAT);
+
+            /**
+             * Writes a block to the filter and fills out with the output it has ready.
+             *
+             * @throws std::runtime_error on I/O errors or if the filter failed.
+             */
+            virtual void process(const buffer& in, buffer& out) override;
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
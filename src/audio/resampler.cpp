@@ -0,0 +1,216 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <stdexcept>
+#include <string>
+
+#include "../logger.hpp"
+#include "kernels.hpp"
+#include "resampler.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::runtime_error;
+using std::string;
+using fu::audio::buffer;
+using fu::audio::resample_quality;
+using fu::audio::resampler;
+using fu::audio::src_state_cache;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("resampler");
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  fu::audio::src_state_cache                                   */
+/* --------------------------------------------------------------------------------------------- */
+
+src_state_cache::~src_state_cache()
+{
+    trim();
+}
+
+SRC_STATE* src_state_cache::acquire(resample_quality quality, unsigned channels)
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+
+        for (auto it = _idle.begin(); it != _idle.end(); ++it) {
+            if (it->quality == quality && it->channels == channels) {
+                SRC_STATE* state = it->state;
+                _idle.erase(it);
+                return state;
+            }
+        }
+    }
+
+    int error;
+    SRC_STATE* state = src_new(quality, static_cast<int>(channels), &error);
+    if (state == nullptr)
+        throw runtime_error(string("audio::src_state_cache: ") + src_strerror(error));
+
+    FU_LOG(__log, fu::DEBUG) << "new converter " << quality << " for " << channels << " channels";
+
+    return state;
+}
+
+void src_state_cache::release(resample_quality quality, unsigned channels, SRC_STATE* state)
+{
+    if (state == nullptr)
+        return;
+
+    src_reset(state);
+
+    entry e = { quality, channels, state };
+
+    lock_guard<mutex> lock(_mutex);
+    _idle.push_back(e);
+}
+
+void src_state_cache::trim()
+{
+    lock_guard<mutex> lock(_mutex);
+
+    for (auto& e: _idle)
+        src_delete(e.state);
+    _idle.clear();
+}
+
+src_state_cache& src_state_cache::global()
+{
+    // Never destroyed, like buffer_pool::global().
+    static src_state_cache* cache = new src_state_cache;
+    return *cache;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     fu::audio::resampler                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+resampler::resampler(unsigned output_rate, resample_quality quality, src_state_cache& cache)
+    : _cache(cache),
+      _state(nullptr),
+      _quality(quality),
+      _channels(0),
+      _output_rate(output_rate)
+{ }
+
+resampler::~resampler()
+{
+    _cache.release(_quality, _channels, _state);
+}
+
+/**
+ * Makes sure _state fits the number of channels of the stream.
+ */
+void resampler::prepare(unsigned channels)
+{
+    if (__builtin_expect(_state != nullptr && channels == _channels, 1))
+        return;
+
+    _cache.release(_quality, _channels, _state);
+    _state    = nullptr;
+    _state    = _cache.acquire(_quality, channels);
+    _channels = channels;
+}
+
+/**
+ * Grows out to a given capacity (in frames), keeping the frames already produced.
+ */
+__attribute__((cold))
+void resampler::grow(buffer& out, unsigned used, unsigned capacity)
+{
+    buffer bigger(capacity, out.channels(), out.sample_rate(), out.pool());
+    __builtin_memcpy(bigger.data(), out.cdata(), used * out.channels() * sizeof(float));
+    out.swap(bigger);
+}
+
+void resampler::reset()
+{
+    if (_state != nullptr)
+        src_reset(_state);
+}
+
+__attribute__((hot))
+void resampler::process(const buffer& in, buffer& out)
+{
+    const unsigned channels = in.channels();
+    const buffer*  src      = &in;
+
+    if (in.sample_rate() == _output_rate && in.layout() == INTERLEAVED) {
+        // Nothing to convert; a copy keeps the storage of in with its sender.
+        out.reset(in.frames(), channels, _output_rate);
+        __builtin_memcpy(out.data(), in.cdata(), in.frames() * channels * sizeof(float));
+        return;
+    }
+
+    prepare(channels);
+
+    if (in.layout() == PLANAR) {
+        kernels::interleave(in, _interleaved);
+        src = &_interleaved;
+    }
+
+    const double ratio    = static_cast<double>(_output_rate) / in.sample_rate();
+    unsigned     capacity = output_frames(in.frames(), ratio);
+    unsigned     produced = 0;
+
+    out.reset(capacity, channels, _output_rate);
+
+    SRC_DATA data;
+    data.data_in      = src->cdata();
+    data.input_frames = in.frames();
+    data.src_ratio    = ratio;
+    data.end_of_input = in.finished() ? 1 : 0;
+
+    for (;;) {
+        data.data_out      = out.data() + produced * channels;
+        data.output_frames = capacity - produced;
+
+        const int error = src_process(_state, &data);
+        if (error != 0)
+            throw runtime_error(string("audio::resampler: ") + src_strerror(error));
+
+        produced          += data.output_frames_gen;
+        data.data_in      += data.input_frames_used * channels;
+        data.input_frames -= data.input_frames_used;
+
+        // Done when every input frame was used and, at end of stream, once the
+        // converter has nothing more to flush.
+        if (data.input_frames == 0 && (!data.end_of_input || data.output_frames_gen == 0))
+            break;
+
+        if (produced == capacity) {
+            capacity *= 2;
+            grow(out, produced, capacity);
+        }
+    }
+
+    out.trunc(produced);
+
+    if (in.finished())
+        src_reset(_state);
+}
@@ -0,0 +1,191 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef U3C1EB56D_B593_4C7F_A79B_A41A2269C41B
+#define U3C1EB56D_B593_4C7F_A79B_A41A2269C41B
+
+#include <mutex>
+#include <vector>
+
+#include <samplerate.h>
+
+#include "buffer.hpp"
+#include "stage.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /**
+         * Resampling quality presets, mapped to libsamplerate converters.
+         */
+        enum resample_quality {
+            SINC_BEST    = SRC_SINC_BEST_QUALITY,
+            SINC_MEDIUM  = SRC_SINC_MEDIUM_QUALITY,
+            SINC_FASTEST = SRC_SINC_FASTEST,
+            LINEAR       = SRC_LINEAR
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                fu::audio::src_state_cache                             */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Cache of idle libsamplerate states, so that resamplers created for
+         * successive files reuse the (large, for sinc converters) filter state
+         * instead of allocating it again. States are keyed by quality and number
+         * of channels; the conversion ratio is given on each call.
+         */
+        class src_state_cache
+        {
+            struct entry {
+                resample_quality quality;
+                unsigned         channels;
+                SRC_STATE*       state;
+            };
+
+            std::vector<entry> _idle;
+            std::mutex         _mutex;
+
+        public:
+            src_state_cache() { }
+
+            src_state_cache(const src_state_cache&) = delete;
+            src_state_cache& operator=(const src_state_cache&) = delete;
+
+            /**
+             * Destructor, deletes idle states.
+             */
+            ~src_state_cache();
+
+            /**
+             * Takes an idle state from the cache, or creates one.
+             *
+             * @throws std::runtime_error if libsamplerate fails to create it.
+             */
+            SRC_STATE* acquire(resample_quality quality, unsigned channels);
+
+            /**
+             * Resets a state and gives it back to the cache.
+             */
+            void release(resample_quality quality, unsigned channels, SRC_STATE* state);
+
+            /**
+             * Deletes every idle state.
+             */
+            void trim();
+
+            /**
+             * Returns the process-wide cache.
+             */
+            static src_state_cache& global();
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                   fu::audio::resampler                                */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Transform stage converting buffers to a given sample rate, streaming
+         * through a libsamplerate state kept alive across buffers and, through
+         * the state cache, across resamplers.
+         *
+         * A finished input buffer flushes the converter tail into the output and
+         * resets the state, so the same resampler can go on with another stream.
+         */
+        class resampler : public transform
+        {
+            src_state_cache&  _cache;
+            SRC_STATE*        _state;
+            resample_quality  _quality;
+            unsigned          _channels;
+            unsigned          _output_rate;
+            buffer            _interleaved;
+
+            void prepare(unsigned channels);
+            static void grow(buffer& out, unsigned used, unsigned capacity);
+
+        public:
+            /**
+             * Creates a resampler.
+             *
+             * @param output_rate  sample rate (Hz) of the output
+             * @param quality      converter to use
+             * @param cache        where states are taken from and given back to
+             */
+            explicit resampler(unsigned output_rate, resample_quality quality = SINC_MEDIUM,
+                               src_state_cache& cache = src_state_cache::global());
+
+            resampler(const resampler&) = delete;
+            resampler& operator=(const resampler&) = delete;
+
+            /**
+             * Gives the state back to the cache.
+             */
+            virtual ~resampler();
+
+            /**
+             * Returns the output sample rate (Hz).
+             */
+            __attribute__((always_inline))
+            inline unsigned output_rate() const
+            {
+                return _output_rate;
+            }
+
+            /**
+             * Returns the converter in use.
+             */
+            __attribute__((always_inline))
+            inline resample_quality quality() const
+            {
+                return _quality;
+            }
+
+            /**
+             * Discards any stream in progress, so that the next block starts afresh.
+             */
+            void reset();
+
+            /**
+             * Resamples a block. out is sized from the conversion ratio, so that in
+             * steady state its storage is reused block after block.
+             */
+            virtual void process(const buffer& in, buffer& out) override;
+
+            /**
+             * Returns the maximum number of output frames for a given number of input
+             * frames at a given ratio, slack for converter jitter included.
+             */
+            __attribute__((always_inline))
+            inline static unsigned output_frames(unsigned input_frames, double ratio)
+            {
+                return static_cast<unsigned>(input_frames * ratio) + 16;
+            }
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
@@ -0,0 +1,100 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <stdexcept>
+#include <utility>
+
+#include "ring.hpp"
+
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using fu::audio::ring;
+using fu::audio::buffer;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Constructors and destructor                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+ring::ring(unsigned size)
+    : _slots(nullptr),
+      _size(size),
+      _head(0),
+      _tail_cache(0),
+      _tail(0),
+      _head_cache(0)
+{
+    if (size == 0)
+        throw std::invalid_argument("audio::ring::ring");
+
+    _slots = new buffer[size];
+}
+
+ring::~ring()
+{
+    delete[] _slots;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Misc. member functions                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+__attribute__((hot))
+bool ring::try_push(buffer& buf)
+{
+    const unsigned long head = _head.load(memory_order_relaxed);
+
+    if (__builtin_expect(head - _tail_cache == _size, 0)) {
+        _tail_cache = _tail.load(memory_order_acquire);
+        if (head - _tail_cache == _size)
+            return false;
+    }
+
+    std::swap(_slots[head % _size], buf);
+    _head.store(head + 1, memory_order_release);
+
+    return true;
+}
+
+__attribute__((hot))
+bool ring::try_pop(buffer& buf)
+{
+    const unsigned long tail = _tail.load(memory_order_relaxed);
+
+    if (__builtin_expect(tail == _head_cache, 0)) {
+        _head_cache = _head.load(memory_order_acquire);
+        if (tail == _head_cache)
+            return false;
+    }
+
+    std::swap(_slots[tail % _size], buf);
+    _tail.store(tail + 1, memory_order_release);
+
+    return true;
+}
+
+void ring::reserve(unsigned frames, unsigned channels, audio::layout layout)
+{
+    for (unsigned i = 0; i < _size; i++)
+        _slots[i].reserve(frames, channels, layout);
+}
@@ -0,0 +1,139 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef U629D14BC_2D8A_4C7D_9142_350E62389AD5
+#define U629D14BC_2D8A_4C7D_9142_350E62389AD5
+
+#include <atomic>
+
+#include "buffer.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /**
+         * Bounded single-producer/single-consumer lock-free ring of audio::buffer slots.
+         *
+         * Buffers are swapped in and out of the slots, never copied, so the storage
+         * a consumer hands back on pop is what the producer gets back on a later push.
+         */
+        class ring
+        {
+
+            /* --------------------------------------------------------------------------------- */
+            /*                                Internal properties                                */
+            /* --------------------------------------------------------------------------------- */
+
+            buffer*                     _slots;
+            unsigned                    _size;
+
+            // Producer-side cache line.
+            std::atomic<unsigned long>  _head;
+            unsigned long               _tail_cache;
+            char                        _head_pad[64 - sizeof(unsigned long) * 2];
+
+            // Consumer-side cache line.
+            std::atomic<unsigned long>  _tail;
+            unsigned long               _head_cache;
+            char                        _tail_pad[64 - sizeof(unsigned long) * 2];
+
+        public:
+
+            /* --------------------------------------------------------------------------------- */
+            /*                            Constructors and destructor                            */
+            /* --------------------------------------------------------------------------------- */
+
+            /**
+             * Constructs a ring with a given number of slots.
+             *
+             * @param size  number of slots, must be greater than zero.
+             */
+            explicit ring(unsigned size);
+
+            ring(const ring&) = delete;
+            ring& operator=(const ring&) = delete;
+
+            /**
+             * Destructor.
+             */
+            ~ring();
+
+
+            /* --------------------------------------------------------------------------------- */
+            /*                                Getters and setters                                */
+            /* --------------------------------------------------------------------------------- */
+
+            /**
+             * Returns the number of slots in the ring.
+             */
+            __attribute__((always_inline))
+            inline unsigned size() const
+            {
+                return _size;
+            }
+
+            /**
+             * Returns the number of filled slots. Exact only when called by either side
+             * while the other one is idle, approximate otherwise.
+             */
+            __attribute__((always_inline))
+            inline unsigned count() const
+            {
+                return static_cast<unsigned>(_head.load(std::memory_order_acquire)
+                                             - _tail.load(std::memory_order_acquire));
+            }
+
+
+            /* --------------------------------------------------------------------------------- */
+            /*                               Misc member functions                               */
+            /* --------------------------------------------------------------------------------- */
+
+            /**
+             * Producer side: swaps buf into the next free slot. On success, buf holds
+             * storage previously handed back by the consumer (or none at all).
+             *
+             * @return     true if success, false if the ring is full.
+             */
+            bool try_push(buffer& buf);
+
+            /**
+             * Consumer side: swaps the oldest filled slot with buf. On success, the
+             * storage previously held by buf will be recycled by the producer.
+             *
+             * @return     true if success, false if the ring is empty.
+             */
+            bool try_pop(buffer& buf);
+
+            /**
+             * Reserves storage for a block in every slot (see buffer::reserve()),
+             * so that swapping buffers of that size in and out never allocates.
+             * Only while neither side is running.
+             */
+            void reserve(unsigned frames, unsigned channels, audio::layout layout = INTERLEAVED);
+
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
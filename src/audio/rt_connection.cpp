@@ -0,0 +1,187 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "rt_connection.hpp"
+
+using std::string;
+using std::to_string;
+using fu::audio::buffer;
+using fu::audio::rt_connection;
+using fu::audio::rt_sink;
+using fu::audio::rt_source;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Configurable constants                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+#define SPIN_ROUNDS     64      // polls with a pause before the first sleep
+#define MIN_SLEEP_US    50      // first sleep, doubled on every further poll
+#define MAX_SLEEP_US    1000
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 Module-local static functions                                 */
+/* --------------------------------------------------------------------------------------------- */
+
+/**
+ * Waits before the next poll: a pause for a few rounds, then sleeps growing up
+ * to MAX_SLEEP_US, which bounds how late the polling side notices a change.
+ */
+static void __backoff(unsigned& round)
+{
+    if (round < SPIN_ROUNDS) {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        const unsigned shift = std::min(round - SPIN_ROUNDS, 5u);
+        std::this_thread::sleep_for(std::chrono::microseconds(std::min(MIN_SLEEP_US << shift, MAX_SLEEP_US)));
+    }
+    round++;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                    fu::audio::rt_connection                                   */
+/* --------------------------------------------------------------------------------------------- */
+
+static string __default_name()
+{
+    static std::atomic<unsigned> count(0);
+    return "rt_connection." + to_string(count.fetch_add(1, std::memory_order_relaxed));
+}
+
+rt_connection::rt_connection(unsigned depth, unsigned frames, unsigned channels, audio::layout layout)
+    : _ring(depth),
+      _frames(frames),
+      _channels(channels),
+      _layout(layout),
+      _closed(false),
+      _name(__default_name()),
+      _overruns(_name + ".overruns"),
+      _underruns(_name + ".underruns")
+{
+    _ring.reserve(frames, channels, layout);
+}
+
+void rt_connection::name(const string& name)
+{
+    _name = name;
+    _overruns.rename(name + ".overruns");
+    _underruns.rename(name + ".underruns");
+}
+
+__attribute__((hot))
+bool rt_connection::try_send(buffer& buf)
+{
+    if (__builtin_expect(_ring.try_push(buf), 1))
+        return true;
+
+    _overruns.add(1);
+    return false;
+}
+
+__attribute__((hot))
+bool rt_connection::try_recv(buffer& buf)
+{
+    if (__builtin_expect(_ring.try_pop(buf), 1))
+        return true;
+
+    if (!closed())
+        _underruns.add(1);
+    return false;
+}
+
+void rt_connection::send(buffer& buf)
+{
+    for (unsigned round = 0; !_ring.try_push(buf); )
+        __backoff(round);
+}
+
+bool rt_connection::recv(buffer& buf)
+{
+    for (unsigned round = 0; ; ) {
+        if (_ring.try_pop(buf))
+            return true;
+        // Whatever was pushed before the close is visible once the close is.
+        if (closed())
+            return _ring.try_pop(buf);
+        __backoff(round);
+    }
+}
+
+void rt_connection::close()
+{
+    _closed.store(true, std::memory_order_release);
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                      fu::audio::rt_source                                     */
+/* --------------------------------------------------------------------------------------------- */
+
+rt_source::rt_source(rt_connection& conn)
+    : _conn(conn)
+{
+    _local.reserve(conn.frames(), conn.channels(), conn.layout());
+}
+
+bool rt_source::produce(buffer& buf)
+{
+    if (!_conn.recv(_local))
+        return false;
+
+    buf.assign(_local);
+    return true;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                       fu::audio::rt_sink                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+rt_sink::rt_sink(rt_connection& conn)
+    : _conn(conn)
+{
+    _local.reserve(conn.frames(), conn.channels(), conn.layout());
+}
+
+rt_sink::~rt_sink()
+{
+    _conn.close();
+}
+
+void rt_sink::consume(const buffer& buf)
+{
+    _local.assign(buf);
+    _conn.send(_local);
+
+    if (buf.finished())
+        _conn.close();
+}
@@ -0,0 +1,230 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef U110E2F7C_FC8E_402F_AD3C_9D9F6B31A62C
+#define U110E2F7C_FC8E_402F_AD3C_9D9F6B31A62C
+
+#include <atomic>
+#include <string>
+
+#include "../metrics.hpp"
+#include "buffer.hpp"
+#include "ring.hpp"
+#include "stage.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                fu::audio::rt_connection                               */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Connection between a real-time thread, e.g. one driving an audio device,
+         * and the rest of a pipeline.
+         *
+         * Buffers go through an audio::ring whose slots are preallocated on
+         * construction. The real-time side calls try_send() or try_recv(), which
+         * are wait-free: they neither lock, allocate nor make system calls, and
+         * count overruns (ring full) and underruns (ring empty) in metrics named
+         * after the connection. The other side calls send() and recv(), which poll
+         * with backoff instead of waiting on a semaphore, so the real-time side
+         * never has to wake it. As long as both sides keep to blocks of up to the
+         * reserved size, storage only changes hands and is never reallocated.
+         */
+        class rt_connection
+        {
+            ring                _ring;
+            unsigned            _frames;
+            unsigned            _channels;
+            audio::layout       _layout;
+            std::atomic<bool>   _closed;
+
+            std::string         _name;
+            metrics::counter    _overruns;
+            metrics::counter    _underruns;
+
+        public:
+            /**
+             * Creates a connection, reserving storage in every slot.
+             *
+             * @param depth     number of slots
+             * @param frames    frames of the largest block
+             * @param channels  number of channels
+             * @param layout    sample layout
+             *
+             * @throws std::invalid_argument if depth is zero.
+             */
+            rt_connection(unsigned depth, unsigned frames, unsigned channels,
+                          audio::layout layout = INTERLEAVED);
+
+            rt_connection(const rt_connection&) = delete;
+            rt_connection& operator=(const rt_connection&) = delete;
+
+            /**
+             * Returns the frames of the largest block reserved for.
+             */
+            __attribute__((always_inline))
+            inline unsigned frames() const
+            {
+                return _frames;
+            }
+
+            /**
+             * Returns the number of channels reserved for.
+             */
+            __attribute__((always_inline))
+            inline unsigned channels() const
+            {
+                return _channels;
+            }
+
+            /**
+             * Returns the layout reserved for.
+             */
+            __attribute__((always_inline))
+            inline audio::layout layout() const
+            {
+                return _layout;
+            }
+
+            /**
+             * Returns the name of the connection, "rt_connection.N" by default.
+             */
+            __attribute__((always_inline))
+            inline const std::string& name() const
+            {
+                return _name;
+            }
+
+            /**
+             * Renames the connection and its metrics (name + ".overruns" and
+             * name + ".underruns").
+             */
+            void name(const std::string& name);
+
+            /**
+             * Returns true once the sender has closed the connection; buffers
+             * may still be queued.
+             */
+            __attribute__((always_inline))
+            inline bool closed() const
+            {
+                return _closed.load(std::memory_order_acquire);
+            }
+
+            /**
+             * Real-time sender: swaps buf into a free slot; buf gets back storage
+             * the receiver is done with. Wait-free.
+             *
+             * @return  true if sent, false (an overrun) if the ring is full.
+             */
+            bool try_send(buffer& buf);
+
+            /**
+             * Real-time receiver: swaps the oldest queued buffer with buf. Wait-free.
+             *
+             * @return  true if received, false if none is queued; an underrun unless
+             *          the connection is closed.
+             */
+            bool try_recv(buffer& buf);
+
+            /**
+             * Sends a buffer, polling until a slot is free. Not for real-time threads.
+             */
+            void send(buffer& buf);
+
+            /**
+             * Receives a buffer, polling until one is queued. Not for real-time threads.
+             *
+             * @return  true if received, false if the connection is closed and drained.
+             */
+            bool recv(buffer& buf);
+
+            /**
+             * Closes the connection, from the sender; wait-free.
+             */
+            void close();
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                  fu::audio::rt_source                                 */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Source stage producing the blocks a real-time thread sends on an
+         * rt_connection, e.g. captured audio. Blocks are copied out of a buffer of
+         * its own, so that only reserved storage goes back to the real-time side.
+         */
+        class rt_source : public source
+        {
+            rt_connection&  _conn;
+            buffer          _local;
+
+        public:
+            explicit rt_source(rt_connection& conn);
+
+            /**
+             * Copies the next block into buf, polling until it comes.
+             *
+             * @return  false once the connection is closed and drained.
+             */
+            virtual bool produce(buffer& buf) override;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                   fu::audio::rt_sink                                  */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Sink stage sending the blocks it consumes to a real-time thread on an
+         * rt_connection, e.g. for playback. Blocks are copied into a buffer of its
+         * own, reserved for the connection, before being sent; the connection is
+         * closed after the last one.
+         */
+        class rt_sink : public sink
+        {
+            rt_connection&  _conn;
+            buffer          _local;
+
+        public:
+            explicit rt_sink(rt_connection& conn);
+
+            /**
+             * Closes the connection, unless the last block was consumed already.
+             */
+            virtual ~rt_sink();
+
+            /**
+             * Copies a block and sends it, polling until a slot is free.
+             */
+            virtual void consume(const buffer& buf) override;
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
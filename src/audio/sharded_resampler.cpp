@@ -0,0 +1,355 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../logger.hpp"
+#include "../semaphore.hpp"
+#include "kernels.hpp"
+#include "sharded_resampler.hpp"
+
+using std::condition_variable;
+using std::exception_ptr;
+using std::lock_guard;
+using std::mutex;
+using std::thread;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using fu::audio::buffer;
+using fu::audio::connection;
+using fu::audio::resampler;
+using fu::audio::sharded_resampler;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Configurable constants                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+#define DEFAULT_OVERLAP   2048    // input frames at ratio >= 1; longer than every sinc filter
+#define JOBS_PER_WORKER   2       // segments in flight per worker
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("sharded");
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Module-local classes                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+namespace {
+
+    /**
+     * One segment, with its overlap, and the result of resampling it.
+     */
+    struct job {
+        buffer        input;
+        buffer        output;
+        unsigned      skip;     // leading output frames belonging to the warm-up
+        unsigned      keep;     // output frames to keep after them
+        bool          last;
+        bool          done;
+        exception_ptr error;
+    };
+
+    /**
+     * State shared by the input, worker and output threads of one run.
+     */
+    struct context {
+        mutex                                  lock;
+        condition_variable                     queued;
+        condition_variable                     finished;
+        std::deque<job*>                       queue;
+        std::map<unsigned long, unique_ptr<job>> jobs;
+        unsigned long                          total;
+        bool                                   input_done;
+        exception_ptr                          error;
+        fu::semaphore                          slots;
+
+        explicit context(unsigned max_jobs)
+            : total(0), input_done(false), slots(static_cast<int>(max_jobs))
+        { }
+    };
+
+    unsigned long gcd(unsigned long a, unsigned long b)
+    {
+        while (b != 0) {
+            const unsigned long t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+
+} // namespace
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 Module-local static functions                                 */
+/* --------------------------------------------------------------------------------------------- */
+
+static void __worker(context& ctx, unsigned output_rate, fu::audio::resample_quality quality,
+                     fu::audio::src_state_cache& cache)
+{
+    resampler conv(output_rate, quality, cache);
+
+    for (;;) {
+        job* j;
+        {
+            unique_lock<mutex> lock(ctx.lock);
+            ctx.queued.wait(lock, [&]{ return !ctx.queue.empty() || ctx.input_done; });
+            if (ctx.queue.empty())
+                return;
+            j = ctx.queue.front();
+            ctx.queue.pop_front();
+        }
+
+        try {
+            conv.reset();
+            if (j->last)
+                j->input.finish();
+            conv.process(j->input, j->output);
+        } catch (...) {
+            j->error = std::current_exception();
+        }
+
+        {
+            lock_guard<mutex> lock(ctx.lock);
+            j->done = true;
+        }
+        ctx.finished.notify_all();
+    }
+}
+
+/**
+ * Sends the kept part of a job's output to output, in blocks.
+ */
+static void __emit(job& j, connection& output, unsigned block_frames)
+{
+    const unsigned available = j.output.frames();
+    const unsigned channels  = j.output.channels();
+    const unsigned end       = j.last ? available : j.skip + j.keep;
+
+    if (end > available || j.skip > end)
+        throw std::runtime_error("audio::sharded_resampler: overlap too short for the converter");
+
+    buffer   buf;
+    unsigned pos = j.skip;
+
+    do {
+        const unsigned frames = end - pos < block_frames ? end - pos : block_frames;
+
+        buf.reset(frames, channels, j.output.sample_rate());
+        __builtin_memcpy(buf.data(), j.output.cdata() + pos * channels, frames * channels * sizeof(float));
+        pos += frames;
+        if (j.last && pos == end)
+            buf.finish();
+        output.send(buf);
+    } while (pos < end);
+}
+
+static void __output(context& ctx, connection& output, unsigned block_frames)
+{
+    for (unsigned long next = 0; ; next++) {
+        job* j;
+        bool failed;
+        {
+            unique_lock<mutex> lock(ctx.lock);
+            ctx.finished.wait(lock, [&]{
+                auto it = ctx.jobs.find(next);
+                return (it != ctx.jobs.end() && it->second->done) || (ctx.input_done && next == ctx.total);
+            });
+            if (next == ctx.total && ctx.input_done)
+                break;
+            j      = ctx.jobs[next].get();
+            failed = ctx.error != nullptr;
+        }
+
+        if (j->error == nullptr && !failed) {
+            try {
+                __emit(*j, output, block_frames);
+            } catch (...) {
+                j->error = std::current_exception();
+            }
+        }
+
+        const bool last = j->last;
+        {
+            lock_guard<mutex> lock(ctx.lock);
+            if (j->error != nullptr && ctx.error == nullptr)
+                ctx.error = j->error;
+            ctx.jobs.erase(next);
+        }
+        ctx.slots.post();
+
+        if (last)
+            break;
+    }
+
+    output.close();
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 fu::audio::sharded_resampler                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+sharded_resampler::sharded_resampler(unsigned output_rate, resample_quality quality, unsigned workers,
+                                     double segment_seconds, src_state_cache& cache)
+    : _cache(cache),
+      _quality(quality),
+      _output_rate(output_rate),
+      _workers(workers != 0 ? workers : std::max(1u, thread::hardware_concurrency())),
+      _segment_seconds(segment_seconds),
+      _overlap(0),
+      _block_frames(4096)
+{ }
+
+void sharded_resampler::run(connection& input, connection& output)
+{
+    context        ctx(_workers * JOBS_PER_WORKER);
+    vector<thread> workers;
+
+    for (unsigned i = 0; i < _workers; i++)
+        workers.emplace_back(__worker, std::ref(ctx), _output_rate, _quality, std::ref(_cache));
+    thread writer(__output, std::ref(ctx), std::ref(output), _block_frames);
+
+    buffer         in, interleaved;
+    vector<float>  pending;          // input frames from index base onwards
+    unsigned long  base       = 0;
+    unsigned long  next_start = 0;   // first input frame of the next segment
+    unsigned long  period_in  = 1, period_out = 1;
+    unsigned long  segment    = 0, overlap = 0;
+    unsigned       channels   = 0, sample_rate = 0;
+    bool           started    = false;
+
+    // Queues the segment starting at next_start, with its warm-up before and, unless
+    // last, after; then drops input frames no later segment needs.
+    auto dispatch = [&](bool last) {
+        const unsigned long available = base + pending.size() / channels;
+        const unsigned long start     = next_start >= overlap ? next_start - overlap : 0;
+        const unsigned long end       = last ? available : next_start + segment + overlap;
+
+        ctx.slots.wait();
+
+        unique_ptr<job> j(new job);
+        j->input.reset(static_cast<unsigned>(end - start), channels, sample_rate);
+        __builtin_memcpy(j->input.data(), pending.data() + (start - base) * channels,
+                         (end - start) * channels * sizeof(float));
+        j->skip = static_cast<unsigned>((next_start - start) / period_in * period_out);
+        j->keep = last ? std::numeric_limits<unsigned>::max()
+                       : static_cast<unsigned>(segment / period_in * period_out);
+        j->last = last;
+        j->done = false;
+
+        {
+            lock_guard<mutex> lock(ctx.lock);
+            ctx.queue.push_back(j.get());
+            ctx.jobs[ctx.total++] = std::move(j);
+        }
+        ctx.queued.notify_one();
+
+        next_start += segment;
+        const unsigned long new_base = next_start - overlap;
+        if (!last && new_base > base) {
+            pending.erase(pending.begin(), pending.begin() + (new_base - base) * channels);
+            base = new_base;
+        }
+    };
+
+    try {
+        while (input.recv(in)) {
+            if (!started) {
+                channels    = in.channels();
+                sample_rate = in.sample_rate();
+
+                const unsigned long g = gcd(sample_rate, _output_rate);
+                period_in  = sample_rate / g;
+                period_out = _output_rate / g;
+
+                // Overlap and segment are whole periods, so that every join maps to a
+                // whole output frame; the overlap is stretched when downsampling, as
+                // the converter widens its filter by the same factor.
+                const double ratio = static_cast<double>(_output_rate) / sample_rate;
+                overlap = _overlap != 0 ? _overlap
+                                        : static_cast<unsigned long>(DEFAULT_OVERLAP / std::min(ratio, 1.0));
+                overlap = (overlap + period_in - 1) / period_in * period_in;
+                segment = static_cast<unsigned long>(_segment_seconds * sample_rate);
+                segment = std::max(segment, 2 * overlap);
+                segment = (segment + period_in - 1) / period_in * period_in;
+                started = true;
+
+                FU_LOG(__log, fu::DEBUG) << "segments of " << segment << " frames, overlap " << overlap
+                                 << ", " << _workers << " workers";
+            } else if (in.channels() != channels || in.sample_rate() != sample_rate) {
+                throw std::invalid_argument("audio::sharded_resampler: stream shape changed");
+            }
+
+            const buffer* src = &in;
+            if (in.layout() == PLANAR) {
+                kernels::interleave(in, interleaved);
+                src = &interleaved;
+            }
+            pending.insert(pending.end(), src->cdata(), src->cdata() + src->frames() * channels);
+
+            while (base + pending.size() / channels >= next_start + segment + overlap)
+                dispatch(false);
+
+            if (in.finished())
+                break;
+        }
+
+        if (started)
+            dispatch(true);
+    } catch (...) {
+        lock_guard<mutex> lock(ctx.lock);
+        if (ctx.error == nullptr)
+            ctx.error = std::current_exception();
+    }
+
+    {
+        lock_guard<mutex> lock(ctx.lock);
+        ctx.input_done = true;
+    }
+    ctx.queued.notify_all();
+    ctx.finished.notify_all();
+
+    for (auto& w: workers)
+        w.join();
+    writer.join();
+
+    if (ctx.error != nullptr)
+        std::rethrow_exception(ctx.error);
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef U3DDAD90D_54A4_4D28_91F3_ABAA80719547
+#define U3DDAD90D_54A4_4D28_91F3_ABAA80719547
+
+#include "connection.hpp"
+#include "resampler.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /**
+         * Resamples one long stream on several threads.
+         *
+         * The input is cut into segments of whole conversion periods (the smallest
+         * number of input frames mapping to a whole number of output frames), and
+         * each segment is resampled by a fresh converter on a worker thread, with
+         * some frames of warm-up overlap on each side. The overlap is discarded
+         * from the output, and segments are reassembled in order, so the joins
+         * land on the same output frames as a single sequential converter would
+         * produce them. With an overlap longer than the filter, the samples match
+         * the sequential result up to the converter's own phase rounding.
+         */
+        class sharded_resampler
+        {
+            src_state_cache&  _cache;
+            resample_quality  _quality;
+            unsigned          _output_rate;
+            unsigned          _workers;
+            double            _segment_seconds;
+            unsigned          _overlap;
+            unsigned          _block_frames;
+
+        public:
+            /**
+             * Creates a sharded resampler.
+             *
+             * @param output_rate      sample rate (Hz) of the output
+             * @param quality          converter to use
+             * @param workers          number of worker threads, zero for one per core
+             * @param segment_seconds  approximate length of each segment
+             * @param cache            where worker converter states come from
+             */
+            explicit sharded_resampler(unsigned output_rate, resample_quality quality = SINC_MEDIUM,
+                                       unsigned workers = 0, double segment_seconds = 30.0,
+                                       src_state_cache& cache = src_state_cache::global());
+
+            /**
+             * Sets the warm-up overlap, in input frames, on each side of a segment;
+             * zero (the default) picks one long enough for every converter.
+             */
+            __attribute__((always_inline))
+            inline void overlap(unsigned frames)
+            {
+                _overlap = frames;
+            }
+
+            /**
+             * Sets the number of frames per output buffer.
+             */
+            __attribute__((always_inline))
+            inline void block_frames(unsigned frames)
+            {
+                _block_frames = frames;
+            }
+
+            /**
+             * Resamples the stream received from input and sends it, in order, to
+             * output, then closes it. Returns when the whole stream has been sent.
+             *
+             * @throws std::invalid_argument if the stream changes shape, or any
+             *         exception raised by a worker.
+             */
+            void run(connection& input, connection& output);
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
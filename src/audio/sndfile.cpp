@@ -0,0 +1,189 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+#include <string>
+
+#include "../logger.hpp"
+#include "kernels.hpp"
+#include "sndfile.hpp"
+
+using std::runtime_error;
+using std::string;
+using fu::audio::buffer;
+using fu::audio::sndfile_reader;
+using fu::audio::sndfile_writer;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("sndfile");
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                   fu::audio::sndfile_reader                                   */
+/* --------------------------------------------------------------------------------------------- */
+
+sndfile_reader::sndfile_reader(const string& path, unsigned block_frames)
+    : _file(nullptr),
+      _path(path),
+      _block_frames(block_frames),
+      _position(0),
+      _eof(false)
+{
+    _info.format = 0;
+    _file = sf_open(path.c_str(), SFM_READ, &_info);
+    if (_file == nullptr)
+        throw runtime_error(path + ": " + sf_strerror(nullptr));
+
+    FU_LOG(__log, fu::DEBUG) << "reading " << path << ": " << _info.channels << " channels, "
+                     << _info.samplerate << " Hz, " << _info.frames << " frames";
+}
+
+sndfile_reader::~sndfile_reader()
+{
+    sf_close(_file);
+}
+
+__attribute__((hot))
+bool sndfile_reader::produce(buffer& buf)
+{
+    if (_eof)
+        return false;
+
+    buf.reset(_block_frames, channels(), sample_rate());
+
+    const sf_count_t count = sf_readf_float(_file, buf.data(), _block_frames);
+    if (count < 0)
+        throw runtime_error(_path + ": " + sf_strerror(_file));
+
+    _position += count;
+
+    // Short reads only happen at end of file; when the length is known, the last
+    // full block is marked as well, instead of sending an empty one after it.
+    if (count < _block_frames || _position >= _info.frames) {
+        buf.trunc(static_cast<unsigned>(count));
+        buf.finish();
+        _eof = true;
+    }
+
+    return true;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                   fu::audio::sndfile_writer                                   */
+/* --------------------------------------------------------------------------------------------- */
+
+sndfile_writer::sndfile_writer(const string& path, int format)
+    : _file(nullptr),
+      _path(path)
+{
+    _info.format     = format;
+    _info.channels   = 0;
+    _info.samplerate = 0;
+}
+
+sndfile_writer::sndfile_writer(const string& path)
+    : sndfile_writer(path, guess_format(path))
+{
+    if (_info.format == 0)
+        throw std::invalid_argument(path + ": unknown file extension");
+}
+
+sndfile_writer::~sndfile_writer()
+{
+    close();
+}
+
+void sndfile_writer::open(const buffer& buf)
+{
+    _info.channels   = static_cast<int>(buf.channels());
+    _info.samplerate = static_cast<int>(buf.sample_rate());
+
+    if (!sf_format_check(&_info))
+        throw std::invalid_argument(_path + ": format not supported for this stream");
+
+    _file = sf_open(_path.c_str(), SFM_WRITE, &_info);
+    if (_file == nullptr)
+        throw runtime_error(_path + ": " + sf_strerror(nullptr));
+
+    FU_LOG(__log, fu::DEBUG) << "writing " << _path << ": " << _info.channels << " channels, "
+                     << _info.samplerate << " Hz";
+}
+
+void sndfile_writer::close()
+{
+    if (_file != nullptr) {
+        sf_close(_file);
+        _file = nullptr;
+    }
+}
+
+__attribute__((hot))
+void sndfile_writer::consume(const buffer& buf)
+{
+    if (__builtin_expect(_file == nullptr, 0)) {
+        if (_info.channels != 0)
+            return; // already closed after the last buffer
+        open(buf);
+    } else if (buf.channels() != static_cast<unsigned>(_info.channels)
+            || buf.sample_rate() != static_cast<unsigned>(_info.samplerate)) {
+        throw std::invalid_argument(_path + ": stream shape changed");
+    }
+
+    const buffer* src = &buf;
+    if (buf.layout() == PLANAR) {
+        kernels::interleave(buf, _interleaved);
+        src = &_interleaved;
+    }
+
+    if (sf_writef_float(_file, src->cdata(), src->frames()) != src->frames())
+        throw runtime_error(_path + ": " + sf_strerror(_file));
+
+    if (buf.finished())
+        close();
+}
+
+int sndfile_writer::guess_format(const string& path)
+{
+    const string::size_type dot = path.rfind('.');
+    if (dot == string::npos)
+        return 0;
+
+    string ext = path.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+    if (ext == "wav")                   return SF_FORMAT_WAV  | SF_FORMAT_FLOAT;
+    if (ext == "w64")                   return SF_FORMAT_W64  | SF_FORMAT_FLOAT;
+    if (ext == "caf")                   return SF_FORMAT_CAF  | SF_FORMAT_FLOAT;
+    if (ext == "aif" || ext == "aiff")  return SF_FORMAT_AIFF | SF_FORMAT_FLOAT;
+    if (ext == "au")                    return SF_FORMAT_AU   | SF_FORMAT_FLOAT;
+    if (ext == "raw")                   return SF_FORMAT_RAW  | SF_FORMAT_FLOAT;
+    if (ext == "flac")                  return SF_FORMAT_FLAC | SF_FORMAT_PCM_24;
+    if (ext == "ogg")                   return SF_FORMAT_OGG  | SF_FORMAT_VORBIS;
+
+    return 0;
+}
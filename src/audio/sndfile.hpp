@@ -0,0 +1,169 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef UD4A9E8E8_55BA_4B96_ADDD_874053CB70B7
+#define UD4A9E8E8_55BA_4B96_ADDD_874053CB70B7
+
+#include <string>
+
+#include <sndfile.h>
+
+#include "buffer.hpp"
+#include "stage.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                fu::audio::sndfile_reader                              */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Source stage decoding a file with libsndfile, straight into buffer storage.
+         */
+        class sndfile_reader : public source
+        {
+            SNDFILE*    _file;
+            SF_INFO     _info;
+            std::string _path;
+            unsigned    _block_frames;
+            sf_count_t  _position;
+            bool        _eof;
+
+        public:
+            /**
+             * Opens a file for reading.
+             *
+             * @param path          path of the file
+             * @param block_frames  number of frames per buffer
+             *
+             * @throws std::runtime_error if the file cannot be opened.
+             */
+            explicit sndfile_reader(const std::string& path, unsigned block_frames = 4096);
+
+            sndfile_reader(const sndfile_reader&) = delete;
+            sndfile_reader& operator=(const sndfile_reader&) = delete;
+
+            /**
+             * Closes the file.
+             */
+            virtual ~sndfile_reader();
+
+            /**
+             * Returns the number of channels of the file.
+             */
+            __attribute__((always_inline))
+            inline unsigned channels() const
+            {
+                return static_cast<unsigned>(_info.channels);
+            }
+
+            /**
+             * Returns the sample rate (Hz) of the file.
+             */
+            __attribute__((always_inline))
+            inline unsigned sample_rate() const
+            {
+                return static_cast<unsigned>(_info.samplerate);
+            }
+
+            /**
+             * Returns the number of frames in the file, or SF_COUNT_MAX if unknown.
+             */
+            __attribute__((always_inline))
+            inline sf_count_t frames() const
+            {
+                return _info.frames;
+            }
+
+            /**
+             * Reads the next block into buf, resetting it to block_frames frames (fewer
+             * for the last one, which is marked as finished).
+             */
+            virtual bool produce(buffer& buf) override;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                fu::audio::sndfile_writer                              */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Sink stage encoding buffers to a file with libsndfile. The file is created
+         * when the first buffer arrives, since channels and sample rate come with it,
+         * and closed after the last one.
+         */
+        class sndfile_writer : public sink
+        {
+            SNDFILE*    _file;
+            SF_INFO     _info;
+            std::string _path;
+            buffer      _interleaved;
+
+            void open(const buffer& buf);
+            void close();
+
+        public:
+            /**
+             * Prepares to write a file.
+             *
+             * @param path    path of the file
+             * @param format  libsndfile major and minor format, e.g. SF_FORMAT_WAV | SF_FORMAT_FLOAT
+             */
+            sndfile_writer(const std::string& path, int format);
+
+            /**
+             * Prepares to write a file, guessing its format from the extension.
+             *
+             * @throws std::invalid_argument if the extension is not known.
+             */
+            explicit sndfile_writer(const std::string& path);
+
+            sndfile_writer(const sndfile_writer&) = delete;
+            sndfile_writer& operator=(const sndfile_writer&) = delete;
+
+            /**
+             * Closes the file, if still open.
+             */
+            virtual ~sndfile_writer();
+
+            /**
+             * Writes a block; planar buffers are interleaved first.
+             *
+             * @throws std::runtime_error on write errors, std::invalid_argument if
+             *         the shape of the stream changes.
+             */
+            virtual void consume(const buffer& buf) override;
+
+            /**
+             * Guesses a libsndfile format from the extension of a path.
+             *
+             * @return  format, or zero if the extension is not known.
+             */
+            static int guess_format(const std::string& path);
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
@@ -0,0 +1,86 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include "stage.hpp"
+
+using fu::audio::buffer;
+using fu::audio::connection;
+using fu::audio::sink;
+using fu::audio::source;
+using fu::audio::transform;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                       fu::audio::source                                       */
+/* --------------------------------------------------------------------------------------------- */
+
+void source::run(connection& output)
+{
+    buffer buf;
+
+    while (produce(buf)) {
+        const bool last = buf.finished();
+        output.send(buf);
+        if (last)
+            break;
+    }
+
+    output.close();
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                      fu::audio::transform                                     */
+/* --------------------------------------------------------------------------------------------- */
+
+void transform::run(connection& input, connection& output)
+{
+    buffer in, out;
+
+    while (input.recv(in)) {
+        process(in, out);
+        if (in.finished())
+            out.finish();
+
+        const bool last = out.finished();
+        output.send(out);
+        if (last)
+            break;
+    }
+
+    output.close();
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                        fu::audio::sink                                        */
+/* --------------------------------------------------------------------------------------------- */
+
+void sink::run(connection& input)
+{
+    buffer buf;
+
+    while (input.recv(buf)) {
+        consume(buf);
+        if (buf.finished())
+            break;
+    }
+}
@@ -0,0 +1,119 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef U416BF857_CFA8_4F3E_8365_2D4BD380036D
+#define U416BF857_CFA8_4F3E_8365_2D4BD380036D
+
+#include "buffer.hpp"
+#include "connection.hpp"
+
+namespace fu {
+
+    namespace audio {
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                    fu::audio::source                                  */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Pipeline stage producing buffers, e.g. a file reader.
+         */
+        class source
+        {
+        public:
+            virtual ~source() { }
+
+            /**
+             * Fills buf with the next block of the stream; the last block is marked
+             * with buffer::finish().
+             *
+             * @param buf  buffer to be reset and filled, usually recycled storage.
+             *
+             * @return     true if buf holds a block, false if the stream is over.
+             */
+            virtual bool produce(buffer& buf) = 0;
+
+            /**
+             * Sends every block of the stream to output, then closes it.
+             */
+            void run(connection& output);
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                  fu::audio::transform                                 */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Pipeline stage turning each input buffer into one output buffer, which
+         * may be empty, e.g. a resampler.
+         */
+        class transform
+        {
+        public:
+            virtual ~transform() { }
+
+            /**
+             * Processes a block.
+             *
+             * @param in   input block; if finished, any data the stage still holds
+             *             must be flushed into out.
+             * @param out  buffer to be reset and filled, usually recycled storage.
+             */
+            virtual void process(const buffer& in, buffer& out) = 0;
+
+            /**
+             * Processes every block received from input and sends the results to
+             * output, then closes it.
+             */
+            void run(connection& input, connection& output);
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                    fu::audio::sink                                    */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Pipeline stage consuming buffers, e.g. a file writer.
+         */
+        class sink
+        {
+        public:
+            virtual ~sink() { }
+
+            /**
+             * Consumes a block; the last one of the stream is marked as finished.
+             */
+            virtual void consume(const buffer& buf) = 0;
+
+            /**
+             * Consumes every block received from input, until the last one or until
+             * the connection is closed.
+             */
+            void run(connection& input);
+        };
+
+    } // namespace audio
+
+} // namespace fu
+
+#endif
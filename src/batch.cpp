@@ -0,0 +1,351 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio/buffer_pool.hpp"
+#include "audio/graph.hpp"
+#include "audio/loudness.hpp"
+#include "audio/resampler.hpp"
+#include "audio/sndfile.hpp"
+#include "batch.hpp"
+#include "executor.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+using std::int64_t;
+using std::mutex;
+using std::size_t;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using fu::batch;
+using fu::executor;
+using fu::audio::graph;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                    Configurable constants                                     */
+/* --------------------------------------------------------------------------------------------- */
+
+#define DEFAULT_MEMORY      (1ul << 30)
+#define DEFAULT_BLOCK       4096
+#define DEFAULT_DEPTH       4
+#define RESAMPLER_BYTES     (1ul << 20)     // estimated libsamplerate state, per resampler
+#define METER_BYTES         (256ul << 10)   // loudness histograms and filter state
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("batch");
+
+static fu::metrics::histogram __job_ns("batch.job_ns");
+
+namespace {
+
+    /**
+     * Bytes of memory jobs may hold at once. A job waits until its estimate fits,
+     * unless nothing else runs, so that one larger than the budget still gets done.
+     */
+    class memory_budget
+    {
+        mutex                    _mutex;
+        std::condition_variable  _cv;
+        size_t                   _limit;
+        size_t                   _used;
+        unsigned                 _running;
+
+    public:
+        explicit memory_budget(size_t limit)
+            : _limit(limit), _used(0), _running(0)
+        { }
+
+        void acquire(size_t bytes)
+        {
+            unique_lock<mutex> lock(_mutex);
+            _cv.wait(lock, [&]{ return _limit == 0 || _running == 0 || _used + bytes <= _limit; });
+            _used += bytes;
+            _running++;
+        }
+
+        void release(size_t bytes)
+        {
+            {
+                unique_lock<mutex> lock(_mutex);
+                _used -= bytes;
+                _running--;
+            }
+            _cv.notify_all();
+        }
+    };
+
+    /**
+     * Holds part of a budget for its lifetime.
+     */
+    class budget_guard
+    {
+        memory_budget&  _budget;
+        size_t          _bytes;
+
+    public:
+        budget_guard(memory_budget& budget, size_t bytes)
+            : _budget(budget), _bytes(bytes)
+        {
+            _budget.acquire(bytes);
+        }
+
+        ~budget_guard()
+        {
+            _budget.release(_bytes);
+        }
+    };
+
+    /**
+     * State shared by the threads running jobs.
+     */
+    struct run_state {
+        const vector<batch::job>&  jobs;
+        const batch::options&      options;
+        executor&                  ex;
+        memory_budget              budget;
+        std::atomic<size_t>        next;
+        std::atomic<size_t>        done;
+        std::atomic<unsigned>      failed;
+
+        run_state(const vector<batch::job>& j, const batch::options& opt, executor& e)
+            : jobs(j), options(opt), ex(e), budget(opt.memory), next(0), done(0), failed(0)
+        { }
+    };
+
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 Module-local static functions                                 */
+/* --------------------------------------------------------------------------------------------- */
+
+static string __trim(const string& s)
+{
+    const size_t first = s.find_first_not_of(" \t\r");
+    if (first == string::npos)
+        return string();
+    return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+}
+
+/**
+ * Builds, sizes and runs the graph of one job.
+ */
+static void __run_job(run_state& state, size_t index)
+{
+    using namespace fu::audio;
+
+    const batch::job&     j   = state.jobs[index];
+    const batch::options& opt = state.options;
+
+    sndfile_reader reader(j.input, opt.block_frames);
+
+    const unsigned in_rate  = reader.sample_rate();
+    const unsigned out_rate = opt.rate != 0 ? opt.rate : in_rate;
+    const bool     write    = !j.output.empty();
+    const bool     measure  = opt.loudness || !write;
+    const bool     convert  = out_rate != in_rate;
+
+    // Admission comes before anything else is built, so that a queued job neither
+    // holds the memory counted for it nor creates its output file yet. Every
+    // connection holds up to depth queued buffers, plus one at each end.
+    const unsigned edges     = (convert ? 1 : 0) + (write && measure ? 3 : 1);
+    const size_t   in_block  = static_cast<size_t>(opt.block_frames) * reader.channels() * sizeof(float);
+    const size_t   out_block = in_block * out_rate / in_rate + 1;
+    const size_t   estimate  = edges * (opt.depth + 2) * std::max(in_block, out_block)
+                             + (convert ? RESAMPLER_BYTES : 0) + (measure ? METER_BYTES : 0);
+
+    budget_guard guard(state.budget, estimate);
+
+    unique_ptr<resampler>       resample;
+    unique_ptr<sndfile_writer>  writer;
+    unique_ptr<loudness_meter>  meter;
+    if (convert)
+        resample.reset(new resampler(out_rate, opt.quality));
+    if (write)
+        writer.reset(new sndfile_writer(j.output));
+    if (measure)
+        meter.reset(new loudness_meter);
+
+    // Declared after the stages, so it is destroyed (and waits for them) first.
+    graph g;
+    g.name("batch." + to_string(index));
+
+    graph::node_id last = g.add(reader);
+    if (resample) {
+        const graph::node_id n = g.add(*resample);
+        g.connect(last, n, opt.depth);
+        last = n;
+    }
+    if (writer && meter) {
+        const graph::node_id t = g.tee(2);
+        g.connect(last, t, opt.depth);
+        g.connect(t, g.add(*writer), opt.depth);
+        g.connect(t, g.add(*meter), opt.depth);
+    } else {
+        g.connect(last, writer ? g.add(*writer) : g.add(*meter), opt.depth);
+    }
+
+    const int64_t start = fu::metrics::now();
+    {
+        fu::metrics::timer t(__job_ns);
+        g.start(state.ex);
+        g.join();
+    }
+    const double elapsed = (fu::metrics::now() - start) * 1e-9;
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1);
+    line << "[" << ++state.done << "/" << state.jobs.size() << "] " << j.input;
+    if (write)
+        line << " -> " << j.output;
+    if (reader.frames() != SF_COUNT_MAX) {
+        const double seconds = static_cast<double>(reader.frames()) / in_rate;
+        line << ": " << seconds << " s of audio in " << std::setprecision(2) << elapsed << " s ("
+             << std::setprecision(0) << seconds / std::max(elapsed, 1e-9) << "x realtime)";
+    } else {
+        line << ": " << std::setprecision(2) << elapsed << " s";
+    }
+    if (meter) {
+        line << std::setprecision(1) << ", " << meter->integrated() << " LUFS, LRA "
+             << meter->range() << " LU, " << meter->true_peak() << " dBTP";
+    }
+
+    FU_LOG(__log, fu::INFO) << line.str();
+}
+
+static void __run_worker(run_state& state)
+{
+    for (;;) {
+        const size_t index = state.next++;
+        if (index >= state.jobs.size())
+            return;
+
+        try {
+            __run_job(state, index);
+        } catch (const std::exception& e) {
+            state.failed++;
+            FU_LOG(__log, fu::ERROR) << "[" << ++state.done << "/" << state.jobs.size() << "] "
+                                     << state.jobs[index].input << " failed: " << e;
+        }
+    }
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                           fu::batch                                           */
+/* --------------------------------------------------------------------------------------------- */
+
+batch::options::options()
+    : jobs(0),
+      threads(0),
+      memory(DEFAULT_MEMORY),
+      block_frames(DEFAULT_BLOCK),
+      depth(DEFAULT_DEPTH),
+      rate(0),
+      quality(audio::SINC_MEDIUM),
+      loudness(false)
+{ }
+
+batch::batch(const options& opt)
+    : _options(opt)
+{
+    if (_options.jobs == 0)
+        _options.jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    if (_options.block_frames == 0 || _options.depth == 0)
+        throw std::invalid_argument("fu::batch::batch");
+}
+
+unsigned batch::run(const vector<job>& jobs)
+{
+    executor  ex(_options.threads);
+    run_state state(jobs, _options, ex);
+
+    const unsigned workers = static_cast<unsigned>(std::min<size_t>(_options.jobs, jobs.size()));
+    FU_LOG(__log, fu::INFO) << "running " << jobs.size() << " jobs, " << workers << " at once on "
+                            << ex.size() << " threads, memory budget "
+                            << (_options.memory >> 20) << " MiB";
+
+    const int64_t start = metrics::now();
+
+    vector<std::thread> threads;
+    for (unsigned i = 0; i < workers; i++)
+        threads.emplace_back(__run_worker, std::ref(state));
+    for (auto& t: threads)
+        t.join();
+
+    const audio::buffer_pool::stats pool = audio::buffer_pool::global().statistics();
+    FU_LOG(__log, fu::INFO) << jobs.size() << " jobs done in " << (metrics::now() - start) / 1000000
+                            << " ms, " << state.failed << " failed; buffer pool: " << pool.hits
+                            << " hits, " << pool.misses << " misses, peak "
+                            << (pool.peak_bytes >> 20) << " MiB";
+
+    return state.failed;
+}
+
+vector<batch::job> batch::read_manifest(std::istream& in, const string& name)
+{
+    vector<job> jobs;
+    string      line;
+
+    while (std::getline(in, line)) {
+        line = __trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        size_t sep = line.find('\t');
+        if (sep == string::npos)
+            sep = line.find(' ');
+
+        job j;
+        j.input = line.substr(0, sep);
+        if (sep != string::npos)
+            j.output = __trim(line.substr(sep + 1));
+        jobs.push_back(j);
+    }
+
+    if (in.bad())
+        throw std::runtime_error(name + ": read error");
+
+    return jobs;
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef U9D03BD9C_6622_4AC8_8D79_5DE0C53AE07E
+#define U9D03BD9C_6622_4AC8_8D79_5DE0C53AE07E
+
+#include <cstddef>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "audio/resampler.hpp"
+
+namespace fu {
+
+    /**
+     * Runs many file jobs in one process, so that they share the buffer pool, the
+     * resampler state cache, the logger and a fu::executor instead of starting
+     * cold each time.
+     *
+     * Each job decodes its input with libsndfile, optionally resamples it, and
+     * encodes it to its output, format guessed from the extension; jobs without
+     * an output only have their loudness measured, which other jobs may do as
+     * well. At most a given number of jobs run at once, and fewer if their
+     * estimated memory would exceed the budget (a job larger than the whole
+     * budget still runs, alone). Progress and timings are logged with tag
+     * "batch", and the time taken by each job is recorded in the "batch.job_ns"
+     * histogram.
+     */
+    class batch
+    {
+    public:
+        /**
+         * Input and output of a job.
+         */
+        struct job {
+            std::string  input;
+            std::string  output;    ///< empty to only measure loudness
+        };
+
+        /**
+         * Settings shared by every job.
+         */
+        struct options {
+            unsigned                 jobs;          ///< jobs run at once, zero for one per core
+            unsigned                 threads;       ///< executor threads, zero for one per core
+            std::size_t              memory;        ///< budget in bytes, zero for none
+            unsigned                 block_frames;  ///< frames per buffer
+            unsigned                 depth;         ///< depth of connections
+            unsigned                 rate;          ///< output sample rate, zero to keep the input's
+            audio::resample_quality  quality;
+            bool                     loudness;      ///< measure jobs with an output too
+
+            /**
+             * Default settings: one job and thread per core, 1 GiB, 4096 frames,
+             * depth 4, no resampling, no loudness measurement.
+             */
+            options();
+        };
+
+    private:
+        options  _options;
+
+    public:
+        /**
+         * Creates a driver.
+         */
+        explicit batch(const options& opt);
+
+        /**
+         * Runs jobs, logging those that fail and going on with the others.
+         *
+         * @return  number of failed jobs.
+         */
+        unsigned run(const std::vector<job>& jobs);
+
+        /**
+         * Reads a manifest: one job per line, input and output separated by a tab,
+         * or by the first spaces if the line has no tab; the output may be left
+         * out. Blank lines and lines starting with '#' are skipped.
+         *
+         * @param in    stream to read
+         * @param name  name of the stream, for error messages
+         *
+         * @throws std::runtime_error if the stream cannot be read.
+         */
+        static std::vector<job> read_manifest(std::istream& in, const std::string& name);
+    };
+
+}
+
+#endif
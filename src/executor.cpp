@@ -0,0 +1,181 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <exception>
+
+#include "executor.hpp"
+#include "logger.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using fu::executor;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("executor");
+
+// Pool and queue the current thread works for, if any.
+static thread_local executor* __current = nullptr;
+static thread_local unsigned  __index   = 0;
+
+// States of a task.
+enum {
+    IDLE,
+    QUEUED,
+    RUNNING,
+    NOTIFIED,   // running, and scheduled meanwhile
+    FINISHED
+};
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                         fu::executor                                          */
+/* --------------------------------------------------------------------------------------------- */
+
+executor::task::task()
+    : _state(IDLE)
+{ }
+
+executor::executor(unsigned threads)
+    : _next(0), _stopping(false)
+{
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (unsigned i = 0; i < threads; i++)
+        _queues.emplace_back(new queue);
+    for (unsigned i = 0; i < threads; i++)
+        _threads.emplace_back(&executor::run_worker, this, i);
+}
+
+executor::~executor()
+{
+    _stopping.store(true);
+    for (unsigned i = 0; i < _threads.size(); i++)
+        _tokens.post();
+    for (auto& t: _threads)
+        t.join();
+}
+
+void executor::schedule(task& t)
+{
+    int state = t._state.load(std::memory_order_acquire);
+
+    for (;;) {
+        if (state == IDLE) {
+            if (t._state.compare_exchange_weak(state, QUEUED, std::memory_order_acq_rel)) {
+                push(t);
+                return;
+            }
+        } else if (state == RUNNING) {
+            if (t._state.compare_exchange_weak(state, NOTIFIED, std::memory_order_acq_rel))
+                return;
+        } else {
+            return;     // already queued or notified, or finished
+        }
+    }
+}
+
+void executor::push(task& t)
+{
+    const unsigned index = __current == this ? __index
+                                             : _next.fetch_add(1, std::memory_order_relaxed) % _queues.size();
+    {
+        lock_guard<mutex> lock(_queues[index]->lock);
+        _queues[index]->tasks.push_back(&t);
+    }
+    _tokens.post();
+}
+
+executor::task* executor::pop(unsigned self)
+{
+    // The token taken by the caller guarantees a task is queued somewhere, unless the
+    // pool is stopping; another thread may take the one we are heading to, but then
+    // there is another one for us.
+    for (;;) {
+        for (unsigned k = 0; k < _queues.size(); k++) {
+            const unsigned i = (self + k) % _queues.size();
+            queue& q = *_queues[i];
+            lock_guard<mutex> lock(q.lock);
+            if (!q.tasks.empty()) {
+                task* t;
+                if (i == self) {
+                    t = q.tasks.back();
+                    q.tasks.pop_back();
+                } else {
+                    t = q.tasks.front();
+                    q.tasks.pop_front();
+                }
+                return t;
+            }
+        }
+
+        if (_stopping.load())
+            return nullptr;
+        std::this_thread::yield();
+    }
+}
+
+void executor::run_worker(unsigned index)
+{
+    __current = this;
+    __index   = index;
+
+    for (;;) {
+        _tokens.wait();
+        task* t = pop(index);
+        if (t == nullptr)
+            break;
+
+        t->_state.store(RUNNING, std::memory_order_release);
+
+        task::result result;
+        try {
+            result = t->run();
+        } catch (const std::exception& e) {
+            FU_LOG(__log, fu::ERROR) << "task threw: " << e;
+            result = task::DONE;
+        } catch (...) {
+            FU_LOG(__log, fu::ERROR) << "task threw";
+            result = task::DONE;
+        }
+
+        if (result == task::DONE) {
+            t->_state.store(FINISHED, std::memory_order_release);
+            t->finished();
+            continue;
+        }
+
+        int state = RUNNING;
+        if (result == task::WAIT
+                && t->_state.compare_exchange_strong(state, IDLE, std::memory_order_acq_rel))
+            continue;
+
+        // Yielding, or scheduled while running.
+        t->_state.store(QUEUED, std::memory_order_release);
+        push(*t);
+    }
+}
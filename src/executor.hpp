@@ -0,0 +1,136 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef UDFFC9508_F09D_439E_A89A_5D383192E64B
+#define UDFFC9508_F09D_439E_A89A_5D383192E64B
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "semaphore.hpp"
+
+namespace fu {
+
+    /**
+     * Fixed pool of threads running short tasks, with work stealing.
+     *
+     * Each thread owns a queue; a task scheduled from a pool thread goes to the
+     * back of that thread's queue and is picked up from there first, so data it
+     * consumes is likely still in cache, while idle threads steal from the front
+     * of the other queues. Tasks are never run concurrently with themselves, and
+     * a task scheduled while running is run again afterwards, so no wakeup is
+     * lost.
+     */
+    class executor
+    {
+    public:
+        /**
+         * Unit of work run by an executor.
+         */
+        class task
+        {
+            friend class executor;
+
+            std::atomic<int>  _state;
+
+        public:
+            /**
+             * What the executor does with a task after running it.
+             */
+            enum result {
+                WAIT,   // run again when scheduled
+                YIELD,  // run again after other queued tasks
+                DONE    // never run again
+            };
+
+            task();
+            virtual ~task() { }
+
+            /**
+             * Does a bounded amount of work; must not throw.
+             */
+            virtual result run() = 0;
+
+            /**
+             * Called after run() returned DONE; the executor does not touch the task
+             * after this returns, so the task may be destroyed from here on.
+             */
+            virtual void finished() { }
+        };
+
+    private:
+        struct queue {
+            std::mutex         lock;
+            std::deque<task*>  tasks;
+            char               pad[64];     // keeps neighbouring queues off the same line
+        };
+
+        std::vector<std::unique_ptr<queue>>  _queues;
+        std::vector<std::thread>             _threads;
+        semaphore                            _tokens;       // one per queued task
+        std::atomic<unsigned>                _next;
+        std::atomic<bool>                    _stopping;
+
+        void push(task& t);
+        task* pop(unsigned self);
+        void run_worker(unsigned index);
+
+    public:
+        /**
+         * Starts the pool.
+         *
+         * @param threads  number of threads, zero for one per core.
+         */
+        explicit executor(unsigned threads = 0);
+
+        executor(const executor&) = delete;
+        executor& operator=(const executor&) = delete;
+
+        /**
+         * Stops the pool; every task must be done or never scheduled again.
+         */
+        ~executor();
+
+        /**
+         * Returns the number of threads.
+         */
+        __attribute__((always_inline))
+        inline unsigned size() const
+        {
+            return static_cast<unsigned>(_threads.size());
+        }
+
+        /**
+         * Queues a task to be run, unless it is already queued; if the task is
+         * running, it will be run once more. May be called from any thread.
+         */
+        void schedule(task& t);
+
+    };
+
+}
+
+#endif
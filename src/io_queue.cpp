@@ -0,0 +1,384 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "io_queue.hpp"
+#include "logger.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::unique_lock;
+using fu::io_queue;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                    Configurable constants                                     */
+/* --------------------------------------------------------------------------------------------- */
+
+#define MAX_TRANSFER    (1u << 30)  // bytes per operation; larger ones complete short
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("io_queue");
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                      fu::io_queue::uring                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+#ifdef FU_HAVE_IO_URING
+
+/**
+ * Submission and completion rings shared with the kernel, used through the raw
+ * system calls. Only the thread driving the queue touches them, so the heads and
+ * tails it owns are read plainly; the ones the kernel moves are read with acquire
+ * semantics, and ours are published with release semantics.
+ */
+struct io_queue::uring {
+    int             fd;
+    char*           sq_map;
+    size_t          sq_map_size;
+    char*           cq_map;         // same as sq_map with IORING_FEAT_SINGLE_MMAP
+    size_t          cq_map_size;
+    io_uring_sqe*   sqes;
+    size_t          sqes_size;
+
+    unsigned*       sq_tail;
+    unsigned*       sq_mask;
+    unsigned*       sq_array;
+    unsigned*       cq_head;
+    unsigned*       cq_tail;
+    unsigned*       cq_mask;
+    io_uring_cqe*   cqes;
+
+    unsigned        queued;         // entries not handed to the kernel yet
+
+    /**
+     * Sets up a ring with room for depth entries.
+     *
+     * @return  the ring, or null if the kernel lacks io_uring or forbids it.
+     */
+    static uring* open(unsigned depth)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+
+        const int fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &p));
+        if (fd < 0) {
+            FU_LOG(__log, fu::INFO) << "io_uring unavailable: " << strerror(errno);
+            return nullptr;
+        }
+
+        // IORING_OP_READ and IORING_OP_WRITE arrived in Linux 5.6, along with this flag.
+        if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+            FU_LOG(__log, fu::INFO) << "io_uring unavailable: kernel too old";
+            close(fd);
+            return nullptr;
+        }
+
+        uring* u = new uring;
+        u->fd          = fd;
+        u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        u->sqes_size   = p.sq_entries * sizeof(io_uring_sqe);
+        u->queued      = 0;
+
+        const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single)
+            u->sq_map_size = u->cq_map_size = std::max(u->sq_map_size, u->cq_map_size);
+
+        void* sq   = mmap(nullptr, u->sq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        void* cq   = single || sq == MAP_FAILED ? sq
+                   : mmap(nullptr, u->cq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void* sqes = cq == MAP_FAILED ? MAP_FAILED
+                   : mmap(nullptr, u->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+        if (sqes == MAP_FAILED) {
+            FU_LOG(__log, fu::INFO) << "io_uring unavailable: " << strerror(errno);
+            if (cq != MAP_FAILED && !single)
+                munmap(cq, u->cq_map_size);
+            if (sq != MAP_FAILED)
+                munmap(sq, u->sq_map_size);
+            close(fd);
+            delete u;
+            return nullptr;
+        }
+
+        u->sq_map   = static_cast<char*>(sq);
+        u->cq_map   = static_cast<char*>(cq);
+        u->sqes     = static_cast<io_uring_sqe*>(sqes);
+        u->sq_tail  = reinterpret_cast<unsigned*>(u->sq_map + p.sq_off.tail);
+        u->sq_mask  = reinterpret_cast<unsigned*>(u->sq_map + p.sq_off.ring_mask);
+        u->sq_array = reinterpret_cast<unsigned*>(u->sq_map + p.sq_off.array);
+        u->cq_head  = reinterpret_cast<unsigned*>(u->cq_map + p.cq_off.head);
+        u->cq_tail  = reinterpret_cast<unsigned*>(u->cq_map + p.cq_off.tail);
+        u->cq_mask  = reinterpret_cast<unsigned*>(u->cq_map + p.cq_off.ring_mask);
+        u->cqes     = reinterpret_cast<io_uring_cqe*>(u->cq_map + p.cq_off.cqes);
+
+        return u;
+    }
+
+    ~uring()
+    {
+        munmap(sqes, sqes_size);
+        if (cq_map != sq_map)
+            munmap(cq_map, cq_map_size);
+        munmap(sq_map, sq_map_size);
+        close(fd);
+    }
+
+    /**
+     * Fills the next submission entry; there is always one free, since no more
+     * than depth operations are pending.
+     */
+    void push(const request& r)
+    {
+        const unsigned tail  = *sq_tail;
+        const unsigned index = tail & *sq_mask;
+
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd        = r.fd;
+        sqe->addr      = reinterpret_cast<uintptr_t>(r.data);
+        sqe->len       = static_cast<unsigned>(r.size);
+        sqe->off       = r.offset;
+        sqe->user_data = r.tag;
+
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+    }
+
+    /**
+     * Pops a completion, if there is one.
+     */
+    bool pop(completion& c)
+    {
+        const unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+
+        const io_uring_cqe& cqe = cqes[head & *cq_mask];
+        c.tag    = cqe.user_data;
+        c.result = cqe.res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    /**
+     * Submits queued entries, and waits for at least min_complete completions.
+     */
+    void enter(unsigned min_complete)
+    {
+        const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        for (;;) {
+            const long n = syscall(__NR_io_uring_enter, fd, queued, min_complete, flags,
+                                   nullptr, 0);
+            if (n >= 0) {
+                queued -= static_cast<unsigned>(n);
+                return;
+            }
+            if (errno != EINTR)
+                throw runtime_error(string("io_uring_enter: ") + strerror(errno));
+        }
+    }
+};
+
+#endif
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                         fu::io_queue                                          */
+/* --------------------------------------------------------------------------------------------- */
+
+io_queue::io_queue(unsigned depth, bool uring)
+    : _depth(depth),
+      _pending(0),
+      _uring(nullptr),
+      _stopping(false)
+{
+    if (depth == 0)
+        throw std::invalid_argument("fu::io_queue::io_queue");
+
+#ifdef FU_HAVE_IO_URING
+    if (uring)
+        _uring = uring::open(depth);
+#else
+    (void) uring;
+#endif
+
+    if (_uring == nullptr) {
+        for (unsigned i = 0; i < depth; i++)
+            _threads.emplace_back(&io_queue::run_worker, this);
+    }
+}
+
+io_queue::~io_queue()
+{
+    drain();
+
+#ifdef FU_HAVE_IO_URING
+    delete _uring;
+#endif
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _requests_cv.notify_all();
+    for (auto& t: _threads)
+        t.join();
+}
+
+void io_queue::push(const request& r)
+{
+#ifdef FU_HAVE_IO_URING
+    if (_uring != nullptr) {
+        _uring->push(r);
+        _pending++;
+        return;
+    }
+#endif
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        _requests.push_back(r);
+    }
+    _pending++;
+    _requests_cv.notify_one();
+}
+
+void io_queue::read(int fd, void* data, size_t size, uint64_t offset, uint64_t tag)
+{
+    if (_pending >= _depth)
+        throw std::invalid_argument("fu::io_queue::read");
+
+    const request r = { fd, static_cast<char*>(data), std::min<size_t>(size, MAX_TRANSFER),
+                        offset, tag, false };
+    push(r);
+}
+
+void io_queue::write(int fd, const void* data, size_t size, uint64_t offset, uint64_t tag)
+{
+    if (_pending >= _depth)
+        throw std::invalid_argument("fu::io_queue::write");
+
+    const request r = { fd, static_cast<char*>(const_cast<void*>(data)),
+                        std::min<size_t>(size, MAX_TRANSFER), offset, tag, true };
+    push(r);
+}
+
+void io_queue::submit()
+{
+#ifdef FU_HAVE_IO_URING
+    if (_uring != nullptr && _uring->queued > 0)
+        _uring->enter(0);
+#endif
+}
+
+io_queue::completion io_queue::wait()
+{
+    if (_pending == 0)
+        throw std::invalid_argument("fu::io_queue::wait");
+
+    completion c;
+
+#ifdef FU_HAVE_IO_URING
+    if (_uring != nullptr) {
+        while (!_uring->pop(c))
+            _uring->enter(1);
+        _pending--;
+        return c;
+    }
+#endif
+
+    unique_lock<mutex> lock(_mutex);
+    _completions_cv.wait(lock, [this]{ return !_completions.empty(); });
+    c = _completions.front();
+    _completions.pop_front();
+    _pending--;
+    return c;
+}
+
+void io_queue::drain()
+{
+    try {
+        while (_pending > 0)
+            wait();
+    } catch (const std::exception& e) {
+        // Memory of the operations left may still be written to; nothing more can
+        // be done about it from here.
+        FU_LOG(__log, fu::ERROR) << "drain failed, " << _pending << " operations left: " << e;
+    }
+}
+
+void io_queue::run_worker()
+{
+    for (;;) {
+        request r;
+        {
+            unique_lock<mutex> lock(_mutex);
+            _requests_cv.wait(lock, [this]{ return _stopping || !_requests.empty(); });
+            if (_requests.empty())
+                return;
+            r = _requests.front();
+            _requests.pop_front();
+        }
+
+        ssize_t n;
+        do {
+            n = r.write ? pwrite(r.fd, r.data, r.size, static_cast<off_t>(r.offset))
+                        : pread(r.fd, r.data, r.size, static_cast<off_t>(r.offset));
+        } while (n < 0 && errno == EINTR);
+
+        const completion c = { r.tag, n < 0 ? -static_cast<long>(errno) : static_cast<long>(n) };
+        {
+            lock_guard<mutex> lock(_mutex);
+            _completions.push_back(c);
+        }
+        _completions_cv.notify_one();
+    }
+}
@@ -0,0 +1,174 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef U29DC4478_4D0E_4A07_A68B_217C118329BD
+#define U29DC4478_4D0E_4A07_A68B_217C118329BD
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// io_uring is tried first on Linux; define FU_NO_IO_URING to always use the
+// thread pool.
+#if defined(__linux__) && !defined(FU_NO_IO_URING)
+#define FU_HAVE_IO_URING 1
+#endif
+
+namespace fu {
+
+    /**
+     * Queue of positioned file reads and writes, completed asynchronously.
+     *
+     * Operations are run by io_uring when the kernel supports it, and otherwise
+     * by a pool of threads calling pread and pwrite, one per slot, so up to depth
+     * operations are in flight either way. Reads and writes may complete short
+     * or out of order; callers resubmit the remainder themselves.
+     *
+     * A queue is driven by a single thread, which submits and waits; the memory
+     * of an operation must stay valid until its completion has been returned.
+     */
+    class io_queue
+    {
+    public:
+        /**
+         * Result of an operation.
+         */
+        struct completion {
+            std::uint64_t  tag;     ///< tag given at submission
+            long           result;  ///< bytes transferred, or -errno
+        };
+
+    private:
+        struct uring;
+
+        struct request {
+            int            fd;
+            char*          data;
+            std::size_t    size;
+            std::uint64_t  offset;
+            std::uint64_t  tag;
+            bool           write;
+        };
+
+        unsigned  _depth;
+        unsigned  _pending;         // submitted or queued, not yet returned by wait()
+        uring*    _uring;           // null when running on the thread pool
+
+        std::mutex                 _mutex;
+        std::condition_variable    _requests_cv;
+        std::condition_variable    _completions_cv;
+        std::deque<request>        _requests;
+        std::deque<completion>     _completions;
+        std::vector<std::thread>   _threads;
+        bool                       _stopping;
+
+        void push(const request& r);
+        void run_worker();
+
+    public:
+        /**
+         * Creates a queue.
+         *
+         * @param depth   maximum number of operations pending at once.
+         * @param uring   false to use the thread pool even if io_uring works.
+         *
+         * @throws std::invalid_argument if depth is zero.
+         */
+        explicit io_queue(unsigned depth, bool uring = true);
+
+        io_queue(const io_queue&) = delete;
+        io_queue& operator=(const io_queue&) = delete;
+
+        /**
+         * Waits for pending operations, then releases the ring or the threads.
+         */
+        ~io_queue();
+
+        /**
+         * Returns the maximum number of pending operations.
+         */
+        __attribute__((always_inline))
+        inline unsigned depth() const
+        {
+            return _depth;
+        }
+
+        /**
+         * Returns the number of operations whose completion was not returned yet.
+         */
+        __attribute__((always_inline))
+        inline unsigned pending() const
+        {
+            return _pending;
+        }
+
+        /**
+         * Returns true if operations are run by io_uring.
+         */
+        __attribute__((always_inline))
+        inline bool uring() const
+        {
+            return _uring != nullptr;
+        }
+
+        /**
+         * Queues a read of size bytes at offset into data. With io_uring, queued
+         * operations reach the kernel on submit() or wait().
+         *
+         * @throws std::invalid_argument if depth operations are already pending.
+         */
+        void read(int fd, void* data, std::size_t size, std::uint64_t offset, std::uint64_t tag);
+
+        /**
+         * Queues a write of size bytes from data at offset, as read() does.
+         */
+        void write(int fd, const void* data, std::size_t size, std::uint64_t offset,
+                   std::uint64_t tag);
+
+        /**
+         * Hands queued operations to the kernel, without waiting for them.
+         *
+         * @throws std::runtime_error if io_uring_enter fails.
+         */
+        void submit();
+
+        /**
+         * Submits queued operations, then waits for one to complete.
+         *
+         * @throws std::invalid_argument if nothing is pending, std::runtime_error
+         *         if io_uring_enter fails.
+         */
+        completion wait();
+
+        /**
+         * Waits for every pending operation, discarding the results.
+         */
+        void drain();
+    };
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef U53339CE1_BE5E_43E1_BA1A_807510A0DFCE
+#define U53339CE1_BE5E_43E1_BA1A_807510A0DFCE
+
+#include <cstdint>
+
+namespace fu {
+
+    /**
+     * Layout of binary log files, written by fu::logger::binary_file() and read
+     * by fu-logdump. All fields are in host byte order.
+     *
+     * The file starts with a file_header, followed by the tag and thread name
+     * tables, then by a ring of records. Records are 8-byte aligned and never wrap
+     * around the end of the ring; each one carries its absolute position, so that
+     * a reader can tell a record from leftovers of an older lap, and its size is
+     * written last, so that a record torn by a crash is skipped.
+     */
+    namespace log_format {
+
+        static const char     MAGIC[8]       = { 'F', 'U', 'L', 'O', 'G', 'v', '1', '\0' };
+        static const unsigned NAME_SIZE      = 32;       // bytes per name table entry
+        static const unsigned MAX_TAGS       = 1024;
+        static const unsigned MAX_THREADS    = 4096;
+        static const uint16_t UNKNOWN        = 0xFFFF;   // tag or thread index when a table is full
+
+        /**
+         * Kinds of records.
+         */
+        enum record_kind {
+            MESSAGE = 1,
+            PADDING = 2     // fills the end of the ring when a record does not fit
+        };
+
+        /**
+         * Header at offset zero of the file.
+         */
+        struct file_header {
+            char      magic[8];
+            uint64_t  names_offset;     // offset of the tag table, followed by the thread table
+            uint64_t  ring_offset;      // offset of the ring
+            uint64_t  capacity;         // size of the ring, multiple of 8
+            uint64_t  head;             // bytes reserved in the ring since creation
+            uint32_t  tags;             // entries used in the tag table
+            uint32_t  threads;          // entries used in the thread table
+        };
+
+        /**
+         * Entry of a name table; name is NUL-terminated.
+         */
+        struct name_entry {
+            uint32_t  ready;            // set once name is written
+            char      name[NAME_SIZE - sizeof(uint32_t)];
+        };
+
+        /**
+         * Header of each record, followed by length bytes of message text.
+         */
+        struct record_header {
+            uint32_t  size;             // bytes of the record, header included; written last
+            uint16_t  kind;
+            uint8_t   level;
+            uint8_t   reserved;
+            uint64_t  position;         // absolute position of the record in the ring
+            int64_t   time;             // ns since the steady clock epoch
+            uint16_t  thread;
+            uint16_t  tag;
+            uint32_t  length;
+        };
+
+        /**
+         * Rounds a size up to the alignment of records.
+         */
+        inline uint64_t align(uint64_t size)
+        {
+            return (size + 7) & ~static_cast<uint64_t>(7);
+        }
+
+    } // namespace log_format
+
+} // namespace fu
+
+#endif
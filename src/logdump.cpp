@@ -0,0 +1,197 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log_format.hpp"
+#include "logger.hpp"
+
+
+using std::cerr;
+using std::cout;
+using std::string;
+using std::vector;
+using fu::logger;
+
+namespace log_format = fu::log_format;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                          fu-logdump                                           */
+/* --------------------------------------------------------------------------------------------- */
+
+/*
+ * Decodes a binary log file written by fu::logger::binary_file() to the layout fu
+ * writes to stderr, oldest entry first. The file may be in use by a running
+ * process, or left behind by a crashed one; records being written, or torn by the
+ * crash, are skipped.
+ */
+
+namespace {
+
+    /**
+     * Returns the name at an index of a name table, or "?" if it is not there.
+     */
+    const char* name(const log_format::name_entry* table, uint32_t count, uint16_t index)
+    {
+        if (index >= count || __atomic_load_n(&table[index].ready, __ATOMIC_ACQUIRE) == 0)
+            return "?";
+        return table[index].name;
+    }
+
+    int usage(const char* argv0)
+    {
+        cerr << "usage: " << argv0 << " [--color | --no-color] FILE" << std::endl;
+        return 2;
+    }
+
+    int fail(const string& what)
+    {
+        cerr << "fu-logdump: " << what << std::endl;
+        return 1;
+    }
+
+}
+
+int main(int argc, char* argv[])
+{
+    using log_format::file_header;
+    using log_format::name_entry;
+    using log_format::record_header;
+
+    const char* path  = nullptr;
+    int         color = -1;     // -1 when standard output is a terminal
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--color") == 0)
+            color = 1;
+        else if (std::strcmp(argv[i], "--no-color") == 0)
+            color = 0;
+        else if (argv[i][0] != '-' && path == nullptr)
+            path = argv[i];
+        else
+            return usage(argv[0]);
+    }
+    if (path == nullptr)
+        return usage(argv[0]);
+
+    if (color < 0)
+        color = isatty(STDOUT_FILENO);
+    if (color)
+        logger::color(fu::FORCE_COLOR);
+
+    // Map the file.
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return fail(string(path) + ": " + std::strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return fail(string(path) + ": " + std::strerror(errno));
+
+    const size_t length = static_cast<size_t>(st.st_size);
+    if (length < sizeof(file_header))
+        return fail(string(path) + ": not a binary log file");
+
+    void* base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return fail(string(path) + ": " + std::strerror(errno));
+
+    // Check the header.
+    const char*        data   = static_cast<const char*>(base);
+    const file_header& header = *reinterpret_cast<const file_header*>(data);
+
+    if (std::memcmp(header.magic, log_format::MAGIC, sizeof(log_format::MAGIC)) != 0)
+        return fail(string(path) + ": not a binary log file");
+
+    const uint64_t capacity = header.capacity;
+    const uint64_t tables   = (log_format::MAX_TAGS + log_format::MAX_THREADS) * sizeof(name_entry);
+    if (capacity == 0 || capacity % 8 != 0
+            || header.names_offset + tables > header.ring_offset
+            || header.ring_offset + capacity > length)
+        return fail(string(path) + ": corrupt header");
+
+    const name_entry* tags    = reinterpret_cast<const name_entry*>(data + header.names_offset);
+    const name_entry* threads = tags + log_format::MAX_TAGS;
+    const char*       ring    = data + header.ring_offset;
+
+    const uint32_t tag_count    = std::min(__atomic_load_n(&header.tags, __ATOMIC_ACQUIRE),
+                                           static_cast<uint32_t>(log_format::MAX_TAGS));
+    const uint32_t thread_count = std::min(__atomic_load_n(&header.threads, __ATOMIC_ACQUIRE),
+                                           static_cast<uint32_t>(log_format::MAX_THREADS));
+
+    // Walk the last lap of the ring. A position not holding a record stamped with it
+    // is leftover from an older lap, or was never finished: move on by the alignment
+    // until records line up again.
+    const uint64_t head  = __atomic_load_n(&header.head, __ATOMIC_ACQUIRE);
+    uint64_t       pos   = head > capacity ? head - capacity : 0;
+
+    vector<const record_header*> entries;
+    while (pos + sizeof(record_header) <= head) {
+        const uint64_t offset = pos % capacity;
+        if (offset + sizeof(record_header) > capacity) {
+            pos += capacity - offset;
+            continue;
+        }
+
+        const record_header* record = reinterpret_cast<const record_header*>(ring + offset);
+        const uint32_t       size   = __atomic_load_n(&record->size, __ATOMIC_ACQUIRE);
+
+        if (record->position != pos || size < sizeof(record_header) || size % 8 != 0
+                || offset + size > capacity || sizeof(record_header) + record->length > size) {
+            pos += 8;
+            continue;
+        }
+
+        if (record->kind == log_format::MESSAGE && record->level <= fu::FATAL)
+            entries.push_back(record);
+        pos += size;
+    }
+
+    // Threads take their timestamps before reserving space, so records may be
+    // slightly out of order.
+    std::stable_sort(entries.begin(), entries.end(), [](const record_header* a, const record_header* b) {
+        return a->time < b->time;
+    });
+
+    for (const record_header* r: entries) {
+        logger::replay(cout, r->time, name(threads, thread_count, r->thread), name(tags, tag_count, r->tag),
+                       static_cast<fu::logger_level>(r->level), reinterpret_cast<const char*>(r + 1),
+                       r->length);
+    }
+    cout.flush();
+
+    munmap(base, length);
+    return cout ? 0 : 1;
+}
@@ -19,26 +19,44 @@
 // DEALINGS IN THE SOFTWARE.
 
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
 #include <chrono>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <list>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <sstream>
 #include <stdexcept>
-#include <boost/algorithm/string.hpp>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <syscall.h>
+#include <unistd.h>
 #include <cxxabi.h>
 
 #define UNW_LOCAL_ONLY
 #include <libunwind.h>
 
+#include "log_format.hpp"
 #include "logger.hpp"
 
 
+using std::atomic;
 using std::clog;
 using std::endl;
 using std::exception;
@@ -47,13 +65,18 @@ using std::lock_guard;
 using std::mutex;
 using std::ostream;
 using std::ostringstream;
+using std::runtime_error;
 using std::string;
 using std::size_t;
-using std::list;
+using std::unique_ptr;
+using std::vector;
 using fu::logger;
+using fu::logger_overflow;
 using fu::logger_level;
 using fu::logger_line;
 
+namespace log_format = fu::log_format;
+
 
 /* --------------------------------------------------------------------------------------------- */
 /*                                           fu::logger                                          */
@@ -63,8 +86,10 @@ using fu::logger_line;
 /*                            Defaults for fu::logger static variables                           */
 /* --------------------------------------------------------------------------------------------- */
 
-logger_level             fu::logger::_level       = fu::ERROR;
-thread_local const char* fu::logger::_thread_name = nullptr;
+logger_level                      fu::logger::_level        = fu::ERROR;
+atomic<std::uint32_t>             fu::logger::_epoch(1);
+thread_local const char*          fu::logger::_thread_name  = nullptr;
+thread_local logger_level         fu::logger::_thread_level = fu::NONE;
 
 
 /* --------------------------------------------------------------------------------------------- */
@@ -87,40 +112,308 @@ enum class bg {
 
 static bool __use_color = false;
 
-__attribute__((hot))
-static ostream& __print_code(ostream& os, int val)
+__attribute__((cold))
+void fu::logger::color(force_color force)
+{
+    __use_color = (force == FORCE_COLOR) || isatty(STDERR_FILENO);
+}
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                            Levels                                             */
+/* --------------------------------------------------------------------------------------------- */
+
+static mutex                           __levels_mutex;      // guards the levels below, and _level
+static std::map<string, logger_level>  __tag_levels;
+static unsigned                        __thread_levels[fu::NONE + 1];   // threads lowering to each level
+static string                          __levels_path;       // file reloaded on signal
+static int                             __reload_pipe[2] = { -1, -1 };  // signal handler -> __reload_main
+static std::once_flag                  __reload_once;
+
+namespace {
+
+    /**
+     * Takes back the level override of a thread when it exits.
+     */
+    struct thread_level_guard {
+        ~thread_level_guard()
+        {
+            logger::thread_level(fu::NONE);
+        }
+    };
+
+}
+
+static thread_local thread_level_guard __thread_level_guard;
+
+/**
+ * Parses a level name or number.
+ */
+static bool __parse_level(const string& name, logger_level& level)
+{
+    static const char* const names[] = { "trace", "debug", "info", "warn", "error", "fatal" };
+
+    string lower(name);
+    for (auto& c: lower)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+
+    for (int i = fu::TRACE; i <= fu::FATAL; i++) {
+        if (lower == names[i] || (lower.size() == 1 && lower[0] == '0' + i)) {
+            level = static_cast<logger_level>(i);
+            return true;
+        }
+    }
+    if (lower == "all") {
+        level = fu::ALL;
+        return true;
+    }
+    if (lower == "none") {
+        level = fu::NONE;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Parses a list of levels as for logger::levels(), adding tag levels to tags and
+ * setting global if a level alone is given.
+ */
+static void __parse_levels(const string& spec, std::map<string, logger_level>& tags,
+                           logger_level& global, bool& has_global)
+{
+    using std::invalid_argument;
+
+    const auto trim = [](const string& s) {
+        const size_t begin = s.find_first_not_of(" \t\r\n");
+        const size_t end   = s.find_last_not_of(" \t\r\n");
+        return begin == string::npos ? string() : s.substr(begin, end - begin + 1);
+    };
+
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == string::npos)
+            comma = spec.size();
+
+        const string item = trim(spec.substr(pos, comma - pos));
+        pos = comma + 1;
+        if (item.empty())
+            continue;
+
+        const size_t equals = item.find('=');
+        logger_level level;
+        if (equals == string::npos) {
+            if (!__parse_level(item, level))
+                throw invalid_argument("fu::logger: unknown level \"" + item + "\"");
+            global     = level;
+            has_global = true;
+        } else {
+            const string tag  = trim(item.substr(0, equals));
+            const string name = trim(item.substr(equals + 1));
+            if (tag.empty() || !__parse_level(name, level))
+                throw invalid_argument("fu::logger: malformed level \"" + item + "\"");
+            tags[tag] = level;
+        }
+    }
+}
+
+/**
+ * Reads a file of levels; see logger::levels_from_file().
+ */
+static void __read_levels(const string& path, std::map<string, logger_level>& tags,
+                          logger_level& global, bool& has_global)
+{
+    std::ifstream in(path);
+    if (!in)
+        throw runtime_error(path + ": " + std::strerror(errno));
+
+    string line;
+    while (std::getline(in, line))
+        __parse_levels(line.substr(0, line.find('#')), tags, global, has_global);
+}
+
+/**
+ * Makes every logger recompute its level on its next check; called with
+ * __levels_mutex held, or from a signal handler.
+ */
+static void __bump_epoch(atomic<std::uint32_t>& epoch)
+{
+    // Zero is the epoch of loggers never checked.
+    if (epoch.fetch_add(1, std::memory_order_release) + 1 == 0)
+        epoch.fetch_add(1, std::memory_order_release);
+}
+
+std::uint64_t fu::logger::refresh() const
 {
-    if (__builtin_expect(__use_color, 0)) {
-        os << "\033[" << val << "m";
+    lock_guard<mutex> lock(__levels_mutex);
+
+    // Read first, so that a change made meanwhile triggers another refresh.
+    const std::uint32_t epoch = _epoch.load(std::memory_order_acquire);
+
+    auto it = __tag_levels.find(_tag);
+    const logger_level tag_level = it != __tag_levels.end() ? it->second : _level;
+
+    int threshold = tag_level;
+    for (int i = fu::TRACE; i < threshold; i++) {
+        if (__thread_levels[i] > 0) {
+            threshold = i;
+            break;
+        }
     }
 
-    return os;
+    const std::uint64_t cache = static_cast<std::uint64_t>(epoch) << 16
+                              | static_cast<std::uint64_t>(tag_level + 1) << 8
+                              | static_cast<std::uint64_t>(threshold + 1);
+    __atomic_store_n(&_cache, cache, __ATOMIC_RELAXED);
+    return cache;
+}
+
+void fu::logger::reload_signal(int)
+{
+    // Only wakes __reload_main; a full pipe means a reload is pending anyway.
+    const int  saved = errno;
+    const char byte  = 0;
+    const ssize_t n  = write(__reload_pipe[1], &byte, 1);
+    (void) n;
+    errno = saved;
+}
+
+__attribute__((cold))
+void fu::logger::level(logger_level level)
+{
+    lock_guard<mutex> lock(__levels_mutex);
+    _level = level;
+    __bump_epoch(_epoch);
 }
 
 __attribute__((cold))
-void fu::logger::color(force_color force)
+void fu::logger::level(const char* tag, logger_level level)
 {
-    __use_color = (force == FORCE_COLOR) || isatty(STDERR_FILENO);
+    lock_guard<mutex> lock(__levels_mutex);
+    __tag_levels[tag] = level;
+    __bump_epoch(_epoch);
+}
+
+__attribute__((cold))
+void fu::logger::thread_level(logger_level level)
+{
+    if (level == _thread_level)
+        return;
+
+    // Instantiate the guard before taking the lock, since it may take it on exit.
+    (void) &__thread_level_guard;
+
+    lock_guard<mutex> lock(__levels_mutex);
+    if (_thread_level >= fu::TRACE && _thread_level < fu::NONE)
+        __thread_levels[_thread_level]--;
+    _thread_level = std::max(level, fu::TRACE);
+    if (_thread_level < fu::NONE)
+        __thread_levels[_thread_level]++;
+    __bump_epoch(_epoch);
+}
+
+__attribute__((cold))
+void fu::logger::reset_levels()
+{
+    lock_guard<mutex> lock(__levels_mutex);
+    __tag_levels.clear();
+    __bump_epoch(_epoch);
+}
+
+__attribute__((cold))
+void fu::logger::levels(const string& spec)
+{
+    std::map<string, logger_level> tags;
+    logger_level global;
+    bool has_global = false;
+    __parse_levels(spec, tags, global, has_global);
+
+    lock_guard<mutex> lock(__levels_mutex);
+    for (auto& tag: tags)
+        __tag_levels[tag.first] = tag.second;
+    if (has_global)
+        _level = global;
+    __bump_epoch(_epoch);
 }
 
-__attribute__((always_inline, hot))
-inline static ostream& operator<< (ostream& os, fg color)
+__attribute__((cold))
+void fu::logger::levels_from_env(const char* name)
 {
-    return __print_code(os, static_cast<int>(color));
+    const char* spec = std::getenv(name);
+    if (spec != nullptr)
+        levels(spec);
 }
 
-__attribute__((always_inline, hot))
-inline static ostream& operator<< (ostream& os, bg color)
+__attribute__((cold))
+void fu::logger::levels_from_file(const string& path)
 {
-    return __print_code(os, static_cast<int>(color));
+    std::map<string, logger_level> tags;
+    logger_level global;
+    bool has_global = false;
+    __read_levels(path, tags, global, has_global);
+
+    lock_guard<mutex> lock(__levels_mutex);
+    __tag_levels.swap(tags);
+    if (has_global)
+        _level = global;
+    __bump_epoch(_epoch);
 }
 
-__attribute__((always_inline, hot))
-inline static ostream& operator<< (ostream& os, attr attr)
+/**
+ * Body of the thread reloading levels: waits for the signal handler to write to
+ * __reload_pipe, then reads the file, so that threads checking a level never do.
+ * Signals arriving meanwhile are coalesced into one more reload.
+ */
+static void __reload_main()
 {
-    return __print_code(os, static_cast<int>(attr));
+    static const logger self("logger");
+
+    logger::thread_name("log-levels");
+
+    for (;;) {
+        char bytes[64];
+        const ssize_t n = read(__reload_pipe[0], bytes, sizeof(bytes));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        string path;
+        {
+            lock_guard<mutex> lock(__levels_mutex);
+            path = __levels_path;
+        }
+
+        try {
+            logger::levels_from_file(path);
+        } catch (const exception& e) {
+            FU_LOG(self, fu::ERROR) << "cannot reload levels: " << e;
+        }
+    }
 }
 
+__attribute__((cold))
+void fu::logger::reload_levels_on(int signum, const string& path)
+{
+    {
+        lock_guard<mutex> lock(__levels_mutex);
+        __levels_path = path;
+    }
+
+    std::call_once(__reload_once, [] {
+        if (pipe2(__reload_pipe, O_CLOEXEC) < 0)
+            throw runtime_error(string("fu::logger::reload_levels_on: pipe: ") + std::strerror(errno));
+        fcntl(__reload_pipe[1], F_SETFL, O_NONBLOCK);
+        std::thread(__reload_main).detach();
+    });
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = reload_signal;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signum, &action, nullptr) < 0)
+        throw runtime_error(string("fu::logger::reload_levels_on: ") + std::strerror(errno));
+}
 
 /* --------------------------------------------------------------------------------------------- */
 /*                                        fu::logger_line                                        */
@@ -131,9 +424,19 @@ inline static ostream& operator<< (ostream& os, attr attr)
 /*                                     Configurable constants                                    */
 /* --------------------------------------------------------------------------------------------- */
 
-#define TIME_WIDTH    13
-#define THREAD_WIDTH  12
-#define TAG_WIDTH     12
+#define TIME_WIDTH      13
+#define THREAD_WIDTH    12
+#define TAG_WIDTH       12
+#define MERGE_WINDOW    5000000   // ns a record is held back for late records stamped before it
+#define FLUSH_INTERVAL  2000000   // ns the writer thread sleeps when there is nothing to write
+#define WRITE_BATCH     64        // records per writev call
+#define MESSAGE_SIZE    4096      // chars of a message kept, the rest is cut
+#define LINE_SIZE       16384     // chars of a formatted entry, stack trace included
+#define TIME_RESERVE    64        // chars kept in front of an entry for its timestamp
+#define RECORD_RESERVE  256       // chars reserved for each entry of an asynchronous queue
+#define BINARY_MIN_SIZE 65536     // bytes of the smallest ring of a binary log file
+#define TAG_CACHE_SIZE  16        // tag indices each thread caches when writing a binary log file
+#define TRACE_FRAMES    64        // frames of a stack trace captured, those of the logger included
 
 
 /* --------------------------------------------------------------------------------------------- */
@@ -142,6 +445,167 @@ inline static ostream& operator<< (ostream& os, attr attr)
 
 static mutex __logger_mutex;
 
+namespace {
+
+    /**
+     * Fixed-capacity stream buffer messages are written to; what does not fit is
+     * discarded.
+     */
+    class message_buffer : public std::streambuf
+    {
+        char  _data[MESSAGE_SIZE];
+        bool  _truncated;
+
+    protected:
+        int_type overflow(int_type ch) override
+        {
+            _truncated = true;
+            return traits_type::not_eof(ch);
+        }
+
+    public:
+        message_buffer()
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            setp(_data, _data + MESSAGE_SIZE);
+            _truncated = false;
+        }
+
+        const char* data() const
+        {
+            return pbase();
+        }
+
+        size_t size() const
+        {
+            return static_cast<size_t>(pptr() - pbase());
+        }
+
+        bool truncated() const
+        {
+            return _truncated;
+        }
+    };
+
+    /**
+     * Stream reused by every line logged from a thread.
+     */
+    struct message_stream {
+        message_buffer  buf;
+        ostream         os;
+        bool            busy;     // a line is being built with it
+
+        message_stream()
+            : os(&buf), busy(false)
+        { }
+
+        void reset()
+        {
+            buf.reset();
+            os.clear();
+            os.flags(ios_base::skipws | ios_base::dec);
+            os.precision(6);
+            os.width(0);
+            os.fill(' ');
+        }
+    };
+
+    /**
+     * Fixed-capacity character buffer an entry is formatted into, with room in
+     * front for the timestamp, which may only be known later.
+     */
+    class format_buffer
+    {
+        char    _data[LINE_SIZE];
+        size_t  _size;
+
+        void code(int val)
+        {
+            if (__builtin_expect(__use_color, 0)) {
+                char tmp[8];
+                append(tmp, static_cast<size_t>(std::snprintf(tmp, sizeof(tmp), "\033[%dm", val)));
+            }
+        }
+
+    public:
+        void clear()
+        {
+            _size = TIME_RESERVE;
+        }
+
+        void append(const char* s, size_t n)
+        {
+            n = std::min(n, LINE_SIZE - _size);
+            std::memcpy(_data + _size, s, n);
+            _size += n;
+        }
+
+        void append(const char* s)
+        {
+            append(s, std::strlen(s));
+        }
+
+        void append(char c)
+        {
+            if (_size < LINE_SIZE)
+                _data[_size++] = c;
+        }
+
+        void fill(char c, size_t n)
+        {
+            n = std::min(n, LINE_SIZE - _size);
+            std::memset(_data + _size, c, n);
+            _size += n;
+        }
+
+        /**
+         * Appends s padded to width chars, or cut with an ellipsis if longer.
+         */
+        void padded(const char* s, size_t width)
+        {
+            const size_t n = std::strlen(s);
+            if (n > width) {
+                append(s, width - 3);
+                fill('.', 3);
+            } else {
+                append(s, n);
+                fill(' ', width - n);
+            }
+        }
+
+        format_buffer& operator<<(attr value) { code(static_cast<int>(value)); return *this; }
+        format_buffer& operator<<(fg value)   { code(static_cast<int>(value)); return *this; }
+        format_buffer& operator<<(bg value)   { code(static_cast<int>(value)); return *this; }
+        format_buffer& operator<<(char c)     { append(c); return *this; }
+        format_buffer& operator<<(const char* s) { append(s); return *this; }
+
+        /**
+         * Puts a prefix right before the entry, and returns where it now starts.
+         */
+        const char* prefix(const char* s, size_t n)
+        {
+            std::memcpy(_data + TIME_RESERVE - n, s, n);
+            return _data + TIME_RESERVE - n;
+        }
+
+        /**
+         * Returns the size of the entry, prefix of n chars included.
+         */
+        size_t size(size_t n) const
+        {
+            return _size - TIME_RESERVE + n;
+        }
+    };
+
+}
+
+static thread_local message_stream  __message;
+static thread_local format_buffer   __line;
+
 
 /* --------------------------------------------------------------------------------------------- */
 /*                                 Module-local static functions                                 */
@@ -174,101 +638,137 @@ static string cxx_demangle(const string& name)
     return string(status == 0 ? demangle_ptr.get() : name);
 }
 
-__attribute__((always_inline, cold))
-inline static void generate_stacktrace(list<string>& list, void* first_return_address)
+namespace {
+
+    /**
+     * Stack trace of a log entry: the line of each frame, kept in the symbol cache.
+     */
+    struct stack_trace {
+        const string*  lines[TRACE_FRAMES];
+        int            size;
+    };
+
+}
+
+static mutex                                  __symbols_mutex;  // guards __symbols
+static std::unordered_map<uintptr_t, string>  __symbols;        // frame lines by address, never erased
+
+/**
+ * Formats the line of a frame.
+ */
+__attribute__((cold))
+static string __frame_line(unw_word_t ip, const char* name)
 {
     using std::sprintf;
 
-    char   name[256];
-    string func;
+    char ip_str[32];
+
+    static_assert(sizeof(ip) == 4 || sizeof(ip) == 8, "sizeof(ip) is neither 4 nor 8");
+    if (sizeof(ip) == 4) {
+        sprintf(ip_str, "[%08" PRIiPTR "]", ip);
+    } else if (sizeof(ip) == 8) {
+        sprintf(ip_str, "[%016" PRIiPTR "]", ip);
+    }
+    return string(ip_str) + cxx_demangle(name);
+}
+
+/**
+ * Walks the stack with a cursor, naming every frame not in __symbols yet, so that
+ * unw_get_proc_name and demangling are paid once per address. Called with
+ * __symbols_mutex held.
+ */
+__attribute__((cold, noinline))
+static void __resolve_frames()
+{
+    char name[256];
 
     unw_cursor_t   cursor;
     unw_context_t  uc;
     unw_word_t     ip, offp;
 
-    list.emplace_back("---");
-
     unw_getcontext(&uc);
     unw_init_local(&cursor, &uc);
 
-    bool add_line = false;
-    while (unw_step(&cursor) > 0)
-    {
-        name[0] = '\0';
-
-        unw_get_proc_name(&cursor, name, 256, &offp);
+    while (unw_step(&cursor) > 0) {
+        unw_get_reg(&cursor, UNW_REG_IP, &ip);
+        if (ip == 0)
+            break;
+        if (__symbols.count(ip) != 0)
+            continue;
 
-        func = cxx_demangle(name);
+        name[0] = '\0';
+        unw_get_proc_name(&cursor, name, sizeof(name), &offp);
+        __symbols.emplace(ip, __frame_line(ip, name));
+    }
+}
 
-        unw_get_reg(&cursor, UNW_REG_IP, &ip);
-        //unw_get_reg(&cursor, UNW_REG_SP, &sp);
+/**
+ * Captures the stack trace from the frame returning to first_return_address on;
+ * addresses are taken with unw_backtrace, and looked up in the symbol cache.
+ */
+__attribute__((cold))
+static void __stacktrace(stack_trace& trace, void* first_return_address)
+{
+    void* frames[TRACE_FRAMES];
+    const int n = unw_backtrace(frames, TRACE_FRAMES);
 
-        if (ip == reinterpret_cast<unw_word_t>(first_return_address))
-            add_line = true;
+    int first = 0;
+    while (first < n && frames[first] != first_return_address)
+        first++;
 
-        if (func.size() == 0 && ip == 0)
-            break;
+    trace.size = 0;
 
-        if (!add_line)
-            continue;
+    lock_guard<mutex> lock(__symbols_mutex);
 
-        char ip_str[32];
+    bool resolved = false;
+    for (int i = first; i < n; i++) {
+        const uintptr_t ip = reinterpret_cast<uintptr_t>(frames[i]);
 
-        static_assert(sizeof(ip) == 4 || sizeof(ip) == 8, "sizeof(ip) is neither 4 nor 8");
-        if (sizeof(ip) == 4) {
-            sprintf(ip_str, "[%08" PRIiPTR "]", ip);
-        } else if (sizeof(ip) == 8) {
-            sprintf(ip_str, "[%016" PRIiPTR "]", ip);
+        auto it = __symbols.find(ip);
+        if (__builtin_expect(it == __symbols.end(), 0)) {
+            if (!resolved) {
+                __resolve_frames();
+                resolved = true;
+                it = __symbols.find(ip);
+            }
+            if (it == __symbols.end())
+                it = __symbols.emplace(ip, __frame_line(ip, "")).first;
         }
-        list.emplace_back(string(ip_str) + func);
+        trace.lines[trace.size++] = &it->second;
     }
-
-    list.emplace_back("---");
 }
 
-__attribute__((always_inline, cold))
-inline static void __print_line(logger_level level, const ostringstream& oss,
-                                const logger& parent_logger, bool stacktrace,
-                                void* first_return_address)
+/**
+ * Returns the name of the calling thread, or its id, written to buf, if it has none.
+ */
+static const char* __thread_label(char (&buf)[24])
 {
-    using std::fixed;
-    using std::list;
-    using std::left;
-    using std::setprecision;
-    using std::setw;
-    using std::to_string;
-    using std::logic_error;
-    using std::chrono::steady_clock;
-    using std::chrono::duration_cast;
-    using std::chrono::microseconds;
-    using boost::is_any_of;
-    using boost::split;
-    using boost::trim;
+    const char* thread_name = logger::thread_name();
 
-    // Get thread name or thread id if none, and limit it to THREAD_WIDTH chars.
-    string thread_name(logger::thread_name() != nullptr ? logger::thread_name() : to_string(syscall(SYS_gettid)));
-
-    if (thread_name.size() > THREAD_WIDTH) {
-        thread_name.resize(THREAD_WIDTH);
-        thread_name[THREAD_WIDTH - 1] = '.';
-        thread_name[THREAD_WIDTH - 2] = '.';
-        thread_name[THREAD_WIDTH - 3] = '.';
+    if (thread_name == nullptr) {
+        std::snprintf(buf, sizeof(buf), "%ld", syscall(SYS_gettid));
+        thread_name = buf;
     }
 
-    // Get tag name, and limit it to TAG_WIDTH chars.
-    string tag(parent_logger.tag());
+    return thread_name;
+}
 
-    if (tag.size() > TAG_WIDTH) {
-        tag.resize(TAG_WIDTH);
-        tag[THREAD_WIDTH - 1] = '.';
-        tag[THREAD_WIDTH - 2] = '.';
-        tag[THREAD_WIDTH - 3] = '.';
-    }
+/**
+ * Formats everything after the timestamp of a log entry, one line per line of the
+ * message and of the stack trace.
+ */
+__attribute__((cold))
+static void __format_body(format_buffer& out, logger_level level,
+                          const char* message, size_t size, bool truncated,
+                          const char* thread_name, const char* tag, bool stacktrace,
+                          void* first_return_address)
+{
+    using std::logic_error;
 
     // Selects the apropriate character and color for a given log level;
-    fg level_fg;
-    bg level_bg;
-    const char* level_ch;
+    fg level_fg = fg::reset;
+    bg level_bg = bg::reset;
+    const char* level_ch = " ? ";
 
     switch (level) {
         case fu::TRACE: level_fg = fg::black;  level_bg = bg::white;  level_ch = " T "; break;
@@ -281,100 +781,737 @@ inline static void __print_line(logger_level level, const ostringstream& oss,
         case fu::NONE:  throw logic_error("logger_line cannot have level fu::NONE");
     }
 
-    // Split message lines.
-    string message = oss.str();
-    trim(message);
-    if (message.size() == 0 && !stacktrace)
-        message = "<empty>";
-    list<string> lines;
-    split(lines, message, is_any_of("\n"));
+    // Trim the message in place.
+    const char* begin = message;
+    const char* end   = message + size;
+    while (begin < end && std::isspace(static_cast<unsigned char>(*begin)))
+        begin++;
+    while (end > begin && std::isspace(static_cast<unsigned char>(end[-1])))
+        end--;
+    if (begin == end && !stacktrace) {
+        begin = "<empty>";
+        end   = begin + 7;
+    }
 
-    // Create filler to align subsequent lines.
-    const string align_filler(1+TIME_WIDTH+1 + 2 + THREAD_WIDTH + 2 + TAG_WIDTH + 2 + 3 + 2, ' ');
+    // Width of the columns before the message, to align subsequent lines.
+    const size_t align = 1+TIME_WIDTH+1 + 2 + THREAD_WIDTH + 2 + TAG_WIDTH + 2 + 3 + 2;
 
-    // Generates stack trace;
-    list<string> trace;
+    out << "  ";
+
+    // Show thread name, limited to THREAD_WIDTH chars.
+    out << attr::bright << fg::cyan;
+    out.padded(thread_name, THREAD_WIDTH);
+    out << attr::reset;
+
+    out << "  ";
+
+    // Show tag name, limited to TAG_WIDTH chars.
+    out << attr::bright << fg::white;
+    out.padded(tag, TAG_WIDTH);
+    out << attr::reset;
+
+    out << "  ";
+
+    // Show level tag.
+    out << attr::bright << level_fg << level_bg
+        << level_ch
+        << attr::reset;
+
+    out << "  ";
+
+    // Show message lines.
+    for (const char* line = begin; ; ) {
+        const char* eol = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (eol == nullptr)
+            eol = end;
+
+        if (line != begin)
+            out.fill(' ', align);
+        out.append(line, eol - line);
+        if (eol == end && truncated)
+            out.append(" [...]");
+        out << '\n';
+
+        if (eol == end)
+            break;
+        line = eol + 1;
+    }
+
+    // Show stack trace.
     if (stacktrace) {
-        generate_stacktrace(trace, first_return_address);
+        stack_trace trace;
+        __stacktrace(trace, first_return_address);
+
+        out.fill(' ', align);
+        out << "---\n";
+        for (int i = 0; i < trace.size; i++) {
+            out.fill(' ', align);
+            out.append(trace.lines[i]->data(), trace.lines[i]->size());
+            out << '\n';
+        }
+        out.fill(' ', align);
+        out << "---\n";
     }
+}
+
+/**
+ * Formats the timestamp of a log entry, in seconds since the steady clock epoch.
+ *
+ * @return  number of chars written, at most TIME_RESERVE.
+ */
+__attribute__((cold))
+static size_t __format_time(char* out, std::int64_t ns_since_epoch)
+{
+    const char* reset  = __use_color ? "\033[0m" : "";
+    const char* bright = __use_color ? "\033[1m\033[32m" : "";
+
+    const int n = std::snprintf(out, TIME_RESERVE, "%s[%s%*.6f%s]", reset, bright,
+                                TIME_WIDTH, ns_since_epoch / 1e9, reset);
+    return std::min(static_cast<size_t>(n), static_cast<size_t>(TIME_RESERVE - 1));
+}
+
+__attribute__((always_inline))
+inline static std::int64_t __now()
+{
+    using std::chrono::steady_clock;
+    using std::chrono::duration_cast;
+    using std::chrono::nanoseconds;
+
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     Asynchronous logging                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+namespace {
+
+    /**
+     * A formatted log entry.
+     */
+    struct log_record {
+        std::int64_t  time;
+        string        text;
+    };
 
+    /**
+     * Single-producer/single-consumer ring of log records, one per logging thread.
+     * Strings are moved in and out of the slots, so no allocation happens here.
+     */
+    class log_queue
     {
-        lock_guard<mutex> lock(__logger_mutex);
+        vector<log_record>     _slots;
+        atomic<size_t>         _head;
+        char                   _head_pad[64 - sizeof(size_t)];
+        atomic<size_t>         _tail;
+        char                   _tail_pad[64 - sizeof(size_t)];
+
+    public:
+        atomic<unsigned long>  dropped;
+        atomic<bool>           orphaned;    // its thread exited
+        log_queue*             next;        // in __new_queues, until the writer takes it
+
+        explicit log_queue(unsigned size)
+            : _slots(size), _head(0), _tail(0), dropped(0), orphaned(false), next(nullptr)
+        {
+            // Strings only circulate from here on, growing to fit long entries.
+            for (auto& slot: _slots)
+                slot.text.reserve(RECORD_RESERVE);
+        }
 
-        // Calculate µs since epoch.
-        // This is done inside the lock to ensure that time always increases steadly.
-        const auto time_since_epoch = steady_clock::now().time_since_epoch();
-        const double us_since_epoch = (double) (duration_cast<microseconds>(time_since_epoch).count()) / 1000000.0;
+        size_t size() const
+        {
+            return _slots.size();
+        }
 
-        // Show µs since epoch.
-        clog
-            << attr::reset << '['
-            << attr::bright << fg::green
-            << fixed << setw(TIME_WIDTH) << setprecision(6) << us_since_epoch
-            << attr::reset << ']';
+        bool push(log_record& record)
+        {
+            const size_t head = _head.load(std::memory_order_relaxed);
+            if (head - _tail.load(std::memory_order_acquire) == _slots.size())
+                return false;
+
+            log_record& slot = _slots[head % _slots.size()];
+            slot.time = record.time;
+            slot.text.swap(record.text);
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
 
-        clog << "  ";
+        bool pop(log_record& record)
+        {
+            const size_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail == _head.load(std::memory_order_acquire))
+                return false;
+
+            log_record& slot = _slots[tail % _slots.size()];
+            record.time = slot.time;
+            record.text.swap(slot.text);
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+    };
 
-        // Show thread name.
-        clog
-            << attr::bright << fg::cyan
-            << left << setw(THREAD_WIDTH) << thread_name
-            << attr::reset;
+    /**
+     * Marks the queue of a thread as orphaned when the thread exits; the writer
+     * thread frees it once empty.
+     */
+    struct log_queue_owner {
+        log_queue* queue = nullptr;
+
+        ~log_queue_owner()
+        {
+            if (queue != nullptr)
+                queue->orphaned.store(true, std::memory_order_release);
+        }
+    };
 
-        clog << "  ";
+    /**
+     * Stops asynchronous logging at exit, so that nothing queued is lost.
+     */
+    struct async_guard {
+        ~async_guard()
+        {
+            logger::sync();
+        }
+    };
 
-        // Show tag name.
-        clog
-            << attr::bright << fg::white
-            << left << setw(TAG_WIDTH) << tag
-            << attr::reset;
+}
 
-        clog << "  ";
+static atomic<bool>                   __async(false);
+static atomic<bool>                   __stopping(false);
+static logger_overflow                __overflow_policy = fu::DROP_ON_OVERFLOW;
+static unsigned                       __queue_size      = 1024;
+static atomic<log_queue*>             __new_queues(nullptr);  // lock-free stack of queues to adopt
+static vector<unique_ptr<log_queue>>  __queues;     // adopted queues, only used by the writer thread
+static std::thread                    __writer;
+static atomic<unsigned long>          __dropped(0);
+static async_guard                    __async_guard;
 
-        // Show level tag.
-        clog << attr::bright << level_fg << level_bg
-               << level_ch
-               << attr::reset;
+static thread_local log_queue_owner  __thread_queue;
 
-        clog << "  ";
+/**
+ * Writes records [0, count) to stderr, in as few writev calls as possible.
+ */
+static void __write_records(const vector<log_record>& records, size_t count)
+{
+    struct iovec iov[WRITE_BATCH];
 
-        bool first_line = true;
+    for (size_t first = 0; first < count; ) {
+        int n = 0;
+        for (; n < WRITE_BATCH && first + n < count; n++) {
+            iov[n].iov_base = const_cast<char*>(records[first + n].text.data());
+            iov[n].iov_len  = records[first + n].text.size();
+        }
 
-        // Show message lines.
-        for (auto line: lines) {
-            if (!first_line) {
-                clog << align_filler;
+        // Resume after partial writes and interruptions.
+        struct iovec* cur  = iov;
+        int           left = n;
+        while (left > 0) {
+            ssize_t written = writev(STDERR_FILENO, cur, left);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;      // nowhere to report it
+            }
+            while (left > 0 && static_cast<size_t>(written) >= cur->iov_len) {
+                written -= cur->iov_len;
+                cur++;
+                left--;
+            }
+            if (left > 0) {
+                cur->iov_base = static_cast<char*>(cur->iov_base) + written;
+                cur->iov_len -= written;
             }
-            clog << line << endl;
-            first_line = false;
         }
 
-        // Show stack trace.
-        for (auto line: trace) {
-            if (!first_line) {
-                clog << align_filler;
+        first += n;
+    }
+}
+
+/**
+ * Body of the writer thread: collects the records of every queue, merges them by
+ * timestamp, and writes those older than MERGE_WINDOW, so that a record stamped
+ * just before another but pushed just after is still written first.
+ */
+static void __writer_main()
+{
+    static const logger self("logger");
+
+    vector<log_record> pending;
+    vector<string>     spare;       // written strings, handed back to the queues
+    size_t             slots = 0;   // slots of every queue, which bounds spare
+    log_record         record;
+
+    logger::thread_name("logger");
+
+    for (;;) {
+        const bool stopping = __stopping.load(std::memory_order_acquire);
+        bool       got_any  = false;
+        unsigned long dropped = 0;
+
+        // Queues of threads which started logging since the last round.
+        for (log_queue* q = __new_queues.exchange(nullptr, std::memory_order_acquire); q != nullptr; ) {
+            log_queue* next = q->next;
+            __queues.emplace_back(q);
+            q = next;
+        }
+
+        slots = 0;
+        for (auto it = __queues.begin(); it != __queues.end(); ) {
+            log_queue& q = **it;
+            const bool orphaned = q.orphaned.load(std::memory_order_acquire);
+            slots += q.size();
+            for (;;) {
+                // A moved-from string keeps only its short-string capacity; handing
+                // it to a producer would make its next entry allocate.
+                if (!spare.empty() && record.text.capacity() < RECORD_RESERVE) {
+                    record.text.swap(spare.back());
+                    spare.pop_back();
+                }
+                if (!q.pop(record))
+                    break;
+                pending.push_back(std::move(record));
+                got_any = true;
             }
-            clog << line << endl;
-            first_line = false;
+            dropped += q.dropped.exchange(0, std::memory_order_relaxed);
+            if (orphaned)
+                it = __queues.erase(it);
+            else
+                ++it;
+        }
+
+        if (dropped > 0) {
+            __dropped.fetch_add(dropped, std::memory_order_relaxed);
+            char message[64];
+            const int size = std::snprintf(message, sizeof(message), "%lu log messages dropped, queue full", dropped);
+
+            char time[TIME_RESERVE];
+            log_record note;
+            note.time = __now();
+            __line.clear();
+            __format_body(__line, fu::WARN, message, size, false, "logger", self.tag(), false, nullptr);
+            const size_t n = __format_time(time, note.time);
+            note.text.assign(__line.prefix(time, n), __line.size(n));
+            pending.push_back(std::move(note));
+        }
+
+        std::stable_sort(pending.begin(), pending.end(),
+                         [](const log_record& a, const log_record& b) { return a.time < b.time; });
+
+        const std::int64_t cutoff = stopping ? std::numeric_limits<std::int64_t>::max()
+                                             : __now() - MERGE_WINDOW;
+        size_t ready = 0;
+        while (ready < pending.size() && pending[ready].time <= cutoff)
+            ready++;
+
+        __write_records(pending, ready);
+        for (size_t i = 0; i < ready && spare.size() < slots; i++) {
+            pending[i].text.clear();
+            spare.push_back(std::move(pending[i].text));
+        }
+        pending.erase(pending.begin(), pending.begin() + ready);
+
+        if (stopping && !got_any && pending.empty())
+            break;
+        if (!got_any)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(FLUSH_INTERVAL));
+    }
+}
+
+/**
+ * Queues a formatted record from the calling thread.
+ */
+/**
+ * Returns the queue of the calling thread, creating it and handing it to the
+ * writer thread, without locking, the first time.
+ */
+static log_queue* __own_queue()
+{
+    log_queue* q = __thread_queue.queue;
+
+    if (__builtin_expect(q == nullptr, 0)) {
+        q = new log_queue(__queue_size);
+        q->next = __new_queues.load(std::memory_order_relaxed);
+        while (!__new_queues.compare_exchange_weak(q->next, q, std::memory_order_release,
+                                                   std::memory_order_relaxed))
+            ;
+        __thread_queue.queue = q;
+    }
+
+    return q;
+}
+
+static void __push_record(log_record& record)
+{
+    log_queue* q = __own_queue();
+
+    while (!q->push(record)) {
+        if (__overflow_policy == fu::DROP_ON_OVERFLOW) {
+            q->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
         }
+        std::this_thread::sleep_for(std::chrono::nanoseconds(FLUSH_INTERVAL));
     }
 }
 
+__attribute__((cold))
+void fu::logger::async(logger_overflow overflow, unsigned queue_size)
+{
+    if (__async.load())
+        return;
+
+    __overflow_policy = overflow;
+    __queue_size = queue_size > 0 ? queue_size : 1;
+    __stopping.store(false);
+    __writer = std::thread(__writer_main);
+    __async.store(true, std::memory_order_release);
+}
+
+__attribute__((cold))
+void fu::logger::sync()
+{
+    if (!__async.exchange(false))
+        return;
+
+    __stopping.store(true, std::memory_order_release);
+    __writer.join();
+}
+
+__attribute__((cold))
+void fu::logger::prepare_thread()
+{
+    __own_queue();
+}
+
+unsigned long fu::logger::dropped()
+{
+    return __dropped.load(std::memory_order_relaxed);
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                       Binary log files                                        */
+/* --------------------------------------------------------------------------------------------- */
+
+namespace {
+
+    /**
+     * A mapped binary log file; see log_format.hpp.
+     */
+    struct binary_log {
+        char*                     base    = nullptr;
+        size_t                    length  = 0;
+        log_format::file_header*  header  = nullptr;
+        log_format::name_entry*   tags    = nullptr;
+        log_format::name_entry*   threads = nullptr;
+        char*                     ring    = nullptr;
+    };
+
+    /**
+     * Index of a tag in the current file, cached per thread.
+     */
+    struct tag_slot {
+        const char*  tag   = nullptr;
+        unsigned     epoch = 0;
+        uint16_t     index = 0;
+    };
+
+    /**
+     * Index of the name of a thread in the current file.
+     */
+    struct thread_slot {
+        const char*  name  = nullptr;
+        unsigned     epoch = 0;
+        uint16_t     index = 0;
+    };
+
+}
+
+static atomic<bool>                __binary(false);
+static binary_log                  __binary_log;
+static unsigned                    __binary_epoch = 0;  // bumped for each file, so caches go stale
+static mutex                       __tags_mutex;        // guards __tag_indices, only taken on a cache miss
+static std::map<string, uint16_t>  __tag_indices;
+
+static thread_local tag_slot     __tag_cache[TAG_CACHE_SIZE];
+static thread_local thread_slot  __thread_slot;
+
+/**
+ * Adds a name to a name table of the current file.
+ *
+ * @return  index of the name, log_format::UNKNOWN if the table is full
+ */
+__attribute__((cold))
+static uint16_t __add_name(log_format::name_entry* table, uint32_t* count, unsigned max, const char* name)
+{
+    const uint32_t index = __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+    if (index >= max)
+        return log_format::UNKNOWN;
+
+    log_format::name_entry& entry = table[index];
+    std::strncpy(entry.name, name, sizeof(entry.name) - 1);
+    __atomic_store_n(&entry.ready, 1, __ATOMIC_RELEASE);
+    return static_cast<uint16_t>(index);
+}
+
+/**
+ * Returns the index of a tag in the current file, adding it if needed.
+ */
+static uint16_t __tag_index(const char* tag)
+{
+    tag_slot& slot = __tag_cache[(reinterpret_cast<uintptr_t>(tag) >> 3) % TAG_CACHE_SIZE];
+    if (__builtin_expect(slot.tag == tag && slot.epoch == __binary_epoch, 1))
+        return slot.index;
+
+    lock_guard<mutex> lock(__tags_mutex);
+
+    auto it = __tag_indices.find(tag);
+    if (it == __tag_indices.end()) {
+        const uint16_t index = __add_name(__binary_log.tags, &__binary_log.header->tags,
+                                          log_format::MAX_TAGS, tag);
+        it = __tag_indices.emplace(tag, index).first;
+    }
+
+    slot.tag   = tag;
+    slot.epoch = __binary_epoch;
+    slot.index = it->second;
+    return slot.index;
+}
+
+/**
+ * Returns the index of the name of the calling thread in the current file, adding
+ * it if the thread is new or was renamed.
+ */
+static uint16_t __thread_index()
+{
+    thread_slot& slot = __thread_slot;
+    const char*  name = logger::thread_name();
+    if (__builtin_expect(slot.name == name && slot.epoch == __binary_epoch, 1))
+        return slot.index;
+
+    char thread_id[24];
+    slot.name  = name;
+    slot.epoch = __binary_epoch;
+    slot.index = __add_name(__binary_log.threads, &__binary_log.header->threads,
+                            log_format::MAX_THREADS, __thread_label(thread_id));
+    return slot.index;
+}
+
+/**
+ * Appends a message record to the ring of the current file. Space is reserved with
+ * a compare-and-swap on the head, so threads never wait for each other; a record
+ * which would cross the end of the ring starts over at its beginning, after a
+ * padding record.
+ */
+static void __write_binary(logger_level level, const char* message, size_t size, bool truncated,
+                           const char* tag)
+{
+    using log_format::record_header;
+
+    static const char more[] = " [...]";
+
+    const binary_log& file     = __binary_log;
+    const uint64_t    capacity = file.header->capacity;
+
+    const size_t   max_size = capacity / 4 - sizeof(record_header) - sizeof(more);
+    if (size > max_size) {
+        size      = max_size;
+        truncated = true;
+    }
+    const size_t   length      = size + (truncated ? sizeof(more) - 1 : 0);
+    const uint64_t record_size = log_format::align(sizeof(record_header) + length);
+
+    const std::int64_t time   = __now();
+    const uint16_t     thread = __thread_index();
+    const uint16_t     tag_ix = __tag_index(tag);
+
+    uint64_t head = __atomic_load_n(&file.header->head, __ATOMIC_RELAXED);
+    uint64_t start;
+    do {
+        const uint64_t offset = head % capacity;
+        start = offset + record_size > capacity ? head + (capacity - offset) : head;
+    } while (!__atomic_compare_exchange_n(&file.header->head, &head, start + record_size,
+                                          true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (start != head && start - head >= sizeof(record_header)) {
+        record_header* pad = reinterpret_cast<record_header*>(file.ring + head % capacity);
+        pad->kind     = log_format::PADDING;
+        pad->position = head;
+        pad->length   = 0;
+        __atomic_store_n(&pad->size, static_cast<uint32_t>(start - head), __ATOMIC_RELEASE);
+    }
+
+    record_header* record = reinterpret_cast<record_header*>(file.ring + start % capacity);
+    __atomic_store_n(&record->size, 0, __ATOMIC_RELAXED);
+    record->kind     = log_format::MESSAGE;
+    record->level    = static_cast<uint8_t>(level);
+    record->reserved = 0;
+    record->position = start;
+    record->time     = time;
+    record->thread   = thread;
+    record->tag      = tag_ix;
+    record->length   = static_cast<uint32_t>(length);
+
+    char* text = reinterpret_cast<char*>(record + 1);
+    std::memcpy(text, message, size);
+    if (truncated)
+        std::memcpy(text + size, more, sizeof(more) - 1);
+
+    __atomic_store_n(&record->size, static_cast<uint32_t>(record_size), __ATOMIC_RELEASE);
+}
+
+__attribute__((cold))
+void fu::logger::binary_file(const char* path, size_t capacity)
+{
+    using namespace log_format;
+
+    close_binary_file();
+
+    capacity = align(std::max(capacity, static_cast<size_t>(BINARY_MIN_SIZE)));
+
+    const long     page         = sysconf(_SC_PAGESIZE);
+    const uint64_t names_offset = align(sizeof(file_header));
+    const uint64_t ring_offset  = (names_offset + (MAX_TAGS + MAX_THREADS) * sizeof(name_entry)
+                                   + page - 1) / page * page;
+    const size_t   length       = ring_offset + capacity;
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw runtime_error(string(path) + ": " + std::strerror(errno));
+
+    if (ftruncate(fd, length) < 0) {
+        const int error = errno;
+        close(fd);
+        throw runtime_error(string(path) + ": " + std::strerror(error));
+    }
+
+    void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int error = errno;
+    close(fd);
+    if (base == MAP_FAILED)
+        throw runtime_error(string(path) + ": " + std::strerror(error));
+
+    binary_log& file = __binary_log;
+    file.base    = static_cast<char*>(base);
+    file.length  = length;
+    file.header  = reinterpret_cast<file_header*>(file.base);
+    file.tags    = reinterpret_cast<name_entry*>(file.base + names_offset);
+    file.threads = file.tags + MAX_TAGS;
+    file.ring    = file.base + ring_offset;
+
+    // The file is fresh out of ftruncate, hence zeroed; the magic goes in last.
+    file.header->names_offset = names_offset;
+    file.header->ring_offset  = ring_offset;
+    file.header->capacity     = capacity;
+    std::memcpy(file.header->magic, MAGIC, sizeof(MAGIC));
+
+    __tag_indices.clear();
+    __binary_epoch++;
+    __binary.store(true, std::memory_order_release);
+}
+
+__attribute__((cold))
+void fu::logger::close_binary_file()
+{
+    if (!__binary.exchange(false))
+        return;
+
+    munmap(__binary_log.base, __binary_log.length);
+    __binary_log = binary_log();
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                      Writing log entries                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+static thread_local log_record  __record;    // its string goes round the queue and comes back
+
+__attribute__((always_inline, cold))
+inline static void __print_line(logger_level level, const char* message, size_t size, bool truncated,
+                                const logger& parent_logger, bool stacktrace,
+                                void* first_return_address)
+{
+    char time[TIME_RESERVE];
+    char thread_id[24];
+
+    if (__binary.load(std::memory_order_acquire)) {
+        if (__builtin_expect(!stacktrace, 1)) {
+            __write_binary(level, message, size, truncated, parent_logger.tag());
+        } else {
+            string text(message, size);
+            if (truncated)
+                text.append(" [...]");
+            stack_trace trace;
+            __stacktrace(trace, first_return_address);
+            text.append("\n---");
+            for (int i = 0; i < trace.size; i++)
+                text.append(1, '\n').append(*trace.lines[i]);
+            text.append("\n---");
+            __write_binary(level, text.data(), text.size(), false, parent_logger.tag());
+        }
+        return;
+    }
+
+    __line.clear();
+    __format_body(__line, level, message, size, truncated, __thread_label(thread_id), parent_logger.tag(),
+                  stacktrace, first_return_address);
+
+    if (__async.load(std::memory_order_acquire)) {
+        __record.time = __now();
+        const size_t n = __format_time(time, __record.time);
+        __record.text.assign(__line.prefix(time, n), __line.size(n));
+        __push_record(__record);
+    } else {
+        lock_guard<mutex> lock(__logger_mutex);
+
+        // The time is taken inside the lock to ensure that it always increases steadily.
+        const size_t n = __format_time(time, __now());
+        clog.write(__line.prefix(time, n), __line.size(n));
+        clog.flush();
+    }
+}
+
+__attribute__((cold))
+void fu::logger::replay(ostream& os, std::int64_t time, const char* thread, const char* tag,
+                        logger_level level, const char* message, size_t size)
+{
+    char time_str[TIME_RESERVE];
+
+    __line.clear();
+    __format_body(__line, level, message, size, false, thread, tag, false, nullptr);
+
+    const size_t n = __format_time(time_str, time);
+    os.write(__line.prefix(time_str, n), __line.size(n));
+}
+
 
 /* --------------------------------------------------------------------------------------------- */
 /*                                    Private member functions                                   */
 /* --------------------------------------------------------------------------------------------- */
 
 /**
- * Initializes _buffer to a new std::ostringstream
- * if line is visible, to nullptr otherwise.
+ * Points _buffer to the stream of the thread if line is visible, to nullptr
+ * otherwise; a line built while another one is (e.g. by an operator<< which
+ * logs) gets a stream of its own.
  */
 __attribute__((hot))
 void logger_line::initialize_buffer()
 {
-    _buffer = __builtin_expect(_parent_logger.level() <= _level, 0)
-             ? new ostringstream
-             : nullptr;
+    if (__builtin_expect(!_parent_logger.enabled(_level), 1)) {
+        _buffer = nullptr;
+        return;
+    }
+
+    message_stream& m = __message;
+    if (__builtin_expect(!m.busy, 1)) {
+        m.busy = true;
+        m.reset();
+        _buffer = &m.os;
+    } else {
+        _buffer = new ostringstream;
+    }
 }
 
 
@@ -386,8 +1523,18 @@ __attribute__((hot))
 logger_line::~logger_line()
 {
     if (__builtin_expect(_buffer != nullptr, 0)) {
-        __print_line(_level, *_buffer, _parent_logger, _stacktrace, __builtin_return_address(0));
-        delete _buffer;
+        message_stream& m = __message;
+        if (_buffer == &m.os) {
+            // Nothing logs while formatting, so the contents stay put.
+            m.busy = false;
+            __print_line(_level, m.buf.data(), m.buf.size(), m.buf.truncated(),
+                         _parent_logger, _stacktrace, __builtin_return_address(0));
+        } else {
+            const string message = static_cast<ostringstream*>(_buffer)->str();
+            __print_line(_level, message.data(), message.size(), false,
+                         _parent_logger, _stacktrace, __builtin_return_address(0));
+            delete _buffer;
+        }
     }
 }
 
@@ -22,7 +22,28 @@
 #ifndef UE0284644_73FE_42B6_BFC6_E1B6C079A0EF
 #define UE0284644_73FE_42B6_BFC6_E1B6C079A0EF
 
+#include <atomic>
+#include <cstdint>
 #include <sstream>
+#include <string>
+
+/**
+ * Lowest level FU_LOG statements are compiled for, as a number (0 for TRACE, 1 for
+ * DEBUG, and so on); statements below it compile to nothing.
+ */
+#ifndef FU_LOG_MIN_LEVEL
+#define FU_LOG_MIN_LEVEL 0
+#endif
+
+/**
+ * Logs a line with a logger, as in FU_LOG(__log, fu::DEBUG) << "x = " << x. Unlike
+ * __log(fu::DEBUG) << ..., the arguments are not evaluated when the level is
+ * disabled at run time for the logger, and the statement is compiled out when the
+ * level is below FU_LOG_MIN_LEVEL. log is evaluated twice.
+ */
+#define FU_LOG(log, level)                                                                      \
+    !((level) >= FU_LOG_MIN_LEVEL && (log).enabled(level))                                      \
+        ? (void) 0 : ::fu::logger_voidify() & (log)(level)
 
 namespace fu {
 
@@ -48,6 +69,14 @@ namespace fu {
         FORCE_COLOR = 1
     };
 
+    /**
+     * What an asynchronous logger does when a thread's queue is full.
+     */
+    enum logger_overflow {
+        DROP_ON_OVERFLOW  = 0,      // drop the message and count it; never blocks
+        BLOCK_ON_OVERFLOW = 1       // wait for room
+    };
+
 
     class logger; // forward declaration
 
@@ -58,14 +87,15 @@ namespace fu {
 
     /**
      * logger_line is created every time a message should be sent to log,
-     * it then accumulates text inside an internal std::ostringstream,
-     * and flushes the text (neatly formatted) to std::clog on destruciton.
+     * it then accumulates text inside a fixed-size stream reused by every line
+     * of the thread, and flushes the text (neatly formatted) to std::clog on
+     * destruction, without allocating in steady state.
      */
     class logger_line
     {
         logger_level        _level;
         const logger&       _parent_logger;
-        std::ostringstream* _buffer;
+        std::ostream*       _buffer;
         bool                _stacktrace;
 
         void initialize_buffer();
@@ -138,18 +168,39 @@ namespace fu {
     };
 
 
+    /**
+     * Turns a logger_line chain into a void expression, for FU_LOG; & binds looser
+     * than <<, so the whole chain is evaluated first.
+     */
+    struct logger_voidify {
+        __attribute__((always_inline))
+        inline void operator&(const logger_line&) { }
+    };
+
+
     /* ----------------------------------------------------------------------------------------- */
     /*                                         fu::logger                                        */
     /* ----------------------------------------------------------------------------------------- */
 
     /**
      * logger is meant to be used module-locally to create logger_line instances.
+     *
+     * The level a message must reach is the level of the logger's tag, if one was
+     * set, or the global level otherwise; a thread may lower it for itself. Each
+     * instance caches it along with the epoch it was computed in, and recomputes it
+     * when a change of levels bumps the epoch.
      */
     class logger {
-        const char* _tag;
+        const char*             _tag;
+        mutable std::uint64_t   _cache;     // epoch << 16 | (tag level + 1) << 8 | (threshold + 1)
+
+        static logger_level                 _level;
+        static std::atomic<std::uint32_t>   _epoch;
+        thread_local static const char*     _thread_name;
+        thread_local static logger_level    _thread_level;
 
-        static logger_level _level;
-        thread_local static const char* _thread_name;
+        std::uint64_t refresh() const;
+        static void reload_signal(int signum);
 
     public:
         /**
@@ -159,7 +210,7 @@ namespace fu {
          */
         __attribute__((always_inline))
         inline logger(const char* tag)
-            : _tag(tag)
+            : _tag(tag), _cache(0)
         { }
 
         /**
@@ -186,6 +237,44 @@ namespace fu {
             return logger_line(level, *this);
         }
 
+        /**
+         * Calls a function with a logger line associated with this instance, if the
+         * level is enabled; the function is not called otherwise.
+         *
+         * @param   level   level of the message logged
+         * @param   write   function taking a logger_line&, writing the message
+         */
+        template <class Function>
+        __attribute__((always_inline))
+        inline void lazy(logger_level level, Function write) const
+        {
+            if (level >= FU_LOG_MIN_LEVEL && enabled(level)) {
+                logger_line line(level, *this);
+                write(line);
+            }
+        }
+
+        /**
+         * Returns whether messages of a given level are displayed for this logger.
+         * Unless levels changed since the last call, this costs a load and a
+         * compare of the epoch, and one of the cached threshold.
+         */
+        __attribute__((always_inline))
+        inline bool enabled(logger_level level) const
+        {
+            std::uint64_t cache = __atomic_load_n(&_cache, __ATOMIC_RELAXED);
+            if (__builtin_expect((cache >> 16) != _epoch.load(std::memory_order_relaxed), 0))
+                cache = refresh();
+
+            const int rank = level + 1;
+            if (__builtin_expect(rank < static_cast<int>(cache & 0xFF), 1))
+                return false;
+
+            // Past the threshold, which is the lowest level of any thread: check
+            // the one of this logger's tag, then the one of this thread.
+            return rank >= static_cast<int>((cache >> 8) & 0xFF) || level >= _thread_level;
+        }
+
         /**
          * Gets minimum message level to display.
          *
@@ -198,15 +287,67 @@ namespace fu {
         }
 
         /**
-         * Sets minimum message level to display.
+         * Sets minimum message level to display, for tags without a level of
+         * their own.
          *
          * @param   level   minimum level
          */
-        __attribute__((always_inline))
-        inline static void level(logger_level level)
-        {
-            _level = level;
-        }
+        static void level(logger_level level);
+
+        /**
+         * Sets minimum message level to display for the loggers of a tag.
+         *
+         * @param   tag     tag of the loggers
+         * @param   level   minimum level
+         */
+        static void level(const char* tag, logger_level level);
+
+        /**
+         * Lowers the minimum message level to display for the calling thread, on
+         * every tag; fu::NONE removes the override.
+         *
+         * @param   level   minimum level
+         */
+        static void thread_level(logger_level level);
+
+        /**
+         * Removes the levels set for tags.
+         */
+        static void reset_levels();
+
+        /**
+         * Sets levels from a comma-separated list of tag=level pairs, where a level
+         * alone sets the global level, as in "warn,connection=debug,graph=trace".
+         * Levels are trace, debug, info, warn, error, fatal, all or none.
+         *
+         * @throws  std::invalid_argument if spec is malformed, without setting anything
+         */
+        static void levels(const std::string& spec);
+
+        /**
+         * Sets levels from an environment variable holding a list as for levels(),
+         * if it is set.
+         */
+        static void levels_from_env(const char* name = "FU_LOG");
+
+        /**
+         * Replaces the levels set for tags by those listed in a file, one list as
+         * for levels() per line; # starts a comment.
+         *
+         * @throws  std::runtime_error if the file cannot be read,
+         *          std::invalid_argument if it is malformed
+         */
+        static void levels_from_file(const std::string& path);
+
+        /**
+         * Reloads levels from a file whenever a signal arrives, as with
+         * levels_from_file(). The file is read by a thread of the logger's own,
+         * started by the first call, never by threads checking a level.
+         *
+         * @param   path    file to reload
+         * @param   signum  signal, SIGHUP for instance
+         */
+        static void reload_levels_on(int signum, const std::string& path);
 
         /**
          * Gets the name of the current thread.
@@ -240,6 +381,61 @@ namespace fu {
          * Sets up logging color.
          */
         static void color(force_color force = DONT_FORCE_COLOR);
+
+        /**
+         * Switches to asynchronous logging: messages are formatted by the thread
+         * logging them and pushed into a lock-free queue of its own, from which a
+         * background thread writes them to stderr in timestamp order. Meant to be
+         * called at startup, before other threads log.
+         *
+         * @param   overflow     what to do when a thread's queue is full
+         * @param   queue_size   number of messages each thread's queue holds
+         */
+        static void async(logger_overflow overflow = DROP_ON_OVERFLOW, unsigned queue_size = 1024);
+
+        /**
+         * Writes every queued message and switches back to synchronous logging;
+         * also done at exit.
+         */
+        static void sync();
+
+        /**
+         * Creates the queue of the calling thread ahead of its first message, so
+         * that a thread which must not allocate, e.g. a real-time audio thread,
+         * can log asynchronously from then on. Otherwise the first message a
+         * thread logs allocates its queue.
+         */
+        static void prepare_thread();
+
+        /**
+         * Returns the number of messages dropped because a queue was full.
+         */
+        static unsigned long dropped();
+
+        /**
+         * Switches to binary logging: messages are written unformatted, with their
+         * time, thread, tag and level, into a ring of records in a memory-mapped
+         * file, which survives a crash and is decoded by fu-logdump. The oldest
+         * records are overwritten once the ring is full. Meant to be called at
+         * startup, before other threads log.
+         *
+         * @param   path        file to create, truncated if it exists
+         * @param   capacity    size of the ring in bytes
+         */
+        static void binary_file(const char* path, std::size_t capacity = 64 << 20);
+
+        /**
+         * Unmaps the binary log file and switches back to text logging; meant to
+         * be called when no other thread logs.
+         */
+        static void close_binary_file();
+
+        /**
+         * Writes an entry to a stream in the same layout as stderr, as if logged
+         * at a given time from a given thread; used to decode binary log files.
+         */
+        static void replay(std::ostream& os, std::int64_t time, const char* thread, const char* tag,
+                           logger_level level, const char* message, std::size_t size);
     };
 
 };
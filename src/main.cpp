@@ -0,0 +1,145 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "batch.hpp"
+#include "logger.hpp"
+
+using std::size_t;
+using std::string;
+using std::vector;
+using fu::batch;
+using fu::logger;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("main");
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                 Module-local static functions                                 */
+/* --------------------------------------------------------------------------------------------- */
+
+static int __usage(const char* argv0)
+{
+    std::cerr << "usage: " << argv0 << " batch [OPTIONS] MANIFEST\n"
+              << "  Runs the jobs listed in MANIFEST ('-' for standard input): one per line,\n"
+              << "  input and output separated by a tab; jobs without an output are measured.\n"
+              << "  --jobs N         jobs run at once (default: one per core)\n"
+              << "  --threads N      executor threads (default: one per core)\n"
+              << "  --memory MIB     memory budget of running jobs (default 1024, 0 for none)\n"
+              << "  --rate HZ        resample outputs to HZ\n"
+              << "  --quality Q      best, medium (default), fastest or linear\n"
+              << "  --block FRAMES   frames per buffer (default 4096)\n"
+              << "  --depth N        depth of connections (default 4)\n"
+              << "  --loudness       measure the loudness of every job\n"
+              << "  Log levels are read from FU_LOG, e.g. FU_LOG=info,batch=debug." << std::endl;
+    return 2;
+}
+
+static bool __quality(const string& name, fu::audio::resample_quality& quality)
+{
+    if (name == "best")         quality = fu::audio::SINC_BEST;
+    else if (name == "medium")  quality = fu::audio::SINC_MEDIUM;
+    else if (name == "fastest") quality = fu::audio::SINC_FASTEST;
+    else if (name == "linear")  quality = fu::audio::LINEAR;
+    else                        return false;
+    return true;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                             main                                              */
+/* --------------------------------------------------------------------------------------------- */
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || std::strcmp(argv[1], "batch") != 0)
+        return __usage(argv[0]);
+
+    batch::options opt;
+    string         manifest;
+
+    for (int i = 2; i < argc; i++) {
+        const string arg = argv[i];
+        const bool   has_value = i + 1 < argc;
+
+        if (arg == "--jobs" && has_value) {
+            opt.jobs = static_cast<unsigned>(std::atoi(argv[++i]));
+        } else if (arg == "--threads" && has_value) {
+            opt.threads = static_cast<unsigned>(std::atoi(argv[++i]));
+        } else if (arg == "--memory" && has_value) {
+            opt.memory = static_cast<size_t>(std::atol(argv[++i])) << 20;
+        } else if (arg == "--rate" && has_value) {
+            opt.rate = static_cast<unsigned>(std::atoi(argv[++i]));
+        } else if (arg == "--quality" && has_value) {
+            if (!__quality(argv[++i], opt.quality))
+                return __usage(argv[0]);
+        } else if (arg == "--block" && has_value) {
+            opt.block_frames = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--depth" && has_value) {
+            opt.depth = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--loudness") {
+            opt.loudness = true;
+        } else if (manifest.empty() && (arg == "-" || arg[0] != '-')) {
+            manifest = arg;
+        } else {
+            return __usage(argv[0]);
+        }
+    }
+    if (manifest.empty())
+        return __usage(argv[0]);
+
+    // Progress is the point of a batch run, so it shows unless FU_LOG says otherwise.
+    logger::level("batch", fu::INFO);
+    logger::levels_from_env();
+
+    try {
+        vector<batch::job> jobs;
+        if (manifest == "-") {
+            jobs = batch::read_manifest(std::cin, "standard input");
+        } else {
+            std::ifstream in(manifest);
+            if (!in) {
+                FU_LOG(__log, fu::ERROR) << manifest << ": cannot open";
+                return 1;
+            }
+            jobs = batch::read_manifest(in, manifest);
+        }
+
+        return batch(opt).run(jobs) == 0 ? 0 : 1;
+    } catch (const std::exception& e) {
+        FU_LOG(__log, fu::ERROR) << e;
+        return 1;
+    }
+}
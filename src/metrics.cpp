@@ -0,0 +1,293 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#include "metrics.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::uint64_t;
+using std::unique_lock;
+using std::vector;
+using fu::metrics::counter;
+using fu::metrics::gauge;
+using fu::metrics::histogram;
+using fu::metrics::metric;
+using fu::metrics::sample;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("metrics");
+
+namespace {
+
+    /**
+     * Registered metrics. Constructed on first use, and never destroyed, since
+     * static metrics may unregister after it would be.
+     */
+    struct registry {
+        mutex            lock;
+        vector<metric*>  metrics;
+
+        static registry& get()
+        {
+            static registry* instance = new registry;
+            return *instance;
+        }
+    };
+
+    /**
+     * Thread started by start_dump().
+     */
+    struct dumper {
+        mutex                    lock;
+        std::condition_variable  wake;
+        std::thread              thread;
+        bool                     stopping = false;
+
+        ~dumper()
+        {
+            fu::metrics::stop_dump();
+        }
+    };
+
+}
+
+static dumper __dumper;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                      fu::metrics::metric                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+metric::metric(const string& name)
+    : _name(name)
+{
+    registry& r = registry::get();
+    lock_guard<mutex> lock(r.lock);
+    r.metrics.push_back(this);
+}
+
+metric::~metric()
+{
+    registry& r = registry::get();
+    lock_guard<mutex> lock(r.lock);
+    r.metrics.erase(std::find(r.metrics.begin(), r.metrics.end(), this));
+}
+
+void metric::rename(const string& name)
+{
+    registry& r = registry::get();
+    lock_guard<mutex> lock(r.lock);
+    _name = name;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                      fu::metrics::counter                                     */
+/* --------------------------------------------------------------------------------------------- */
+
+thread_local unsigned counter::_shard = counter::SHARDS;
+
+counter::counter(const string& name)
+    : metric(name)
+{
+    const uintptr_t line = sizeof(shard);
+    _shards = reinterpret_cast<shard*>((reinterpret_cast<uintptr_t>(_storage) + line - 1) & ~(line - 1));
+    for (unsigned i = 0; i < SHARDS; i++)
+        new (&_shards[i].value) std::atomic<uint64_t>(0);
+}
+
+unsigned counter::assign_shard()
+{
+    static std::atomic<unsigned> next(0);
+
+    _shard = next.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+    return _shard;
+}
+
+uint64_t counter::value() const
+{
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < SHARDS; i++)
+        sum += _shards[i].value.load(std::memory_order_relaxed);
+    return sum;
+}
+
+void counter::read(sample& s) const
+{
+    s.kind  = sample::COUNTER;
+    s.value = static_cast<std::int64_t>(value());
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                       fu::metrics::gauge                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+gauge::gauge(const string& name)
+    : metric(name), _value(0)
+{ }
+
+void gauge::read(sample& s) const
+{
+    s.kind  = sample::GAUGE;
+    s.value = value();
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     fu::metrics::histogram                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+histogram::histogram(const string& name)
+    : metric(name), _count(0), _sum(0), _max(0)
+{
+    for (auto& b: _buckets)
+        b.store(0, std::memory_order_relaxed);
+}
+
+uint64_t histogram::lowest(unsigned bucket)
+{
+    if (bucket < (1u << SUB_BITS))
+        return bucket;
+
+    const unsigned bits = (bucket >> SUB_BITS) + SUB_BITS - 1;
+    const uint64_t sub  = bucket & ((1u << SUB_BITS) - 1);
+    return ((1u << SUB_BITS) + sub) << (bits - SUB_BITS);
+}
+
+uint64_t histogram::quantile(double q) const
+{
+    const uint64_t count = _count.load(std::memory_order_relaxed);
+    if (count == 0)
+        return 0;
+
+    // Buckets are read one by one while values are being recorded, so their sum
+    // may not match count exactly.
+    const uint64_t rank = static_cast<uint64_t>(q * count);
+    uint64_t       seen = 0;
+    for (unsigned b = 0; b < BUCKETS; b++) {
+        seen += _buckets[b].load(std::memory_order_relaxed);
+        if (seen > rank)
+            return std::min(lowest(b), _max.load(std::memory_order_relaxed));
+    }
+    return _max.load(std::memory_order_relaxed);
+}
+
+void histogram::read(sample& s) const
+{
+    s.kind  = sample::HISTOGRAM;
+    s.value = static_cast<std::int64_t>(_count.load(std::memory_order_relaxed));
+    s.sum   = _sum.load(std::memory_order_relaxed);
+    s.max   = _max.load(std::memory_order_relaxed);
+    s.p50   = quantile(0.50);
+    s.p90   = quantile(0.90);
+    s.p99   = quantile(0.99);
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                        Registry access                                        */
+/* --------------------------------------------------------------------------------------------- */
+
+vector<sample> fu::metrics::snapshot()
+{
+    vector<sample> samples;
+
+    {
+        registry& r = registry::get();
+        lock_guard<mutex> lock(r.lock);
+
+        samples.resize(r.metrics.size());
+        for (size_t i = 0; i < r.metrics.size(); i++) {
+            sample& s = samples[i];
+            s.name = r.metrics[i]->name();
+            s.sum = s.max = s.p50 = s.p90 = s.p99 = 0;
+            r.metrics[i]->read(s);
+        }
+    }
+
+    std::stable_sort(samples.begin(), samples.end(),
+                     [](const sample& a, const sample& b) { return a.name < b.name; });
+    return samples;
+}
+
+void fu::metrics::dump(logger_level level)
+{
+    if (!__log.enabled(level))
+        return;
+
+    for (const sample& s: snapshot()) {
+        switch (s.kind) {
+        case sample::COUNTER:
+        case sample::GAUGE:
+            __log(level) << s.name << " = " << s.value;
+            break;
+        case sample::HISTOGRAM:
+            __log(level) << s.name << ": count " << s.value
+                         << ", mean " << (s.value > 0 ? s.sum / s.value : 0)
+                         << ", p50 " << s.p50 << ", p90 " << s.p90 << ", p99 " << s.p99
+                         << ", max " << s.max << ", sum " << s.sum;
+            break;
+        }
+    }
+}
+
+void fu::metrics::start_dump(std::chrono::milliseconds period, logger_level level)
+{
+    stop_dump();
+
+    __dumper.stopping = false;
+    __dumper.thread = std::thread([period, level] {
+        logger::thread_name("metrics");
+
+        unique_lock<mutex> lock(__dumper.lock);
+        while (!__dumper.wake.wait_for(lock, period, [] { return __dumper.stopping; })) {
+            lock.unlock();
+            dump(level);
+            lock.lock();
+        }
+    });
+}
+
+void fu::metrics::stop_dump()
+{
+    if (!__dumper.thread.joinable())
+        return;
+
+    {
+        lock_guard<mutex> lock(__dumper.lock);
+        __dumper.stopping = true;
+    }
+    __dumper.wake.notify_all();
+    __dumper.thread.join();
+}
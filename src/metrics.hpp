@@ -0,0 +1,343 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef UDE71DBD4_F1E8_4C97_8DD4_4E412CCC3C7D
+#define UDE71DBD4_F1E8_4C97_8DD4_4E412CCC3C7D
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "logger.hpp"
+
+namespace fu {
+
+    /**
+     * Counters, gauges and latency histograms, readable while the program runs.
+     *
+     * Metrics register themselves by name on construction and unregister on
+     * destruction; recording is lock-free and never allocates. Counters are
+     * sharded per thread, each shard on a cache line of its own, so threads
+     * counting at once do not contend. snapshot() reads every metric, and
+     * start_dump() logs them periodically.
+     */
+    namespace metrics {
+
+        /**
+         * Returns the time in ns since the steady clock epoch, the unit of
+         * histograms of durations.
+         */
+        __attribute__((always_inline))
+        inline std::int64_t now()
+        {
+            using std::chrono::duration_cast;
+            using std::chrono::nanoseconds;
+            using std::chrono::steady_clock;
+
+            return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+        }
+
+        /**
+         * Value of a metric at some point in time.
+         */
+        struct sample {
+            enum kind_t { COUNTER, GAUGE, HISTOGRAM };
+
+            std::string   name;
+            kind_t        kind;
+            std::int64_t  value;    // count of values recorded, for histograms
+
+            // Histograms only.
+            std::uint64_t sum;
+            std::uint64_t max;
+            std::uint64_t p50;
+            std::uint64_t p90;
+            std::uint64_t p99;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                   fu::metrics::metric                                 */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Base of metrics, registered while alive.
+         */
+        class metric
+        {
+            std::string  _name;
+
+        public:
+            /**
+             * Registers a metric.
+             *
+             * @param name  name of the metric, e.g. "connection.3.frames"; names need
+             *              not be unique
+             */
+            explicit metric(const std::string& name);
+
+            metric(const metric&) = delete;
+            metric& operator=(const metric&) = delete;
+
+            /**
+             * Unregisters the metric.
+             */
+            virtual ~metric();
+
+            /**
+             * Renames the metric.
+             */
+            void rename(const std::string& name);
+
+            /**
+             * Reads the metric; called with the registry locked.
+             */
+            virtual void read(sample& s) const = 0;
+
+            /**
+             * Returns the name of the metric; called with the registry locked.
+             */
+            __attribute__((always_inline))
+            inline const std::string& name() const
+            {
+                return _name;
+            }
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                  fu::metrics::counter                                 */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Monotonic count, e.g. of buffers passed.
+         */
+        class counter : public metric
+        {
+        public:
+            static const unsigned SHARDS = 16;
+
+        private:
+            struct shard {
+                std::atomic<std::uint64_t>  value;
+                char                        pad[64 - sizeof(std::atomic<std::uint64_t>)];
+            };
+
+            // Shards are aligned to cache lines within _storage, since operator new
+            // does not honour alignas() in C++11.
+            shard*  _shards;
+            char    _storage[(SHARDS + 1) * sizeof(shard)];
+
+            thread_local static unsigned  _shard;
+
+            static unsigned assign_shard();
+
+        public:
+            explicit counter(const std::string& name);
+
+            /**
+             * Adds to the count, in the shard of the calling thread.
+             */
+            __attribute__((always_inline, hot))
+            inline void add(std::uint64_t n = 1)
+            {
+                unsigned index = _shard;
+                if (__builtin_expect(index >= SHARDS, 0))
+                    index = assign_shard();
+                _shards[index].value.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            /**
+             * Returns the sum of every shard.
+             */
+            std::uint64_t value() const;
+
+            void read(sample& s) const override;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                   fu::metrics::gauge                                  */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Value going up and down, e.g. a queue depth.
+         */
+        class gauge : public metric
+        {
+            std::atomic<std::int64_t>  _value;
+
+        public:
+            explicit gauge(const std::string& name);
+
+            __attribute__((always_inline, hot))
+            inline void set(std::int64_t value)
+            {
+                _value.store(value, std::memory_order_relaxed);
+            }
+
+            __attribute__((always_inline, hot))
+            inline void add(std::int64_t n)
+            {
+                _value.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            __attribute__((always_inline))
+            inline std::int64_t value() const
+            {
+                return _value.load(std::memory_order_relaxed);
+            }
+
+            void read(sample& s) const override;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                 fu::metrics::histogram                                */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Distribution of values, e.g. latencies in ns, HDR-style: buckets are
+         * linear below 16, then 16 per power of two, so the relative error is
+         * under 1/16 up to 2^40, beyond which values are clamped.
+         */
+        class histogram : public metric
+        {
+        public:
+            static const unsigned SUB_BITS  = 4;
+            static const unsigned MAX_BITS  = 40;
+            static const unsigned BUCKETS   = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+        private:
+            std::atomic<std::uint64_t>  _count;
+            std::atomic<std::uint64_t>  _sum;
+            std::atomic<std::uint64_t>  _max;
+            std::atomic<std::uint64_t>  _buckets[BUCKETS];
+
+        public:
+            explicit histogram(const std::string& name);
+
+            /**
+             * Returns the bucket of a value.
+             */
+            __attribute__((always_inline, const))
+            inline static unsigned bucket(std::uint64_t value)
+            {
+                const std::uint64_t top = (static_cast<std::uint64_t>(1) << MAX_BITS) - 1;
+                if (value > top)
+                    value = top;
+                if (value < (1u << SUB_BITS))
+                    return static_cast<unsigned>(value);
+
+                const unsigned bits = 63 - __builtin_clzll(value);
+                const unsigned sub  = static_cast<unsigned>(value >> (bits - SUB_BITS))
+                                      & ((1u << SUB_BITS) - 1);
+                return ((bits - SUB_BITS + 1) << SUB_BITS) + sub;
+            }
+
+            /**
+             * Returns the lowest value of a bucket.
+             */
+            static std::uint64_t lowest(unsigned bucket);
+
+            /**
+             * Records a value.
+             */
+            __attribute__((always_inline, hot))
+            inline void record(std::uint64_t value)
+            {
+                _buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+                _count.fetch_add(1, std::memory_order_relaxed);
+                _sum.fetch_add(value, std::memory_order_relaxed);
+
+                std::uint64_t max = _max.load(std::memory_order_relaxed);
+                while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+                    ;
+            }
+
+            /**
+             * Returns the value below which a fraction q of the values recorded
+             * fall, to the precision of buckets.
+             */
+            std::uint64_t quantile(double q) const;
+
+            void read(sample& s) const override;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                    fu::metrics::timer                                 */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Records the ns between its construction and destruction in a histogram.
+         */
+        class timer
+        {
+            histogram&    _histogram;
+            std::int64_t  _start;
+
+        public:
+            __attribute__((always_inline))
+            inline explicit timer(histogram& h)
+                : _histogram(h), _start(now())
+            { }
+
+            __attribute__((always_inline))
+            inline ~timer()
+            {
+                _histogram.record(static_cast<std::uint64_t>(now() - _start));
+            }
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                     Registry access                                   */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Reads every registered metric, sorted by name.
+         */
+        std::vector<sample> snapshot();
+
+        /**
+         * Logs every registered metric, one line each, with tag "metrics".
+         */
+        void dump(logger_level level = INFO);
+
+        /**
+         * Starts a thread calling dump() periodically, until stop_dump().
+         */
+        void start_dump(std::chrono::milliseconds period, logger_level level = INFO);
+
+        /**
+         * Stops the thread started by start_dump(); also done at exit.
+         */
+        void stop_dump();
+
+    } // namespace metrics
+
+} // namespace fu
+
+#endif
@@ -0,0 +1,273 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include <alloca.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef FU_RT_CHECK
+#include <dlfcn.h>
+#endif
+
+#include "logger.hpp"
+#include "realtime.hpp"
+
+using std::runtime_error;
+using std::string;
+using std::uint64_t;
+using fu::realtime::deadline;
+using fu::realtime::thread_mark;
+using fu::realtime::violation_kind;
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                  Module-local static objects                                  */
+/* --------------------------------------------------------------------------------------------- */
+
+static fu::logger __log("realtime");
+
+// Constant-initialized, so that checks made before (or while) other modules are
+// initialized, e.g. by their allocations, find them ready.
+static thread_local bool        __marked = false;
+static std::atomic<uint64_t>    __violations[fu::realtime::VIOLATION_KINDS];
+static std::atomic<int>         __action(fu::realtime::COUNT_VIOLATIONS);
+
+static const char* const __kind_names[fu::realtime::VIOLATION_KINDS] = {
+    "allocations", "locks", "syscalls"
+};
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                         Thread set-up                                         */
+/* --------------------------------------------------------------------------------------------- */
+
+void fu::realtime::lock_memory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        throw runtime_error(string("mlockall: ") + std::strerror(errno));
+}
+
+__attribute__((noinline))
+void fu::realtime::prefault_stack(std::size_t bytes)
+{
+    const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    volatile char* stack   = static_cast<volatile char*>(alloca(bytes));
+
+    for (std::size_t i = 0; i < bytes; i += page)
+        stack[i] = 0;
+}
+
+void fu::realtime::set_fifo(int priority)
+{
+    if (priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO))
+        throw std::invalid_argument("realtime::set_fifo");
+
+    sched_param param;
+    std::memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+
+    const int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0)
+        throw runtime_error(string("SCHED_FIFO: ") + std::strerror(err));
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                             Checks                                            */
+/* --------------------------------------------------------------------------------------------- */
+
+bool fu::realtime::checking()
+{
+#ifdef FU_RT_CHECK
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool fu::realtime::marked()
+{
+    return __marked;
+}
+
+__attribute__((hot))
+void fu::realtime::violation(violation_kind kind)
+{
+    if (__builtin_expect(!__marked, 1))
+        return;
+
+    __violations[kind].fetch_add(1, std::memory_order_relaxed);
+    if (__action.load(std::memory_order_relaxed) == ABORT_ON_VIOLATION) {
+        __marked = false;
+        std::abort();
+    }
+}
+
+uint64_t fu::realtime::violations(violation_kind kind)
+{
+    return __violations[kind].load(std::memory_order_relaxed);
+}
+
+void fu::realtime::on_violation(violation_action action)
+{
+    __action.store(action, std::memory_order_relaxed);
+}
+
+void fu::realtime::report()
+{
+    for (unsigned k = 0; k < VIOLATION_KINDS; k++) {
+        const uint64_t n = violations(static_cast<violation_kind>(k));
+        FU_LOG(__log, n > 0 ? fu::WARN : fu::INFO) << n << " " << __kind_names[k] << " on real-time threads";
+    }
+    if (!checking())
+        FU_LOG(__log, fu::INFO) << "violations are only detected in builds with FU_RT_CHECK";
+}
+
+thread_mark::thread_mark()
+    : _was_marked(__marked)
+{
+    __marked = true;
+}
+
+thread_mark::~thread_mark()
+{
+    __marked = _was_marked;
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                     fu::realtime::deadline                                    */
+/* --------------------------------------------------------------------------------------------- */
+
+deadline::deadline(const string& name, std::int64_t budget_ns)
+    : _budget(budget_ns),
+      _start(0),
+      _cycles(name + ".cycle_ns"),
+      _misses(name + ".deadline_misses")
+{ }
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                               Interposed functions (FU_RT_CHECK)                              */
+/* --------------------------------------------------------------------------------------------- */
+
+#ifdef FU_RT_CHECK
+
+void* operator new(std::size_t size)
+{
+    fu::realtime::violation(fu::realtime::ALLOCATION);
+
+    void* p;
+    while ((p = std::malloc(size != 0 ? size : 1)) == nullptr) {
+        const std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+    return p;
+}
+
+void* operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try {
+        return ::operator new(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return ::operator new(size, std::nothrow);
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p != nullptr)
+        fu::realtime::violation(fu::realtime::ALLOCATION);
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    ::operator delete(p);
+}
+
+typedef int (*__mutex_lock_fn)(pthread_mutex_t*);
+
+// Resolved before main, or by the first lock if that comes earlier; not a
+// function-local static, whose guard could itself lock.
+static __mutex_lock_fn __real_mutex_lock = nullptr;
+
+static __mutex_lock_fn __resolve_mutex_lock()
+{
+    __mutex_lock_fn fn = __atomic_load_n(&__real_mutex_lock, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(fn == nullptr, 0)) {
+        fn = reinterpret_cast<__mutex_lock_fn>(dlsym(RTLD_NEXT, "pthread_mutex_lock"));
+        if (fn == nullptr)
+            std::abort();
+        __atomic_store_n(&__real_mutex_lock, fn, __ATOMIC_RELEASE);
+    }
+    return fn;
+}
+
+__attribute__((constructor))
+static void __init_mutex_lock()
+{
+    __resolve_mutex_lock();
+}
+
+/**
+ * Counts locks taken by marked threads, then locks. Interposed on the C library
+ * in dynamically linked programs only.
+ */
+extern "C" int pthread_mutex_lock(pthread_mutex_t* mutex)
+{
+    fu::realtime::violation(fu::realtime::LOCK);
+    return __resolve_mutex_lock()(mutex);
+}
+
+#endif
@@ -0,0 +1,218 @@
+// Copyright (c) 2015 André von Kugland
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+
+#ifndef U43888FC9_B4E0_4D13_8DF7_E92FCDEC975B
+#define U43888FC9_B4E0_4D13_8DF7_E92FCDEC975B
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "metrics.hpp"
+
+namespace fu {
+
+    /**
+     * Support for threads with bounded latency, e.g. one driving an audio device.
+     *
+     * Such a thread runs with its memory locked and under SCHED_FIFO, and must
+     * neither allocate, lock nor block; audio::rt_connection links it to the
+     * rest of a pipeline without doing so. A thread declares itself with a
+     * thread_mark; builds with FU_RT_CHECK then count (or abort on) operator
+     * new and delete, pthread_mutex_lock and futex system calls made from
+     * marked threads, so a violation shows up in testing rather than as a
+     * glitch. A deadline counts the cycles exceeding a budget.
+     */
+    namespace realtime {
+
+        /**
+         * Kinds of operations not allowed on marked threads.
+         */
+        enum violation_kind {
+            ALLOCATION = 0,     ///< operator new or delete
+            LOCK       = 1,     ///< pthread_mutex_lock, e.g. std::mutex
+            SYSCALL    = 2,     ///< blocking or waking on a fu::semaphore
+            VIOLATION_KINDS
+        };
+
+        /**
+         * What to do on a violation.
+         */
+        enum violation_action {
+            COUNT_VIOLATIONS,   ///< count it (the default)
+            ABORT_ON_VIOLATION  ///< abort, leaving a core with the offending stack
+        };
+
+        /**
+         * Locks current and future pages of the process in memory.
+         *
+         * @throw std::runtime_error  if not permitted, e.g. by RLIMIT_MEMLOCK.
+         */
+        void lock_memory();
+
+        /**
+         * Touches a number of bytes of stack below the caller, so that the calling
+         * thread takes no page fault there later.
+         */
+        void prefault_stack(std::size_t bytes = 256 * 1024);
+
+        /**
+         * Runs the calling thread under SCHED_FIFO.
+         *
+         * @param priority  priority, from 1 to 99
+         *
+         * @throw std::runtime_error  if not permitted, e.g. by RLIMIT_RTPRIO.
+         */
+        void set_fifo(int priority);
+
+        /**
+         * Returns true if built with FU_RT_CHECK, i.e. violations are detected.
+         */
+        bool checking();
+
+        /**
+         * Returns true if the calling thread is marked.
+         */
+        bool marked();
+
+        /**
+         * Records a violation of a kind if the calling thread is marked. Called by
+         * the checks themselves; never allocates.
+         */
+        void violation(violation_kind kind);
+
+        /**
+         * Returns the number of violations of a kind recorded so far.
+         */
+        std::uint64_t violations(violation_kind kind);
+
+        /**
+         * Sets what to do on later violations.
+         */
+        void on_violation(violation_action action);
+
+        /**
+         * Logs the number of violations of each kind, at WARN if any; from a
+         * thread that is not marked.
+         */
+        void report();
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                               fu::realtime::thread_mark                               */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Marks the calling thread as real-time while alive.
+         */
+        class thread_mark
+        {
+            bool  _was_marked;
+
+        public:
+            thread_mark();
+            ~thread_mark();
+
+            thread_mark(const thread_mark&) = delete;
+            thread_mark& operator=(const thread_mark&) = delete;
+        };
+
+
+        /* ------------------------------------------------------------------------------------- */
+        /*                                 fu::realtime::deadline                                */
+        /* ------------------------------------------------------------------------------------- */
+
+        /**
+         * Times the cycles of a real-time loop against a budget, e.g. the period
+         * of an audio device, into a histogram "<name>.cycle_ns" and a counter
+         * "<name>.deadline_misses". Neither allocates nor locks.
+         */
+        class deadline
+        {
+            std::int64_t        _budget;
+            std::int64_t        _start;
+            metrics::histogram  _cycles;
+            metrics::counter    _misses;
+
+        public:
+            /**
+             * Constructor.
+             *
+             * @param name       prefix of the metrics
+             * @param budget_ns  longest cycle allowed, in ns
+             */
+            deadline(const std::string& name, std::int64_t budget_ns);
+
+            deadline(const deadline&) = delete;
+            deadline& operator=(const deadline&) = delete;
+
+            /**
+             * Returns the budget of a cycle, in ns.
+             */
+            __attribute__((always_inline))
+            inline std::int64_t budget() const
+            {
+                return _budget;
+            }
+
+            /**
+             * Returns the number of cycles over budget so far.
+             */
+            __attribute__((always_inline))
+            inline std::uint64_t misses() const
+            {
+                return _misses.value();
+            }
+
+            /**
+             * Starts a cycle.
+             */
+            __attribute__((always_inline))
+            inline void begin()
+            {
+                _start = metrics::now();
+            }
+
+            /**
+             * Ends a cycle.
+             *
+             * @return  true if the cycle kept within budget, false if it missed.
+             */
+            __attribute__((always_inline, hot))
+            inline bool end()
+            {
+                const std::int64_t elapsed = metrics::now() - _start;
+
+                _cycles.record(static_cast<std::uint64_t>(elapsed));
+                if (__builtin_expect(elapsed > _budget, 0)) {
+                    _misses.add(1);
+                    return false;
+                }
+                return true;
+            }
+        };
+
+    } // namespace realtime
+
+} // namespace fu
+
+#endif
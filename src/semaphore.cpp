@@ -19,27 +19,188 @@
 // DEALINGS IN THE SOFTWARE.
 
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include "semaphore.hpp"
 
+#ifdef FU_RT_CHECK
+#include "realtime.hpp"
+#endif
+
 using std::unique_lock;
 using std::mutex;
 using std::lock_guard;
-using fu::semaphore;
+using fu::mutex_semaphore;
+
 
-semaphore::semaphore(int initial_count)
+/* --------------------------------------------------------------------------------------------- */
+/*                                      fu::mutex_semaphore                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+mutex_semaphore::mutex_semaphore(int initial_count)
     : _count(initial_count)
 { }
 
-void semaphore::wait()
+void mutex_semaphore::wait()
 {
     unique_lock<mutex> lock(_mutex);
     _cv.wait(lock, [=]{ return _count > 0; });
     _count--;
 }
 
-void semaphore::post()
+bool mutex_semaphore::try_wait()
+{
+    lock_guard<mutex> lock(_mutex);
+    if (_count > 0) {
+        _count--;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+int mutex_semaphore::try_wait(int max)
+{
+    lock_guard<mutex> lock(_mutex);
+    const int taken = std::max(0, std::min(_count, max));
+    _count -= taken;
+    return taken;
+}
+
+int mutex_semaphore::value()
+{
+    lock_guard<mutex> lock(_mutex);
+    return _count;
+}
+
+void mutex_semaphore::post()
 {
     lock_guard<mutex> lock(_mutex);
     _count++;
     _cv.notify_one();
 }
+
+void mutex_semaphore::post(int n)
+{
+    if (n <= 0)
+        return;
+
+    lock_guard<mutex> lock(_mutex);
+    _count += n;
+    if (n == 1)
+        _cv.notify_one();
+    else
+        _cv.notify_all();
+}
+
+
+/* --------------------------------------------------------------------------------------------- */
+/*                                      fu::futex_semaphore                                      */
+/* --------------------------------------------------------------------------------------------- */
+
+#ifdef FU_HAVE_FUTEX_SEMAPHORE
+
+using std::memory_order_seq_cst;
+using fu::futex_semaphore;
+
+// Spinning is pointless when there is no other core to post.
+unsigned futex_semaphore::_default_spin_time = std::thread::hardware_concurrency() > 1 ? 10000 : 0;
+
+__attribute__((always_inline))
+inline static void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+__attribute__((always_inline))
+inline static void futex_wait(std::atomic<int>* addr, int expected)
+{
+#ifdef FU_RT_CHECK
+    fu::realtime::violation(fu::realtime::SYSCALL);
+#endif
+    syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+__attribute__((always_inline))
+inline static void futex_wake(std::atomic<int>* addr, int count)
+{
+#ifdef FU_RT_CHECK
+    fu::realtime::violation(fu::realtime::SYSCALL);
+#endif
+    syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+futex_semaphore::futex_semaphore(int initial_count)
+    : _count(initial_count),
+      _waiters(0),
+      _spin_time(_default_spin_time)
+{ }
+
+futex_semaphore::futex_semaphore(int initial_count, unsigned spin_time)
+    : _count(initial_count),
+      _waiters(0),
+      _spin_time(spin_time)
+{ }
+
+__attribute__((hot))
+void futex_semaphore::wait()
+{
+    using std::chrono::steady_clock;
+    using std::chrono::nanoseconds;
+
+    if (__builtin_expect(try_wait(), 1))
+        return;
+
+    if (_spin_time > 0) {
+        const auto deadline = steady_clock::now() + nanoseconds(_spin_time);
+        do {
+            for (int i = 0; i < 64; i++) {
+                cpu_relax();
+                if (try_wait())
+                    return;
+            }
+        } while (steady_clock::now() < deadline);
+    }
+
+    // Announce ourselves before re-checking the count: post increments the count
+    // before reading _waiters, so (both being seq_cst) either we see its increment
+    // or it sees us and wakes the futex.
+    _waiters.fetch_add(1, memory_order_seq_cst);
+    while (!try_wait()) {
+        futex_wait(&_count, 0);
+    }
+    _waiters.fetch_sub(1, memory_order_seq_cst);
+}
+
+__attribute__((hot))
+void futex_semaphore::post()
+{
+    _count.fetch_add(1, memory_order_seq_cst);
+    if (__builtin_expect(_waiters.load(memory_order_seq_cst) > 0, 0)) {
+        futex_wake(&_count, 1);
+    }
+}
+
+__attribute__((hot))
+void futex_semaphore::post(int n)
+{
+    if (n <= 0)
+        return;
+
+    _count.fetch_add(n, memory_order_seq_cst);
+    if (__builtin_expect(_waiters.load(memory_order_seq_cst) > 0, 0)) {
+        futex_wake(&_count, n);
+    }
+}
+
+#endif
@@ -22,15 +22,23 @@
 #ifndef UC770C7A6_2F73_4D76_88FF_1DEF2E242258
 #define UC770C7A6_2F73_4D76_88FF_1DEF2E242258
 
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 
+// The futex-based semaphore is used by default on Linux; define FU_NO_FUTEX
+// to fall back to fu::mutex_semaphore everywhere.
+#if defined(__linux__) && !defined(FU_NO_FUTEX)
+#define FU_HAVE_FUTEX_SEMAPHORE 1
+#endif
+
 namespace fu {
 
     /**
-     * Simple semaphore class, with post and wait operations.
+     * Simple semaphore class, with post and wait operations, built on
+     * std::mutex and std::condition_variable.
      */
-    class semaphore
+    class mutex_semaphore
     {
 
         int                      _count;
@@ -43,20 +51,174 @@ namespace fu {
          *
          * @param  initial_count  initial count, defaults to zero.
          */
-        explicit semaphore(int initial_count = 0);
+        explicit mutex_semaphore(int initial_count = 0);
 
         /**
          * Wait for semaphore.
          */
         void wait();
 
+        /**
+         * Decrements the count if it is positive, without blocking.
+         *
+         * @return  true if the count was decremented, false otherwise.
+         */
+        bool try_wait();
+
+        /**
+         * Decrements the count by as much as it can, up to max, without blocking.
+         *
+         * @return  how much the count was decremented.
+         */
+        int try_wait(int max);
+
+        /**
+         * Returns the current count; only a hint, unless the caller is the only
+         * thread waiting on the semaphore.
+         */
+        int value();
+
         /**
          * Post.
          */
         void post();
 
+        /**
+         * Posts n times at once, waking up to n waiters.
+         */
+        void post(int n);
+
     };
 
+#ifdef FU_HAVE_FUTEX_SEMAPHORE
+
+    /**
+     * Semaphore keeping its count in an atomic. wait spins for a bounded
+     * time and only then parks the thread on a Linux futex; post only
+     * makes a system call when some thread is parked.
+     */
+    class futex_semaphore
+    {
+
+        std::atomic<int>  _count;
+        std::atomic<int>  _waiters;
+        unsigned          _spin_time;
+
+        static unsigned   _default_spin_time;
+
+    public:
+        /**
+         * Initializes semaphore
+         *
+         * @param  initial_count  initial count, defaults to zero.
+         */
+        explicit futex_semaphore(int initial_count = 0);
+
+        /**
+         * Initializes semaphore
+         *
+         * @param  initial_count  initial count.
+         * @param  spin_time      time (ns) to spin before parking.
+         */
+        futex_semaphore(int initial_count, unsigned spin_time);
+
+        futex_semaphore(const futex_semaphore&) = delete;
+        futex_semaphore& operator=(const futex_semaphore&) = delete;
+
+        /**
+         * Wait for semaphore.
+         */
+        void wait();
+
+        /**
+         * Decrements the count if it is positive, without blocking.
+         *
+         * @return  true if the count was decremented, false otherwise.
+         */
+        __attribute__((always_inline, hot))
+        inline bool try_wait()
+        {
+            int count = _count.load(std::memory_order_seq_cst);
+
+            while (count > 0) {
+                if (_count.compare_exchange_weak(count, count - 1, std::memory_order_acquire))
+                    return true;
+            }
+
+            return false;
+        }
+
+        /**
+         * Decrements the count by as much as it can, up to max, without blocking.
+         *
+         * @return  how much the count was decremented.
+         */
+        __attribute__((always_inline, hot))
+        inline int try_wait(int max)
+        {
+            int count = _count.load(std::memory_order_seq_cst);
+
+            while (count > 0) {
+                const int taken = count < max ? count : max;
+                if (_count.compare_exchange_weak(count, count - taken, std::memory_order_acquire))
+                    return taken;
+            }
+
+            return 0;
+        }
+
+        /**
+         * Returns the current count; only a hint, unless the caller is the only
+         * thread waiting on the semaphore.
+         */
+        __attribute__((always_inline))
+        inline int value() const
+        {
+            return _count.load(std::memory_order_acquire);
+        }
+
+        /**
+         * Post.
+         */
+        void post();
+
+        /**
+         * Posts n times at once, making at most one system call.
+         */
+        void post(int n);
+
+        /**
+         * Gets the time (ns) new semaphores spin before parking.
+         *
+         * @return  spin time
+         */
+        __attribute__((always_inline, pure))
+        inline static unsigned default_spin_time()
+        {
+            return _default_spin_time;
+        }
+
+        /**
+         * Sets the time (ns) new semaphores spin before parking.
+         *
+         * @param   spin_time   spin time, zero to park immediately.
+         */
+        __attribute__((always_inline))
+        inline static void default_spin_time(unsigned spin_time)
+        {
+            _default_spin_time = spin_time;
+        }
+
+    };
+
+    typedef futex_semaphore semaphore;
+
+#else
+
+    typedef mutex_semaphore semaphore;
+
+#endif
+
 }
 
 #endif